@@ -0,0 +1,516 @@
+/*
+Batch comparison
+Copyright (C) 2011-2016 Steven Myint, Jeff Terrace
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "batch.h"
+
+#include "compare_args.h"
+#include "difference.h"
+#include "image_view.h"
+#include "metric.h"
+#include "reference.h"
+#include "rgba_image.h"
+#include "stats.h"
+#include "trace.h"
+
+#include <ciso646>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+namespace pdiff
+{
+    // How many decoded pairs may wait to be compared, and how many results
+    // may wait for their difference images to be written. Together they
+    // bound the images the pipeline holds at once.
+    static const auto DECODE_QUEUE_SIZE = size_t(2);
+    static const auto WRITE_QUEUE_SIZE = size_t(4);
+
+
+    // Passes items from one stage of the pipeline to the next. push() waits
+    // while the queue is full and pop() while it is empty.
+    template <typename T>
+    class BoundedQueue
+    {
+    public:
+
+        explicit BoundedQueue(const size_t capacity)
+            : capacity_(capacity), closed_(false)
+        {
+        }
+
+        void push(T item)
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            not_full_.wait(lock,
+                           [this] { return items_.size() < capacity_; });
+            items_.push_back(std::move(item));
+            not_empty_.notify_one();
+        }
+
+        // Returns false once the queue is closed and empty.
+        bool pop(T &item)
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            not_empty_.wait(lock,
+                            [this] { return closed_ or not items_.empty(); });
+            if (items_.empty())
+            {
+                return false;
+            }
+            item = std::move(items_.front());
+            items_.pop_front();
+            not_full_.notify_one();
+            return true;
+        }
+
+        // Called by the producer after its last push().
+        void close()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+            not_empty_.notify_all();
+        }
+
+    private:
+
+        const size_t capacity_;
+        bool closed_;
+        std::deque<T> items_;
+        std::mutex mutex_;
+        std::condition_variable not_full_;
+        std::condition_variable not_empty_;
+    };
+
+
+    // A manifest line with its images decoded, or why they could not be.
+    struct BatchPair
+    {
+        size_t line;
+        std::unique_ptr<CompareArgs> args;
+        std::string error;
+    };
+
+
+    // The outcome of a pair, and its difference outputs if they are to be
+    // written.
+    struct BatchResult
+    {
+        BatchResult()
+            : line(0),
+              passed(false),
+              sum_errors(false),
+              pixels_failed(0),
+              error_sum(0.f),
+              normalized_error_sum(0.),
+              tracer(nullptr)
+        {
+        }
+
+        size_t line;
+        std::string error;
+        std::string image_a;
+        std::string image_b;
+        std::string output;
+        std::string regions;
+        std::string tile_grid;
+        bool passed;
+        std::string reason;
+        bool sum_errors;
+        size_t pixels_failed;
+        float error_sum;
+        double normalized_error_sum;
+        std::shared_ptr<DifferenceOutputs> difference;
+        std::shared_ptr<ComparisonStats> stats;
+        Tracer *tracer;
+    };
+
+
+    // Options that stop the program or start another mode, which a pair
+    // must not use.
+    static bool is_mode_option(const std::string &argument)
+    {
+        const char *const options[] = {"help", "h", "version", "batch",
+                                       "serve", "write-reference",
+                                       "verbose", "trace"};
+        for (const auto option : options)
+        {
+            if (argument == std::string("-") + option or
+                argument == std::string("--") + option)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+
+    // Parses a manifest line and decodes its images. Returns false if the
+    // line is blank or a comment.
+    static bool parse_pair(const std::string &line, const size_t number,
+                           const CompareArgs &args,
+                           const ReferenceLoader &load_reference,
+                           BatchPair &pair)
+    {
+        std::vector<std::string> arguments(1, "perceptualdiff");
+        arguments.insert(arguments.end(), args.pair_options_.begin(),
+                         args.pair_options_.end());
+        const auto first = arguments.size();
+
+        std::istringstream tokens(line);
+        for (std::string token; tokens >> token;)
+        {
+            arguments.push_back(token);
+        }
+        if (arguments.size() == first or arguments[first][0] == '#')
+        {
+            return false;
+        }
+
+        pair.line = number;
+        pair.args.reset();
+        pair.error.clear();
+        for (auto i = first; i < arguments.size(); i++)
+        {
+            if (is_mode_option(arguments[i]))
+            {
+                pair.error = arguments[i] + " can not be used in a manifest";
+                return true;
+            }
+        }
+
+        try
+        {
+            std::vector<char *> argv;
+            for (auto &argument : arguments)
+            {
+                argv.push_back(&argument[0]);
+            }
+            pair.args.reset(new CompareArgs(static_cast<int>(argv.size()),
+                                            &argv[0], load_reference));
+            pair.args->parameters_.tracer = args.parameters_.tracer;
+        }
+        catch (const std::exception &exception)
+        {
+            pair.error = exception.what();
+        }
+        return true;
+    }
+
+
+    static void decode_pairs(std::istream &manifest, const CompareArgs &args,
+                             BoundedQueue<BatchPair> &pairs)
+    {
+        std::string line;
+        for (auto number = size_t(1); std::getline(manifest, line); number++)
+        {
+            BatchPair pair;
+            const TraceScope decoding(args.tracer_.get(),
+                                      get_stage_name(Stage::DECODE));
+            if (parse_pair(line, number, args, ReferenceLoader(), pair))
+            {
+                pairs.push(std::move(pair));
+            }
+        }
+        pairs.close();
+    }
+
+
+    static BatchResult compare_pair(YeeComparator &comparator,
+                                    const BatchPair &pair)
+    {
+        BatchResult result;
+        result.line = pair.line;
+        if (not pair.args)
+        {
+            result.error = pair.error;
+            return result;
+        }
+
+        const auto &args = *pair.args;
+        result.image_a = args.image_a_ ? args.image_a_->get_name()
+                                       : args.reference_file_;
+        result.image_b = args.image_b_->get_name();
+        result.sum_errors = args.sum_errors_;
+        result.stats = args.stats_;
+        result.tracer = args.parameters_.tracer;
+
+        try
+        {
+            // As on the command line, the exact count and error sum are
+            // only worked out when asked for, since the comparison can
+            // otherwise stop early.
+            const auto pixels_failed =
+                args.sum_errors_ ? &result.pixels_failed : nullptr;
+            const auto error_sum =
+                args.sum_errors_ ? &result.error_sum : nullptr;
+            const ImageView image_b(*args.image_b_);
+            const auto difference =
+                args.difference_ ? &args.difference_->get_view() : nullptr;
+            result.passed =
+                args.reference_ ?
+                comparator.compare(*args.reference_, image_b,
+                                   args.parameters_, pixels_failed,
+                                   error_sum, &result.reason, difference) :
+                comparator.compare(ImageView(*args.image_a_), image_b,
+                                   args.parameters_, pixels_failed,
+                                   error_sum, &result.reason, difference);
+        }
+        catch (const std::exception &exception)
+        {
+            result.error = exception.what();
+            return result;
+        }
+
+        result.normalized_error_sum =
+            result.error_sum /
+            (static_cast<double>(args.image_b_->get_width()) *
+             args.image_b_->get_height() * 255.);
+
+        // Difference outputs are only written for failures, as on the
+        // command line.
+        if (not result.passed and args.difference_)
+        {
+            result.difference = args.difference_;
+            result.output = result.difference->get_image_file();
+            result.regions = result.difference->get_regions_file();
+            result.tile_grid = result.difference->get_tile_grid_file();
+        }
+        return result;
+    }
+
+
+    static void write_json_string(std::ostream &output,
+                                  const std::string &value)
+    {
+        output << '"';
+        for (const auto c : value)
+        {
+            if (c == '"' or c == '\\')
+            {
+                output << '\\' << c;
+            }
+            else if (c == '\n')
+            {
+                output << "\\n";
+            }
+            else if (static_cast<unsigned char>(c) < 0x20)
+            {
+                char escaped[8];
+                std::snprintf(escaped, sizeof(escaped), "\\u%04x",
+                              static_cast<unsigned int>(c));
+                output << escaped;
+            }
+            else
+            {
+                output << c;
+            }
+        }
+        output << '"';
+    }
+
+
+    static void write_json_field(std::ostream &output, const char *name,
+                                 const std::string &value)
+    {
+        output << ", \"" << name << "\": ";
+        write_json_string(output, value);
+    }
+
+
+    static std::string to_json(const BatchResult &result)
+    {
+        std::ostringstream json;
+        json.precision(std::numeric_limits<float>::max_digits10);
+
+        json << "{\"line\": " << result.line;
+        if (not result.image_a.empty())
+        {
+            write_json_field(json, "image_a", result.image_a);
+        }
+        if (not result.image_b.empty())
+        {
+            write_json_field(json, "image_b", result.image_b);
+        }
+        if (not result.error.empty())
+        {
+            write_json_field(json, "error", result.error);
+        }
+        if (not result.reason.empty())
+        {
+            json << ", \"passed\": " << (result.passed ? "true" : "false");
+
+            auto reason = result.reason;
+            if (reason.back() == '\n')
+            {
+                reason.pop_back();
+            }
+            write_json_field(json, "reason", reason);
+
+            if (result.sum_errors)
+            {
+                json << ", \"pixels_failed\": " << result.pixels_failed
+                     << ", \"error_sum\": " << result.error_sum
+                     << ", \"normalized_error_sum\": "
+                     << result.normalized_error_sum;
+            }
+        }
+        if (not result.output.empty())
+        {
+            write_json_field(json, "output", result.output);
+        }
+        if (not result.regions.empty())
+        {
+            write_json_field(json, "regions", result.regions);
+        }
+        if (not result.tile_grid.empty())
+        {
+            write_json_field(json, "tile_grid", result.tile_grid);
+        }
+        if (result.stats)
+        {
+            json << ", \"stats\": ";
+            result.stats->write_json(json);
+        }
+        json << "}\n";
+        return json.str();
+    }
+
+
+    static void write_difference(BatchResult &result)
+    {
+        if (result.difference)
+        {
+            // Comparisons go on beside the writer, so it takes one thread.
+            try
+            {
+                const StageTimer timer(result.stats.get(), Stage::OUTPUT,
+                                       result.tracer);
+                const Scheduler writer(1, nullptr, result.tracer);
+                result.difference->write(writer).get();
+            }
+            catch (const std::exception &exception)
+            {
+                result.error = exception.what();
+                result.output.clear();
+                result.regions.clear();
+                result.tile_grid.clear();
+            }
+            result.difference.reset();
+        }
+        if (result.stats)
+        {
+            result.stats->update_peak_rss();
+        }
+    }
+
+
+    static bool write_results(BoundedQueue<BatchResult> &results,
+                              std::ostream &output)
+    {
+        auto all_passed = true;
+        BatchResult result;
+        while (results.pop(result))
+        {
+            write_difference(result);
+
+            // Each line is flushed so that results can be followed while
+            // the batch runs.
+            output << to_json(result) << std::flush;
+            all_passed = all_passed and result.passed and
+                         result.error.empty();
+        }
+        return all_passed;
+    }
+
+
+    bool run_batch(const CompareArgs &args, std::ostream &output)
+    {
+        std::ifstream file;
+        if (args.batch_ != "-")
+        {
+            file.open(args.batch_);
+            if (not file)
+            {
+                throw ParseException("Failed to open the manifest " +
+                                     args.batch_);
+            }
+        }
+        std::istream &manifest = args.batch_ == "-" ? std::cin : file;
+
+        BoundedQueue<BatchPair> pairs(DECODE_QUEUE_SIZE);
+        BoundedQueue<BatchResult> results(WRITE_QUEUE_SIZE);
+
+        std::thread decoder([&] { decode_pairs(manifest, args, pairs); });
+        auto all_passed = true;
+        std::thread writer(
+            [&] { all_passed = write_results(results, output); });
+
+        // One comparator keeps its buffers from pair to pair.
+        YeeComparator comparator;
+        BatchPair pair;
+        while (pairs.pop(pair))
+        {
+            results.push(compare_pair(comparator, pair));
+            pair.args.reset();
+        }
+        results.close();
+
+        decoder.join();
+        writer.join();
+
+        if (args.tracer_)
+        {
+            args.tracer_->write_to_file(args.trace_file_);
+        }
+        return all_passed;
+    }
+
+
+    std::string compare_line(YeeComparator &comparator,
+                             const CompareArgs &args, const std::string &line,
+                             const size_t number,
+                             const ReferenceLoader &load_reference)
+    {
+        BatchPair pair;
+        if (not parse_pair(line, number, args, load_reference, pair))
+        {
+            return "";
+        }
+        auto result = compare_pair(comparator, pair);
+        write_difference(result);
+        return to_json(result);
+    }
+
+
+    std::string error_line(const size_t number, const std::string &message)
+    {
+        BatchResult result;
+        result.line = number;
+        result.error = message;
+        return to_json(result);
+    }
+}
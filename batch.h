@@ -0,0 +1,64 @@
+/*
+Batch comparison
+Copyright (C) 2011-2016 Steven Myint, Jeff Terrace
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef PERCEPTUALDIFF_BATCH_H
+#define PERCEPTUALDIFF_BATCH_H
+
+#include "compare_args.h"
+
+#include <cstddef>
+#include <iosfwd>
+#include <string>
+
+
+namespace pdiff
+{
+    class YeeComparator;
+
+
+    // Compares every pair in the manifest args.batch_ and writes one JSON
+    // object per pair to output, in manifest order.
+    //
+    // Each non-blank line of the manifest that does not start with '#' holds
+    // the arguments of one comparison, separated by white space, as they
+    // would be given on the command line. They follow args.pair_options_,
+    // so they can override them.
+    //
+    // The next pairs are decoded and the previous difference outputs written
+    // on their own threads while a pair is compared.
+    //
+    // Returns true if every pair was compared and passed.
+    bool run_batch(const CompareArgs &args, std::ostream &output);
+
+
+    // Compares the pair on one line of a manifest right away and writes its
+    // difference outputs. Image1 goes through load_reference if it is set.
+    // Returns the JSON result with its newline, or nothing if the line is
+    // blank or a comment.
+    std::string compare_line(YeeComparator &comparator,
+                             const CompareArgs &args, const std::string &line,
+                             size_t number,
+                             const ReferenceLoader &load_reference);
+
+
+    // Returns the JSON result, with its newline, of line number of a
+    // manifest that could not be compared because of message.
+    std::string error_line(size_t number, const std::string &message);
+}
+
+#endif
@@ -0,0 +1,266 @@
+/*
+Color conversion
+Copyright (C) 2006-2011 Yangli Hector Yee
+Copyright (C) 2011-2016 Steven Myint, Jeff Terrace
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "color.h"
+
+#include "parallel.h"
+#include "image_view.h"
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+
+namespace pdiff
+{
+    // The Y row of adobe_rgb_to_xyz(), for when only luminance is needed.
+    static float adobe_rgb_to_y(const float r, const float g, const float b)
+    {
+        return r * 0.297361f  + g * 0.627355f  + b * 0.0752847f;
+    }
+
+
+    // convert Adobe RGB (1998) with reference white D65 to XYZ
+    static void adobe_rgb_to_xyz(const float r, const float g, const float b,
+                                 float &x, float &y, float &z)
+    {
+        // matrix is from http://www.brucelindbloom.com/
+        x = r * 0.576700f  + g * 0.185556f  + b * 0.188212f;
+        y = adobe_rgb_to_y(r, g, b);
+        z = r * 0.0270328f + g * 0.0706879f + b * 0.991248f;
+    }
+
+
+    struct White
+    {
+        White()
+        {
+            adobe_rgb_to_xyz(1.f, 1.f, 1.f, x, y, z);
+        }
+
+        float x;
+        float y;
+        float z;
+    };
+
+
+    static const White global_white;
+
+
+    // Cube root for xyz_to_lab, within one ulp of powf(x, 1.0f / 3.0f) for
+    // the positive inputs it sees. An exponent-dividing bit trick gives a
+    // first guess that two Halley steps refine, the last in double.
+    static float fast_cbrt(const float x)
+    {
+        uint32_t bits;
+        std::memcpy(&bits, &x, sizeof(bits));
+        bits = bits / 3 + 0x2a5137a0u;
+        float guess;
+        std::memcpy(&guess, &bits, sizeof(guess));
+
+        const auto guess3 = guess * guess * guess;
+        const double y = guess * (guess3 + 2.f * x) / (2.f * guess3 + x);
+        const auto y3 = y * y * y;
+        return static_cast<float>(y * (y3 + 2.0 * x) / (2.0 * y3 + x));
+    }
+
+
+    static void xyz_to_lab(const float x, const float y, const float z,
+                           float &l, float &a, float &b)
+    {
+        const float epsilon = 216.0f / 24389.0f;
+        const float kappa = 24389.0f / 27.0f;
+        const float r[] = {
+            x / global_white.x,
+            y / global_white.y,
+            z / global_white.z
+        };
+        float f[3];
+        for (auto i = 0u; i < 3; i++)
+        {
+            if (r[i] > epsilon)
+            {
+                f[i] = fast_cbrt(r[i]);
+            }
+            else
+            {
+                f[i] = (kappa * r[i] + 16.0f) / 116.0f;
+            }
+        }
+        l = 116.0f * f[1] - 16.0f;
+        a = 500.0f * (f[0] - f[1]);
+        b = 200.0f * (f[1] - f[2]);
+    }
+
+
+    GammaTable::GammaTable(const float gamma, const Scheduler &scheduler)
+        : gamma_(gamma), table_(256 * 256), gray_(256 * 3)
+    {
+        scheduler.parallel_for(
+            256, 16, [&](const size_t begin, const size_t end)
+            {
+                for (auto alpha = begin; alpha < end; alpha++)
+                {
+                    const auto scaled_alpha = alpha / 255.f;
+                    for (auto c = 0; c < 256; c++)
+                    {
+                        table_[alpha * 256 + c] =
+                            powf(c / 255.f * scaled_alpha, gamma);
+                    }
+                }
+            });
+
+        const auto linear = get_row(255);
+        for (auto c = 0; c < 256; c++)
+        {
+            float x;
+            float z;
+            float l;
+            adobe_rgb_to_xyz(linear[c], linear[c], linear[c],
+                             x, gray_[c * 3], z);
+            xyz_to_lab(x, gray_[c * 3], z, l, gray_[c * 3 + 1],
+                       gray_[c * 3 + 2]);
+        }
+    }
+
+
+    // Converts a pixel, as RGBAImage stores them, to luminance and CIE
+    // L*a*b* chroma.
+    static void convert_pixel(const unsigned int pixel,
+                              const GammaTable &gamma_table,
+                              const float luminance,
+                              float &lum, float &a, float &b)
+    {
+        // perceptualdiff used to use premultiplied alphas when loading the
+        // image. This is no longer the case since the switch to FreeImage.
+        // We need to do the multiplication here now. As was the case with
+        // premultiplied alphas, differences in alphas won't be detected
+        // where the color is black.
+        const auto linear = gamma_table.get_row(pixel >> 24);
+
+        float x;
+        float y;
+        float z;
+        adobe_rgb_to_xyz(linear[pixel & 0xff],
+                         linear[(pixel >> 8) & 0xff],
+                         linear[(pixel >> 16) & 0xff],
+                         x, y, z);
+        float l;
+        xyz_to_lab(x, y, z, l, a, b);
+
+        lum = y * luminance;
+    }
+
+
+    // Returns true if every pixel in a row is gray and opaque.
+    static bool is_opaque_gray(const unsigned int *const pixels,
+                               const size_t count)
+    {
+        auto differences = 0u;
+        for (auto i = size_t(0); i < count; i++)
+        {
+            const auto pixel = pixels[i];
+            differences |= pixel ^ ((pixel & 0xffu) * 0x010101u | 0xff000000u);
+        }
+        return differences == 0;
+    }
+
+
+    // Converts count pixels, as RGBAImage stores them, into the start of the
+    // planes. Without a and b only the luminance is computed.
+    static void convert_row(const unsigned int *const pixels,
+                            const size_t count,
+                            const GammaTable &gamma_table,
+                            const float luminance,
+                            float *const lum, float *const a, float *const b)
+    {
+        if (not a)
+        {
+            for (auto i = size_t(0); i < count; i++)
+            {
+                const auto pixel = pixels[i];
+                const auto linear = gamma_table.get_row(pixel >> 24);
+                lum[i] = adobe_rgb_to_y(linear[pixel & 0xff],
+                                        linear[(pixel >> 8) & 0xff],
+                                        linear[(pixel >> 16) & 0xff]) *
+                         luminance;
+            }
+            return;
+        }
+
+        // Rows of opaque grays, common in screenshots, are looked up whole.
+        if (is_opaque_gray(pixels, count))
+        {
+            for (auto i = size_t(0); i < count; i++)
+            {
+                const auto gray = gamma_table.get_gray(pixels[i] & 0xff);
+                lum[i] = gray[0] * luminance;
+                a[i] = gray[1];
+                b[i] = gray[2];
+            }
+            return;
+        }
+
+        for (auto i = size_t(0); i < count; i++)
+        {
+            convert_pixel(pixels[i], gamma_table, luminance, lum[i], a[i],
+                          b[i]);
+        }
+    }
+
+
+    void convert_region(const ImageView &image,
+                        const GammaTable &gamma_table,
+                        const float luminance,
+                        const size_t x_begin, const size_t x_end,
+                        const size_t y_begin, const size_t y_end,
+                        float *const lum, float *const a, float *const b,
+                        const Scheduler &scheduler)
+    {
+        const auto region_w = x_end - x_begin;
+
+        scheduler.parallel_for(
+            y_end - y_begin, 16, [&](const size_t begin, const size_t end)
+            {
+                // Rows in other formats are read into RGBAImage's one first.
+                auto &converted = get_thread_buffers().pixels[0];
+                for (auto j = begin; j < end; j++)
+                {
+                    const auto y = static_cast<unsigned int>(y_begin + j);
+                    auto pixels = image.get_rgba_row(y);
+                    if (pixels)
+                    {
+                        pixels += x_begin;
+                    }
+                    else
+                    {
+                        converted.resize(region_w);
+                        image.read_row(y, x_begin, x_end, converted.data());
+                        pixels = converted.data();
+                    }
+
+                    const auto offset = j * region_w;
+                    convert_row(pixels, region_w, gamma_table, luminance,
+                                lum + offset, a ? a + offset : nullptr,
+                                b ? b + offset : nullptr);
+                }
+            });
+    }
+}
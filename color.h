@@ -0,0 +1,90 @@
+/*
+Color conversion
+Copyright (C) 2006-2011 Yangli Hector Yee
+Copyright (C) 2011-2016 Steven Myint, Jeff Terrace
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef PERCEPTUALDIFF_COLOR_H
+#define PERCEPTUALDIFF_COLOR_H
+
+#include <cstddef>
+#include <vector>
+
+
+namespace pdiff
+{
+    class ImageView;
+    class Scheduler;
+
+
+    // Linear light value of every 8-bit channel value at every 8-bit alpha,
+    // built once per comparison for its gamma. Entries are exactly what
+    // powf(c / 255 * alpha / 255, gamma) gives, so lookups replace the
+    // transcendental math per pixel without changing any result.
+    //
+    // It also holds the CIE Y and L*a*b* chroma of every opaque gray, which
+    // are likewise exactly what converting those pixels gives.
+    class GammaTable
+    {
+    public:
+
+        GammaTable(float gamma, const Scheduler &scheduler);
+
+        float get_gamma() const
+        {
+            return gamma_;
+        }
+
+        // Returns the 256 linear values for color channels with this alpha.
+        const float *get_row(const unsigned char alpha) const
+        {
+            return &table_[alpha * 256];
+        }
+
+        // Returns Y, a and b of the opaque gray with this value.
+        const float *get_gray(const unsigned char value) const
+        {
+            return &gray_[value * 3];
+        }
+
+        // Bytes of storage the table holds.
+        size_t get_allocated_bytes() const
+        {
+            return (table_.capacity() + gray_.capacity()) * sizeof(float);
+        }
+
+    private:
+
+        float gamma_;
+        std::vector<float> table_;
+        std::vector<float> gray_;
+    };
+
+
+    // Converts the pixels [x_begin, x_end) x [y_begin, y_end) of an image to
+    // luminance and CIE L*a*b* chroma. They are stored row by row from the
+    // start of each plane. If a and b are null only the luminance is
+    // computed.
+    void convert_region(const ImageView &image,
+                        const GammaTable &gamma_table,
+                        float luminance,
+                        size_t x_begin, size_t x_end,
+                        size_t y_begin, size_t y_end,
+                        float *lum, float *a, float *b,
+                        const Scheduler &scheduler);
+}
+
+#endif
@@ -19,12 +19,15 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include "compare_args.h"
 
+#include "reference.h"
+#include "resample.h"
 #include "rgba_image.h"
 
 #include <cassert>
 #include <ciso646>
 #include <climits>
 #include <cstdlib>
+#include <future>
 #include <iostream>
 #include <stdexcept>
 #include <sstream>
@@ -40,6 +43,7 @@ namespace pdiff
 "\n"
 "Compares image1 and image2 using a perceptually based image metric.\n"
 "Images can be in any FreeImage-supported format: TIF, PNG, etc.\n"
+"PAM, PPM, PGM and raw .pdraw frames are read without FreeImage.\n"
 "\n"
 "Options:\n"
 "  --verbose         Turn on verbose mode\n"
@@ -53,8 +57,43 @@ namespace pdiff
 "  --down-sample     How many powers of two to down sample the image\n"
 "                    (default: 0)\n"
 "  --scale           Scale images to match each other's dimensions\n"
+"  --filter f        Filter for --down-sample and --scale: box, bilinear or\n"
+"                    bicubic (default: bicubic)\n"
+"  --decimated-pyramid\n"
+"                    Store pyramid levels at reduced resolution to save\n"
+"                    memory on large images\n"
+"  --max-memory m    Compare in bands to keep working memory under m\n"
+"                    megabytes (default: no limit)\n"
+"  --fast-masking    Use faster approximations in the masking model\n"
+"  --half-float-pyramid\n"
+"                    Store pyramid levels in half precision to save memory\n"
+"                    and bandwidth\n"
+"  --write-reference r\n"
+"                    Precompute image1 for later comparisons and write it to\n"
+"                    the file r\n"
+"  --reference r     Compare a single image against the reference r written\n"
+"                    by --write-reference with the same options\n"
+"  --threads n       Use at most n threads (default: all)\n"
+"  --batch m         Compare each pair listed in the manifest m, or in the\n"
+"                    standard input if m is -, and print the results as\n"
+"                    JSON lines\n"
+"  --serve s         Serve comparisons on the Unix domain socket s, keeping\n"
+"                    the first image of each pair cached for later ones\n"
+"  --cache-memory m  Cache at most m megabytes of images when serving\n"
+"                    (default: 512)\n"
+"  --connections n   Serve at most n clients at once, and leave others\n"
+"                    waiting to connect (default: 16)\n"
 "  --sum-errors      Print a sum of the luminance and color differences\n"
 "  --output o        Write difference to the file o\n"
+"  --regions r       Write the regions of failing pixels to the file r as\n"
+"                    JSON\n"
+"  --tile-grid g     Write how many pixels failed in each tile to the file g\n"
+"                    as JSON\n"
+"  --tile-size n     Side of the tiles of --tile-grid (default: 64)\n"
+"  --stats json      Print the time and memory each stage took and how many\n"
+"                    pixels were evaluated, as JSON to the standard error\n"
+"  --trace t         Write when each thread worked on each stage to the file\n"
+"                    t, in the Chrome trace event format\n"
 "  --version         Print version\n"
 "\n";
 
@@ -68,12 +107,62 @@ namespace pdiff
     }
 
 
-    CompareArgs::CompareArgs(int argc, char **argv)
+    CompareArgs::CompareArgs(int argc, char **argv,
+                             const ReferenceLoader &load_reference)
         : verbose_(false),
           sum_errors_(false),
-          down_sample_(0)
+          down_sample_(0),
+          resample_filter_(ResampleFilter::BICUBIC),
+          cache_memory_(static_cast<size_t>(512) * 1024 * 1024),
+          connections_(16)
     {
-        parse_args(argc, argv);
+        parse_args(argc, argv, load_reference);
+    }
+
+
+    // Describes a bad argument i, with the reason if there is one.
+    static ParseException argument_error(char **const argv, const int i,
+                                         const std::string &reason="")
+    {
+        return ParseException(
+            "Invalid argument (" + std::string(argv[i]) + ") for " +
+            argv[i - 1] + (reason.empty() ? "" : "; " + reason));
+    }
+
+
+    // Reads the image named by argument i, halved as many times as given.
+    static std::shared_ptr<RGBAImage> read_argument(
+        char **const argv, const int i, const unsigned int halvings,
+        const ResampleFilter filter, const Scheduler &scheduler)
+    {
+        try
+        {
+            return read_from_file(argv[i], halvings, filter, scheduler);
+        }
+        catch (const PerceptualDiffException &exception)
+        {
+            throw argument_error(argv, i, exception.what());
+        }
+        catch (const std::invalid_argument &)
+        {
+            throw argument_error(argv, i);
+        }
+    }
+
+
+    // Returns an image that has the size in the header of argument i but no
+    // pixels, or null if the size is not known without decoding.
+    static std::shared_ptr<RGBAImage> read_header(char **const argv,
+                                                  const int i)
+    {
+        unsigned int width;
+        unsigned int height;
+        if (not read_image_size(argv[i], width, height))
+        {
+            return nullptr;
+        }
+        return std::make_shared<RGBAImage>(
+            width, height, std::shared_ptr<unsigned int>(), argv[i]);
     }
 
 
@@ -89,7 +178,8 @@ namespace pdiff
 #endif
     }
 
-    void CompareArgs::parse_args(const int argc, char **argv)
+    void CompareArgs::parse_args(const int argc, char **argv,
+                                 const ReferenceLoader &load_reference)
     {
         if (argc <= 1)
         {
@@ -98,7 +188,15 @@ namespace pdiff
         }
 
         auto image_count = 0u;
+        int image_indices[2];
+        auto mode_index = 0;
+        auto cache_memory_index = 0;
+        auto connections_index = 0;
+        auto trace_index = 0;
         const char *output_file_name = nullptr;
+        const char *regions_file_name = nullptr;
+        const char *tile_grid_file_name = nullptr;
+        auto tile_size = 64u;
         auto scale = false;
         for (auto i = 1; i < argc; i++)
         {
@@ -185,6 +283,116 @@ namespace pdiff
                 {
                     scale = true;
                 }
+                else if (option_matches(argv[i], "filter"))
+                {
+                    if (++i < argc and
+                        not parse_resample_filter(argv[i], resample_filter_))
+                    {
+                        throw PerceptualDiffException(
+                            "--filter must be box, bilinear or bicubic");
+                    }
+                }
+                else if (option_matches(argv[i], "decimated-pyramid"))
+                {
+                    parameters_.decimated_pyramid = true;
+                }
+                else if (option_matches(argv[i], "max-memory"))
+                {
+                    if (++i < argc)
+                    {
+                        auto temporary = std::stoi(argv[i]);
+                        if (temporary < 0)
+                        {
+                            throw PerceptualDiffException(
+                                "--max-memory must be positive");
+                        }
+                        parameters_.max_memory =
+                            static_cast<size_t>(temporary) * 1024 * 1024;
+                    }
+                }
+                else if (option_matches(argv[i], "fast-masking"))
+                {
+                    parameters_.fast_masking = true;
+                }
+                else if (option_matches(argv[i], "half-float-pyramid"))
+                {
+                    parameters_.half_float_pyramid = true;
+                }
+                else if (option_matches(argv[i], "threads"))
+                {
+                    if (++i < argc)
+                    {
+                        auto temporary = std::stoi(argv[i]);
+                        if (temporary < 0)
+                        {
+                            throw PerceptualDiffException(
+                                "--threads must be positive");
+                        }
+                        parameters_.threads =
+                            static_cast<unsigned int>(temporary);
+                    }
+                }
+                else if (option_matches(argv[i], "batch"))
+                {
+                    if (++i < argc)
+                    {
+                        batch_ = argv[i];
+                        mode_index = i - 1;
+                    }
+                }
+                else if (option_matches(argv[i], "serve"))
+                {
+                    if (++i < argc)
+                    {
+                        serve_ = argv[i];
+                        mode_index = i - 1;
+                    }
+                }
+                else if (option_matches(argv[i], "cache-memory"))
+                {
+                    if (++i < argc)
+                    {
+                        auto temporary = std::stoi(argv[i]);
+                        if (temporary < 0)
+                        {
+                            throw PerceptualDiffException(
+                                "--cache-memory must be positive");
+                        }
+                        cache_memory_ =
+                            static_cast<size_t>(temporary) * 1024 * 1024;
+                        cache_memory_index = i - 1;
+                    }
+                }
+                else if (option_matches(argv[i], "connections"))
+                {
+                    if (++i < argc)
+                    {
+                        auto temporary = std::stoi(argv[i]);
+                        if (temporary <= 0)
+                        {
+                            throw PerceptualDiffException(
+                                "--connections must be positive");
+                        }
+                        connections_ = static_cast<unsigned int>(temporary);
+                        connections_index = i - 1;
+                    }
+                }
+                else if (option_matches(argv[i], "write-reference"))
+                {
+                    if (++i < argc)
+                    {
+                        write_reference_ = argv[i];
+                    }
+                }
+                else if (option_matches(argv[i], "reference"))
+                {
+                    if (++i < argc)
+                    {
+                        reference_ =
+                            std::make_shared<PrecomputedReference>(argv[i]);
+                        reference_file_ = argv[i];
+                    }
+                }
                 else if (option_matches(argv[i], "output"))
                 {
                     if (++i < argc)
@@ -192,25 +400,66 @@ namespace pdiff
                         output_file_name = argv[i];
                     }
                 }
-                else if (option_matches(argv[i], "version"))
+                else if (option_matches(argv[i], "regions"))
                 {
-                    std::cout << "perceptualdiff " << VERSION << "\n";
-                    exit(EXIT_SUCCESS);
+                    if (++i < argc)
+                    {
+                        regions_file_name = argv[i];
+                    }
                 }
-                else if (image_count < 2)
+                else if (option_matches(argv[i], "tile-grid"))
                 {
-                    auto image = read_from_file(argv[i]);
-
-                    ++image_count;
-                    if (image_count == 1)
+                    if (++i < argc)
                     {
-                        image_a_ = image;
+                        tile_grid_file_name = argv[i];
                     }
-                    else
+                }
+                else if (option_matches(argv[i], "tile-size"))
+                {
+                    if (++i < argc)
                     {
-                        image_b_ = image;
+                        auto temporary = std::stoi(argv[i]);
+                        if (temporary <= 0)
+                        {
+                            throw PerceptualDiffException(
+                                "--tile-size must be positive");
+                        }
+                        tile_size = static_cast<unsigned int>(temporary);
                     }
                 }
+                else if (option_matches(argv[i], "stats"))
+                {
+                    if (++i < argc)
+                    {
+                        if (std::string(argv[i]) != "json")
+                        {
+                            throw PerceptualDiffException(
+                                "--stats must be json");
+                        }
+                        stats_ = std::make_shared<ComparisonStats>();
+                        parameters_.stats = stats_.get();
+                    }
+                }
+                else if (option_matches(argv[i], "trace"))
+                {
+                    if (++i < argc)
+                    {
+                        trace_index = i - 1;
+                        trace_file_ = argv[i];
+                        tracer_ = std::make_shared<Tracer>();
+                        parameters_.tracer = tracer_.get();
+                    }
+                }
+                else if (option_matches(argv[i], "version"))
+                {
+                    std::cout << "perceptualdiff " << VERSION << "\n";
+                    exit(EXIT_SUCCESS);
+                }
+                else if (image_count < 2)
+                {
+                    // Read once every option is known.
+                    image_indices[image_count++] = i;
+                }
                 else
                 {
                     std::cerr << "Warning: option/file \"" << argv[i]
@@ -219,51 +468,214 @@ namespace pdiff
             }
             catch (const PerceptualDiffException &exception)
             {
-                std::string reason = "";
-                if (not std::string(exception.what()).empty())
+                throw argument_error(argv, i, exception.what());
+            }
+            catch (const std::invalid_argument &)
+            {
+                throw argument_error(argv, i);
+            }
+        }
+
+        // The pairs of a batch or server come from its manifest or
+        // requests, and every other option is kept to be applied to each of
+        // them.
+        if (not batch_.empty() or not serve_.empty())
+        {
+            if (not batch_.empty() and not serve_.empty())
+            {
+                throw ParseException(
+                    "--batch and --serve can not be used together");
+            }
+            if (image_count > 0)
+            {
+                throw ParseException("Images are taken from the manifest or "
+                                     "requests with --batch and --serve");
+            }
+            if (not write_reference_.empty() or
+                (verbose_ and serve_.empty()))
+            {
+                throw ParseException("--verbose and --write-reference can "
+                                     "not be used with --batch");
+            }
+            if (tracer_ and not serve_.empty())
+            {
+                throw ParseException("--trace can not be used with --serve");
+            }
+            for (auto i = 1; i < argc; i++)
+            {
+                if (i == mode_index or i == cache_memory_index or
+                    i == connections_index or i == trace_index)
                 {
-                    reason = std::string("; ") + exception.what();
+                    i++;
                 }
-                throw ParseException(
-                    "Invalid argument (" + std::string(argv[i]) + ") for " +
-                    argv[i - 1] + reason);
+                else if (not option_matches(argv[i], "verbose"))
+                {
+                    pair_options_.push_back(argv[i]);
+                }
+            }
+            return;
+        }
+
+        // Reading and resizing both images make up the decode stage.
+        const StageTimer decoding(stats_.get(), Stage::DECODE, tracer_.get());
+
+        // Images whose headers show that they differ in size fail the
+        // comparison whatever their pixels, so unless they are to be
+        // resized only their headers are read.
+        const auto compared_as_read =
+            not scale and down_sample_ == 0 and write_reference_.empty();
+        if (compared_as_read and image_count == 2 and not reference_)
+        {
+            const auto header_a = read_header(argv, image_indices[0]);
+            const auto header_b = read_header(argv, image_indices[1]);
+            if (header_a and header_b and
+                (header_a->get_width() != header_b->get_width() or
+                 header_a->get_height() != header_b->get_height()))
+            {
+                image_a_ = header_a;
+                image_b_ = header_b;
             }
-            catch (const std::invalid_argument &exception)
+        }
+        else if (compared_as_read and image_count == 1 and reference_)
+        {
+            const auto header = read_header(argv, image_indices[0]);
+            if (header and
+                (header->get_width() != reference_->get_width() or
+                 header->get_height() != reference_->get_height()))
             {
-                throw ParseException(
-                    "Invalid argument (" + std::string(argv[i]) + ") for " +
-                    argv[i - 1]);
+                image_a_ = header;
             }
         }
 
-        if (not image_a_ or not image_b_)
+        // With --down-sample, images whose sizes are in their headers are
+        // shrunk as they are read, which for some formats skips most of
+        // their pixels. Both are halved as many times as the smaller
+        // allows. An image1 that goes through the loader is shrunk there.
+        const Scheduler scheduler(parameters_.threads, parameters_.executor,
+                                  tracer_.get());
+        auto halvings = down_sample_;
+        auto reduced_on_read = down_sample_ > 0 and not image_a_;
+        for (auto k = 0u; k < image_count and reduced_on_read; k++)
         {
-            std::cerr << "Not enough image files specified\n";
-            exit(EXIT_FAILURE);
+            const auto header = read_header(argv, image_indices[k]);
+            if (header)
+            {
+                halvings = max_halvings(header->get_width(),
+                                        header->get_height(), halvings);
+            }
+            else
+            {
+                reduced_on_read = false;
+            }
         }
+        const auto read_halvings = reduced_on_read ? halvings : 0u;
 
-        for (auto i = 0u; i < down_sample_; i++)
+        // The loader keeps references at the size they are compared at, so
+        // images that are only halved once both are decoded do not go
+        // through it.
+        const auto use_loader = image_count == 2 and load_reference and
+                                (down_sample_ == 0 or reduced_on_read);
+
+        // Image2 is decoded on another thread while image1 is decoded, or
+        // precomputed, on this one.
+        if (image_count > 0 and not image_a_)
         {
-            const auto tmp_a = image_a_->down_sample();
-            const auto tmp_b = image_b_->down_sample();
+            std::future<std::shared_ptr<RGBAImage>> decoding_b;
+            if (image_count == 2)
+            {
+                decoding_b = std::async(
+                    std::launch::async,
+                    [&]()
+                    {
+                        const TraceScope tracing(
+                            tracer_.get(), get_stage_name(Stage::DECODE));
+                        return read_argument(argv, image_indices[1],
+                                             read_halvings, resample_filter_,
+                                             scheduler);
+                    });
+            }
 
-            if (tmp_a and tmp_b)
+            // With two images image1 goes through the loader, which may
+            // have kept it from an earlier comparison.
+            if (use_loader)
             {
-                image_a_ = tmp_a;
-                image_b_ = tmp_b;
+                if (reference_)
+                {
+                    throw ParseException(
+                        "Only one image can be compared against a "
+                        "reference");
+                }
+                reference_file_ = argv[image_indices[0]];
+                reference_ =
+                    load_reference(reference_file_, *this, read_halvings);
             }
             else
             {
-                break;
+                image_a_ = read_argument(argv, image_indices[0],
+                                         read_halvings, resample_filter_,
+                                         scheduler);
             }
 
-            if (verbose_)
+            if (decoding_b.valid())
+            {
+                image_b_ = decoding_b.get();
+            }
+        }
+
+        // The single image is compared against the reference.
+        if (reference_ and not image_b_)
+        {
+            image_b_ = image_a_;
+            image_a_.reset();
+        }
+
+        if (reference_ and image_a_)
+        {
+            throw ParseException(
+                "Only one image can be compared against a reference");
+        }
+        const auto enough_images =
+            write_reference_.empty() ? image_b_ and (image_a_ or reference_)
+                                     : static_cast<bool>(image_a_);
+        if (not enough_images)
+        {
+            throw ParseException("Not enough image files specified");
+        }
+
+        // Otherwise they are halved now, in one step.
+        if (not reduced_on_read)
+        {
+            for (const auto &image : {image_a_, image_b_})
+            {
+                if (image)
+                {
+                    halvings = max_halvings(image->get_width(),
+                                            image->get_height(), halvings);
+                }
+            }
+        }
+        if (halvings > 0 and not reduced_on_read)
+        {
+            for (auto image : {&image_a_, &image_b_})
+            {
+                if (*image)
+                {
+                    *image = resample(**image,
+                                      (*image)->get_width() >> halvings,
+                                      (*image)->get_height() >> halvings,
+                                      resample_filter_, scheduler);
+                }
+            }
+        }
+        if (verbose_)
+        {
+            for (auto i = 0u; i < halvings; i++)
             {
                 std::cout << "Downsampling by " << (1 << (i + 1)) << "\n";
             }
         }
 
-        if (scale and
+        if (scale and image_a_ and image_b_ and
             (image_a_->get_width() != image_b_->get_width() or
              image_a_->get_height() != image_b_->get_height()))
         {
@@ -284,22 +696,24 @@ namespace pdiff
                 std::cout << "Scaling to " << min_width << " x " << min_height
                           << "\n";
             }
-            auto tmp = image_a_->down_sample(min_width, min_height);
-            if (tmp)
-            {
-                image_a_ = tmp;
-            }
-            tmp = image_b_->down_sample(min_width, min_height);
-            if (tmp)
+            for (auto image : {&image_a_, &image_b_})
             {
-                image_b_ = tmp;
+                if ((*image)->get_width() != min_width or
+                    (*image)->get_height() != min_height)
+                {
+                    *image = resample(**image, min_width, min_height,
+                                      resample_filter_, scheduler);
+                }
             }
         }
-        if (output_file_name)
+        if ((output_file_name or regions_file_name or tile_grid_file_name) and
+            image_b_)
         {
-            image_difference_ = std::make_shared<RGBAImage>(image_a_->get_width(),
-                                                            image_a_->get_height(),
-                                                            output_file_name);
+            difference_ = std::make_shared<DifferenceOutputs>(
+                image_b_->get_width(), image_b_->get_height(),
+                output_file_name ? output_file_name : "",
+                regions_file_name ? regions_file_name : "",
+                tile_grid_file_name ? tile_grid_file_name : "", tile_size);
         }
     }
 
@@ -20,28 +20,53 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #ifndef PERCEPTUALDIFF_COMPARE_ARGS_H
 #define PERCEPTUALDIFF_COMPARE_ARGS_H
 
+#include "difference.h"
 #include "exceptions.h"
 #include "metric.h"
+#include "resample.h"
+#include "stats.h"
+#include "trace.h"
 
+#include <functional>
 #include <memory>
 #include <stdexcept>
 #include <string>
+#include <vector>
 
 
 namespace pdiff
 {
+    class CompareArgs;
+    class PrecomputedReference;
+
+
+    // Returns the precomputed form of an image file halved halvings times,
+    // for comparisons with the parameters of args.
+    typedef std::function<std::shared_ptr<PrecomputedReference>(
+        const std::string &filename, const CompareArgs &args,
+        unsigned int halvings)>
+        ReferenceLoader;
+
+
     // Arguments to pass into the comparison function.
     class CompareArgs
     {
     public:
 
-        CompareArgs(int argc, char **argv);
+        // If load_reference is set, image1 is loaded through it into
+        // reference_ instead of being read into image_a_.
+        CompareArgs(int argc, char **argv,
+                    const ReferenceLoader &load_reference=ReferenceLoader());
 
         void print_args() const;
 
         std::shared_ptr<RGBAImage> image_a_;
         std::shared_ptr<RGBAImage> image_b_;
-        std::shared_ptr<RGBAImage> image_difference_;
+
+        // The difference image, failing regions and tile grid to make of
+        // the comparison, if any are asked for.
+        std::shared_ptr<DifferenceOutputs> difference_;
+
         bool verbose_;
 
         // Print a sum of the luminance and color differences of each pixel.
@@ -50,11 +75,48 @@ namespace pdiff
         // How much to down sample image before comparing, in powers of 2.
         unsigned int down_sample_;
 
+        // How images are down sampled or scaled.
+        ResampleFilter resample_filter_;
+
         PerceptualDiffParameters parameters_;
 
+        // What reading the images and comparing them cost, if asked for.
+        // parameters_.stats points to it.
+        std::shared_ptr<ComparisonStats> stats_;
+
+        // The timeline of reading the images and comparing them, to be
+        // written to trace_file_, if asked for. parameters_.tracer points to
+        // it.
+        std::shared_ptr<Tracer> tracer_;
+        std::string trace_file_;
+
+        // Compare image_b_ against this instead of image_a_, if set.
+        std::shared_ptr<PrecomputedReference> reference_;
+        std::string reference_file_;
+
+        // Precompute image_a_ and write it to this file instead of
+        // comparing, if set.
+        std::string write_reference_;
+
+        // Compare the pairs listed in this manifest instead, if set.
+        std::string batch_;
+
+        // Serve comparisons on this Unix domain socket instead, if set,
+        // keeping references in up to cache_memory_ bytes between them and
+        // serving up to connections_ clients at once.
+        std::string serve_;
+        size_t cache_memory_;
+        unsigned int connections_;
+
+        // The options other than --batch and --serve, which apply to every
+        // pair of a batch or server. Each pair is parsed from them followed
+        // by its own arguments.
+        std::vector<std::string> pair_options_;
+
     private:
 
-        void parse_args(int argc, char **argv);
+        void parse_args(int argc, char **argv,
+                        const ReferenceLoader &load_reference);
     };
 
 
@@ -0,0 +1,345 @@
+/*
+Difference outputs
+Copyright (C) 2011-2016 Steven Myint, Jeff Terrace
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "difference.h"
+
+#include "rgba_image.h"
+
+#include <algorithm>
+#include <ciso646>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <ostream>
+#include <sstream>
+
+
+namespace pdiff
+{
+    // Returns row y of a difference image as RGBAImage stores its pixels,
+    // converted into buffer if it has to be.
+    static const unsigned int *read_difference_row(
+        const ImageView &difference, const unsigned int y,
+        std::vector<unsigned int> &buffer)
+    {
+        const auto row = difference.get_rgba_row(y);
+        if (row)
+        {
+            return row;
+        }
+        buffer.resize(difference.get_width());
+        difference.read_row(y, 0, buffer.size(), buffer.data());
+        return buffer.data();
+    }
+
+
+    // Passing pixels are black and failing ones red.
+    static bool failed(const unsigned int pixel)
+    {
+        unsigned char channels[4];
+        std::memcpy(channels, &pixel, sizeof(pixel));
+        return channels[0] != 0 or channels[1] != 0 or channels[2] != 0;
+    }
+
+
+    // Consecutive failing pixels [begin, end) of a row, and the region they
+    // were put in.
+    struct FailingRun
+    {
+        size_t begin;
+        size_t end;
+        size_t label;
+    };
+
+
+    // The rectangle [x_begin, x_end) by [y_begin, y_end) around a region.
+    struct RegionBounds
+    {
+        size_t x_begin;
+        size_t x_end;
+        size_t y_begin;
+        size_t y_end;
+        size_t pixels;
+    };
+
+
+    static size_t find_root(std::vector<size_t> &parents, size_t label)
+    {
+        while (parents[label] != label)
+        {
+            parents[label] = parents[parents[label]];
+            label = parents[label];
+        }
+        return label;
+    }
+
+
+    std::vector<FailingRegion> find_failing_regions(
+        const ImageView &difference)
+    {
+        const auto w = static_cast<size_t>(difference.get_width());
+        const auto h = difference.get_height();
+
+        // Runs of failing pixels are joined to the runs they touch in the
+        // row above. Regions that meet are merged into the one found first.
+        std::vector<size_t> parents;
+        std::vector<RegionBounds> bounds;
+        std::vector<FailingRun> previous;
+        std::vector<FailingRun> current;
+        std::vector<unsigned int> buffer;
+        for (auto y = 0u; y < h; y++)
+        {
+            const auto row = read_difference_row(difference, y, buffer);
+            current.clear();
+            for (auto x = size_t(0); x < w;)
+            {
+                if (not failed(row[x]))
+                {
+                    x++;
+                    continue;
+                }
+                const auto begin = x;
+                while (x < w and failed(row[x]))
+                {
+                    x++;
+                }
+                current.push_back(FailingRun{begin, x, 0});
+            }
+
+            auto above = previous.begin();
+            for (auto &run : current)
+            {
+                // Runs above that end left of this one can not touch it or
+                // any after it.
+                while (above != previous.end() and above->end < run.begin)
+                {
+                    above++;
+                }
+
+                auto label = SIZE_MAX;
+                for (auto touching = above; touching != previous.end() and
+                                            touching->begin <= run.end;
+                     touching++)
+                {
+                    const auto root = find_root(parents, touching->label);
+                    if (label == SIZE_MAX or root == label)
+                    {
+                        label = root;
+                        continue;
+                    }
+
+                    const auto kept = std::min(root, label);
+                    const auto merged = std::max(root, label);
+                    parents[merged] = kept;
+                    auto &into = bounds[kept];
+                    const auto &from = bounds[merged];
+                    into.x_begin = std::min(into.x_begin, from.x_begin);
+                    into.x_end = std::max(into.x_end, from.x_end);
+                    into.y_begin = std::min(into.y_begin, from.y_begin);
+                    into.pixels += from.pixels;
+                    label = kept;
+                }
+                if (label == SIZE_MAX)
+                {
+                    label = parents.size();
+                    parents.push_back(label);
+                    bounds.push_back(
+                        RegionBounds{run.begin, run.end, y, y + 1, 0});
+                }
+
+                auto &region = bounds[label];
+                region.x_begin = std::min(region.x_begin, run.begin);
+                region.x_end = std::max(region.x_end, run.end);
+                region.y_end = y + 1;
+                region.pixels += run.end - run.begin;
+                run.label = label;
+            }
+            previous.swap(current);
+        }
+
+        std::vector<FailingRegion> regions;
+        for (auto label = size_t(0); label < parents.size(); label++)
+        {
+            if (parents[label] == label)
+            {
+                const auto &region = bounds[label];
+                regions.push_back(FailingRegion{
+                    static_cast<unsigned int>(region.x_begin),
+                    static_cast<unsigned int>(region.y_begin),
+                    static_cast<unsigned int>(region.x_end - region.x_begin),
+                    static_cast<unsigned int>(region.y_end - region.y_begin),
+                    region.pixels});
+            }
+        }
+        std::stable_sort(regions.begin(), regions.end(),
+                         [](const FailingRegion &a, const FailingRegion &b)
+                         {
+                             return a.pixels > b.pixels;
+                         });
+        return regions;
+    }
+
+
+    std::vector<size_t> count_tile_failures(const ImageView &difference,
+                                            const unsigned int tile_size,
+                                            const Scheduler &scheduler)
+    {
+        const auto w = static_cast<size_t>(difference.get_width());
+        const auto h = static_cast<size_t>(difference.get_height());
+        const auto columns = (w + tile_size - 1) / tile_size;
+        const auto rows = (h + tile_size - 1) / tile_size;
+        std::vector<size_t> counts(columns * rows);
+
+        // Each task counts one row of tiles.
+        scheduler.parallel_for(
+            rows, 1, [&](const size_t ty, const size_t)
+            {
+                std::vector<unsigned int> buffer;
+                const auto tile_row = &counts[ty * columns];
+                const auto y_end = std::min((ty + 1) * tile_size, h);
+                for (auto y = ty * tile_size; y < y_end; y++)
+                {
+                    const auto row = read_difference_row(
+                        difference, static_cast<unsigned int>(y), buffer);
+                    for (auto x = size_t(0); x < w; x++)
+                    {
+                        if (failed(row[x]))
+                        {
+                            tile_row[x / tile_size]++;
+                        }
+                    }
+                }
+            });
+        return counts;
+    }
+
+
+    void write_regions_json(std::ostream &output, const unsigned int width,
+                            const unsigned int height,
+                            const std::vector<FailingRegion> &regions)
+    {
+        output << "{\"width\": " << width << ", \"height\": " << height
+               << ", \"regions\": [";
+        for (auto i = size_t(0); i < regions.size(); i++)
+        {
+            const auto &region = regions[i];
+            output << (i > 0 ? ", " : "") << "{\"x\": " << region.x
+                   << ", \"y\": " << region.y << ", \"width\": "
+                   << region.width << ", \"height\": " << region.height
+                   << ", \"pixels\": " << region.pixels << "}";
+        }
+        output << "]}\n";
+    }
+
+
+    void write_tile_grid_json(std::ostream &output, const unsigned int width,
+                              const unsigned int height,
+                              const unsigned int tile_size,
+                              const std::vector<size_t> &counts)
+    {
+        const auto columns = (width + tile_size - 1) / tile_size;
+        output << "{\"width\": " << width << ", \"height\": " << height
+               << ", \"tile_size\": " << tile_size << ", \"failures\": [";
+        for (auto i = size_t(0); i < counts.size(); i++)
+        {
+            if (i % columns == 0)
+            {
+                output << (i > 0 ? "], [" : "[");
+            }
+            else
+            {
+                output << ", ";
+            }
+            output << counts[i];
+        }
+        output << (counts.empty() ? "]}\n" : "]]}\n");
+    }
+
+
+    static void save_text(const std::string &filename,
+                          const std::string &text)
+    {
+        std::ofstream file(filename, std::ios::binary);
+        file << text;
+        file.close();
+        if (not file)
+        {
+            throw RGBImageException("Failed to save to '" + filename + "'");
+        }
+    }
+
+
+    DifferenceOutputs::DifferenceOutputs(const unsigned int width,
+                                         const unsigned int height,
+                                         const std::string &image_file,
+                                         const std::string &regions_file,
+                                         const std::string &tile_grid_file,
+                                         const unsigned int tile_size)
+        : image_file_(image_file),
+          regions_file_(regions_file),
+          tile_grid_file_(tile_grid_file),
+          tile_size_(tile_size)
+    {
+        if (not image_file.empty())
+        {
+            image_ = std::make_shared<RGBAImage>(width, height, image_file);
+            view_.reset(new MutableImageView(*image_));
+        }
+        else
+        {
+            mask_.resize(static_cast<size_t>(width) * height);
+            view_.reset(new MutableImageView(mask_.data(), width, height,
+                                             width, PixelFormat::GRAY));
+        }
+    }
+
+
+    std::future<void> DifferenceOutputs::write(
+        const Scheduler &scheduler) const
+    {
+        auto encoding = std::async(image_ ? std::launch::async
+                                          : std::launch::deferred,
+                                   [this]
+                                   {
+                                       if (image_)
+                                       {
+                                           image_->write_to_file(image_file_);
+                                       }
+                                   });
+
+        const auto width = view_->get_width();
+        const auto height = view_->get_height();
+        if (not regions_file_.empty())
+        {
+            std::ostringstream json;
+            write_regions_json(json, width, height,
+                               find_failing_regions(*view_));
+            save_text(regions_file_, json.str());
+        }
+        if (not tile_grid_file_.empty())
+        {
+            std::ostringstream json;
+            write_tile_grid_json(
+                json, width, height, tile_size_,
+                count_tile_failures(*view_, tile_size_, scheduler));
+            save_text(tile_grid_file_, json.str());
+        }
+        return encoding;
+    }
+}
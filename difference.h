@@ -0,0 +1,136 @@
+/*
+Difference outputs
+Copyright (C) 2011-2016 Steven Myint, Jeff Terrace
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef PERCEPTUALDIFF_DIFFERENCE_H
+#define PERCEPTUALDIFF_DIFFERENCE_H
+
+#include "image_view.h"
+#include "parallel.h"
+
+#include <cstddef>
+#include <future>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <vector>
+
+
+namespace pdiff
+{
+    class RGBAImage;
+
+
+    // Pixels that failed and touch each other at an edge or a corner, and
+    // the rectangle around them.
+    struct FailingRegion
+    {
+        unsigned int x;
+        unsigned int y;
+        unsigned int width;
+        unsigned int height;
+        size_t pixels;
+    };
+
+
+    // Finds the regions of failing pixels in a difference image, where a
+    // pixel failed if its red channel is not 0. The largest come first, and
+    // those of the same size in the order of their first rows.
+    std::vector<FailingRegion> find_failing_regions(
+        const ImageView &difference);
+
+
+    // Counts the failing pixels in each square tile of a difference image,
+    // a row of tiles at a time. Tiles at the right and bottom edges may be
+    // cut short.
+    std::vector<size_t> count_tile_failures(
+        const ImageView &difference, unsigned int tile_size,
+        const Scheduler &scheduler=Scheduler());
+
+
+    // Writes regions as a JSON object, with the size of the image they were
+    // found in.
+    void write_regions_json(std::ostream &output, unsigned int width,
+                            unsigned int height,
+                            const std::vector<FailingRegion> &regions);
+
+
+    // Writes the counts of count_tile_failures() as a JSON object, with
+    // the tile size and a list of counts per row of tiles.
+    void write_tile_grid_json(std::ostream &output, unsigned int width,
+                              unsigned int height, unsigned int tile_size,
+                              const std::vector<size_t> &counts);
+
+
+    // What is made of the failing pixels of a comparison, each written to
+    // a file of its own: a difference image, a list of failing regions and
+    // a grid of failures per tile. Only the outputs that are given a file
+    // are made. Without a difference image, failures are marked in a byte
+    // per pixel instead of a full image.
+    class DifferenceOutputs
+    {
+    public:
+
+        DifferenceOutputs(unsigned int width, unsigned int height,
+                          const std::string &image_file,
+                          const std::string &regions_file,
+                          const std::string &tile_grid_file,
+                          unsigned int tile_size);
+
+        // Where the comparison marks the pixels that fail.
+        const MutableImageView &get_view() const
+        {
+            return *view_;
+        }
+
+        const std::string &get_image_file() const
+        {
+            return image_file_;
+        }
+
+        const std::string &get_regions_file() const
+        {
+            return regions_file_;
+        }
+
+        const std::string &get_tile_grid_file() const
+        {
+            return tile_grid_file_;
+        }
+
+        // Starts encoding the difference image on another thread, then
+        // writes the regions and tiles. Returns the encoding, whose get()
+        // waits for the image to be saved and throws if it was not. The
+        // outputs must outlive it.
+        std::future<void> write(const Scheduler &scheduler=Scheduler()) const;
+
+    private:
+
+        DifferenceOutputs(const DifferenceOutputs &);
+        DifferenceOutputs &operator=(const DifferenceOutputs &);
+
+        const std::string image_file_;
+        const std::string regions_file_;
+        const std::string tile_grid_file_;
+        const unsigned int tile_size_;
+        std::shared_ptr<RGBAImage> image_;
+        std::vector<unsigned char> mask_;
+        std::unique_ptr<MutableImageView> view_;
+    };
+}
+
+#endif
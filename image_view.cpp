@@ -0,0 +1,166 @@
+/*
+Image views
+Copyright (C) 2011-2016 Steven Myint, Jeff Terrace
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "image_view.h"
+
+#include "rgba_image.h"
+
+#include <FreeImage.h>
+
+#include <algorithm>
+#include <ciso646>
+#include <cstring>
+
+
+namespace pdiff
+{
+    size_t pixel_size(const PixelFormat format)
+    {
+        if (format == PixelFormat::GRAY)
+        {
+            return 1;
+        }
+        return format == PixelFormat::RGB ? 3 : 4;
+    }
+
+
+    PixelFormat get_rgba_image_format()
+    {
+        return FI_RGBA_RED == 0 ? PixelFormat::RGBA : PixelFormat::BGRA;
+    }
+
+
+    ImageView::ImageView(const void *const data, const unsigned int width,
+                         const unsigned int height, const ptrdiff_t stride,
+                         const PixelFormat format)
+        : data_(static_cast<const unsigned char *>(data)),
+          width_(width),
+          height_(height),
+          stride_(stride),
+          format_(format)
+    {
+    }
+
+
+    ImageView::ImageView(const RGBAImage &image)
+        : data_(reinterpret_cast<const unsigned char *>(image.get_data())),
+          width_(image.get_width()),
+          height_(image.get_height()),
+          stride_(static_cast<ptrdiff_t>(image.get_width() *
+                                         sizeof(unsigned int))),
+          format_(get_rgba_image_format())
+    {
+    }
+
+
+    void ImageView::read_row(const unsigned int y, const size_t x_begin,
+                             const size_t x_end,
+                             unsigned int *const pixels) const
+    {
+        const auto row = get_row(y);
+        const auto count = x_end - x_begin;
+        const auto output = reinterpret_cast<unsigned char *>(pixels);
+        if (format_ == get_rgba_image_format())
+        {
+            std::memcpy(pixels, row + x_begin * 4, count * 4);
+        }
+        else if (format_ == PixelFormat::RGBA or format_ == PixelFormat::BGRA)
+        {
+            // The other order of the two swaps red and blue.
+            const auto input = row + x_begin * 4;
+            for (auto i = size_t(0); i < count * 4; i += 4)
+            {
+                output[i] = input[i + 2];
+                output[i + 1] = input[i + 1];
+                output[i + 2] = input[i];
+                output[i + 3] = input[i + 3];
+            }
+        }
+        else if (format_ == PixelFormat::GRAY)
+        {
+            const auto gray = row + x_begin;
+            for (auto i = size_t(0); i < count; i++)
+            {
+                const auto pixel = output + i * 4;
+                pixel[FI_RGBA_RED] = gray[i];
+                pixel[FI_RGBA_GREEN] = gray[i];
+                pixel[FI_RGBA_BLUE] = gray[i];
+                pixel[FI_RGBA_ALPHA] = 255;
+            }
+        }
+        else
+        {
+            const auto rgb = row + x_begin * 3;
+            for (auto i = size_t(0); i < count; i++)
+            {
+                const auto pixel = output + i * 4;
+                pixel[FI_RGBA_RED] = rgb[i * 3];
+                pixel[FI_RGBA_GREEN] = rgb[i * 3 + 1];
+                pixel[FI_RGBA_BLUE] = rgb[i * 3 + 2];
+                pixel[FI_RGBA_ALPHA] = 255;
+            }
+        }
+    }
+
+
+    MutableImageView::MutableImageView(void *const data,
+                                       const unsigned int width,
+                                       const unsigned int height,
+                                       const ptrdiff_t stride,
+                                       const PixelFormat format)
+        : ImageView(data, width, height, stride, format),
+          mutable_data_(static_cast<unsigned char *>(data))
+    {
+    }
+
+
+    MutableImageView::MutableImageView(RGBAImage &image)
+        : ImageView(image),
+          mutable_data_(reinterpret_cast<unsigned char *>(image.get_data()))
+    {
+    }
+
+
+    void MutableImageView::set(const unsigned int x, const unsigned int y,
+                               const unsigned char r, const unsigned char g,
+                               const unsigned char b,
+                               const unsigned char a) const
+    {
+        const auto format = get_format();
+        const auto row = mutable_data_ + (get_row(y) - get_row(0));
+        if (format == PixelFormat::RGB)
+        {
+            const auto pixel = row + x * 3;
+            pixel[0] = r;
+            pixel[1] = g;
+            pixel[2] = b;
+            return;
+        }
+        if (format == PixelFormat::GRAY)
+        {
+            row[x] = std::max(std::max(r, g), b);
+            return;
+        }
+
+        const auto pixel = row + x * 4;
+        pixel[0] = format == PixelFormat::RGBA ? r : b;
+        pixel[1] = g;
+        pixel[2] = format == PixelFormat::RGBA ? b : r;
+        pixel[3] = a;
+    }
+}
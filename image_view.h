@@ -0,0 +1,136 @@
+/*
+Image views
+Copyright (C) 2011-2016 Steven Myint, Jeff Terrace
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef PERCEPTUALDIFF_IMAGE_VIEW_H
+#define PERCEPTUALDIFF_IMAGE_VIEW_H
+
+#include <cstddef>
+
+
+namespace pdiff
+{
+    class RGBAImage;
+
+
+    // Layouts of pixels with 8-bit channels, named after the order of their
+    // bytes in memory. RGB pixels are opaque, and GRAY pixels are one opaque
+    // gray byte, which is enough to mark where a comparison failed.
+    enum class PixelFormat
+    {
+        RGBA,
+        BGRA,
+        RGB,
+        GRAY
+    };
+
+
+    // Bytes per pixel of a format.
+    size_t pixel_size(PixelFormat format);
+
+
+    // The format RGBAImage stores its pixels in, which is FreeImage's: BGRA
+    // on little-endian machines and RGBA on big-endian ones. Views in other
+    // formats are converted to it as they are compared, so a view of the
+    // pixels of a file compares the same as the file.
+    PixelFormat get_rgba_image_format();
+
+
+    // Pixels in memory that the caller owns, such as a frame buffer. Rows
+    // are stride bytes apart, which may be more than the width takes, or
+    // negative for images stored bottom up with data pointing at the top
+    // row. RGBA and BGRA rows must start on 4-byte boundaries.
+    //
+    // A view does not copy the pixels, which must outlive it.
+    class ImageView
+    {
+    public:
+
+        ImageView(const void *data, unsigned int width, unsigned int height,
+                  ptrdiff_t stride, PixelFormat format);
+
+        // Views all of an image.
+        ImageView(const RGBAImage &image);
+
+        unsigned int get_width() const
+        {
+            return width_;
+        }
+
+        unsigned int get_height() const
+        {
+            return height_;
+        }
+
+        PixelFormat get_format() const
+        {
+            return format_;
+        }
+
+        const unsigned char *get_row(const unsigned int y) const
+        {
+            return data_ + static_cast<ptrdiff_t>(y) * stride_;
+        }
+
+        // Returns row y as RGBAImage stores its pixels if it already is,
+        // or null.
+        const unsigned int *get_rgba_row(const unsigned int y) const
+        {
+            return format_ == get_rgba_image_format()
+                ? reinterpret_cast<const unsigned int *>(get_row(y))
+                : nullptr;
+        }
+
+        // Copies pixels [x_begin, x_end) of row y to pixels, as RGBAImage
+        // stores them.
+        void read_row(unsigned int y, size_t x_begin, size_t x_end,
+                      unsigned int *pixels) const;
+
+    private:
+
+        const unsigned char *data_;
+        unsigned int width_;
+        unsigned int height_;
+        ptrdiff_t stride_;
+        PixelFormat format_;
+    };
+
+
+    // A view of caller owned pixels that can be written, such as the buffer
+    // a difference image goes to.
+    class MutableImageView : public ImageView
+    {
+    public:
+
+        MutableImageView(void *data, unsigned int width, unsigned int height,
+                         ptrdiff_t stride, PixelFormat format);
+
+        // Views all of an image.
+        MutableImageView(RGBAImage &image);
+
+        // Sets pixel (x, y). RGB pixels drop the alpha, and GRAY pixels
+        // keep the brightest of r, g and b.
+        void set(unsigned int x, unsigned int y, unsigned char r,
+                 unsigned char g, unsigned char b, unsigned char a) const;
+
+    private:
+
+        unsigned char *mutable_data_;
+    };
+}
+
+#endif
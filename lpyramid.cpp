@@ -19,81 +19,718 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include "lpyramid.h"
 
+#include "parallel.h"
+
 #include <algorithm>
 #include <cassert>
 #include <ciso646>
 #include <cstddef>
+#include <cstring>
+#include <thread>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define PERCEPTUALDIFF_SSE
+#endif
 
 
 namespace pdiff
 {
-    LPyramid::LPyramid(const std::vector<float> &image,
-                       const unsigned int width, const unsigned int height)
-        : width_(width), height_(height)
+    static const float kernel[] = {0.05f, 0.25f, 0.4f, 0.25f, 0.05f};
+
+
+    // Mirrors an out-of-range coordinate back into [0, n). Negative
+    // coordinates are reflected about the first sample and coordinates past
+    // the end about the last boundary, which is what the original 5x5 loop
+    // did. The clamp only matters for images narrower than the kernel.
+    static ptrdiff_t mirror(ptrdiff_t i, const ptrdiff_t n)
     {
-        // Make the Laplacian pyramid by successively
-        // copying the earlier levels and blurring them
-        for (auto i = 0u; i < MAX_PYR_LEVELS; i++)
+        i = std::max(i, -i);
+        if (i >= n)
+        {
+            i = 2 * n - i - 1;
+        }
+        return std::min(std::max(i, ptrdiff_t(0)), n - 1);
+    }
+
+
+    // Vertical pass over one row: out[x] is the kernel applied to column x of
+    // the five rows centered on the current one. Rows are already mirrored by
+    // the caller, so there is no branching here.
+    static void convolve_column(float *const out, const float *const rows[5],
+                                const size_t width)
+    {
+        auto x = size_t(0);
+#if defined(__AVX__)
+        const auto k0 = _mm256_set1_ps(kernel[0]);
+        const auto k1 = _mm256_set1_ps(kernel[1]);
+        const auto k2 = _mm256_set1_ps(kernel[2]);
+        const auto k3 = _mm256_set1_ps(kernel[3]);
+        const auto k4 = _mm256_set1_ps(kernel[4]);
+        for (; x + 8 <= width; x += 8)
+        {
+            auto acc = _mm256_mul_ps(k0, _mm256_loadu_ps(rows[0] + x));
+            acc = _mm256_add_ps(
+                acc, _mm256_mul_ps(k1, _mm256_loadu_ps(rows[1] + x)));
+            acc = _mm256_add_ps(
+                acc, _mm256_mul_ps(k2, _mm256_loadu_ps(rows[2] + x)));
+            acc = _mm256_add_ps(
+                acc, _mm256_mul_ps(k3, _mm256_loadu_ps(rows[3] + x)));
+            acc = _mm256_add_ps(
+                acc, _mm256_mul_ps(k4, _mm256_loadu_ps(rows[4] + x)));
+            _mm256_storeu_ps(out + x, acc);
+        }
+#elif defined(PERCEPTUALDIFF_SSE)
+        const auto k0 = _mm_set1_ps(kernel[0]);
+        const auto k1 = _mm_set1_ps(kernel[1]);
+        const auto k2 = _mm_set1_ps(kernel[2]);
+        const auto k3 = _mm_set1_ps(kernel[3]);
+        const auto k4 = _mm_set1_ps(kernel[4]);
+        for (; x + 4 <= width; x += 4)
+        {
+            auto acc = _mm_mul_ps(k0, _mm_loadu_ps(rows[0] + x));
+            acc = _mm_add_ps(acc, _mm_mul_ps(k1, _mm_loadu_ps(rows[1] + x)));
+            acc = _mm_add_ps(acc, _mm_mul_ps(k2, _mm_loadu_ps(rows[2] + x)));
+            acc = _mm_add_ps(acc, _mm_mul_ps(k3, _mm_loadu_ps(rows[3] + x)));
+            acc = _mm_add_ps(acc, _mm_mul_ps(k4, _mm_loadu_ps(rows[4] + x)));
+            _mm_storeu_ps(out + x, acc);
+        }
+#endif
+        for (; x < width; x++)
+        {
+            auto acc = kernel[0] * rows[0][x];
+            acc += kernel[1] * rows[1][x];
+            acc += kernel[2] * rows[2][x];
+            acc += kernel[3] * rows[3][x];
+            acc += kernel[4] * rows[4][x];
+            out[x] = acc;
+        }
+    }
+
+
+    static float convolve_row_at(const float *const in, const ptrdiff_t x,
+                                 const ptrdiff_t width)
+    {
+        auto acc = kernel[0] * in[mirror(x - 2, width)];
+        acc += kernel[1] * in[mirror(x - 1, width)];
+        acc += kernel[2] * in[mirror(x, width)];
+        acc += kernel[3] * in[mirror(x + 1, width)];
+        acc += kernel[4] * in[mirror(x + 2, width)];
+        return acc;
+    }
+
+
+    // Horizontal pass over one row. Only the two pixels at each end need
+    // mirroring; they are peeled off so the interior runs without branches.
+    static void convolve_row(float *const out, const float *const in,
+                             const size_t width)
+    {
+        const auto w = static_cast<ptrdiff_t>(width);
+        const auto edge = std::min(ptrdiff_t(2), w);
+
+        for (auto x = ptrdiff_t(0); x < edge; x++)
+        {
+            out[x] = convolve_row_at(in, x, w);
+        }
+
+        auto x = edge;
+#if defined(__AVX__)
+        const auto k0 = _mm256_set1_ps(kernel[0]);
+        const auto k1 = _mm256_set1_ps(kernel[1]);
+        const auto k2 = _mm256_set1_ps(kernel[2]);
+        const auto k3 = _mm256_set1_ps(kernel[3]);
+        const auto k4 = _mm256_set1_ps(kernel[4]);
+        for (; x + 8 <= w - 2; x += 8)
+        {
+            auto acc = _mm256_mul_ps(k0, _mm256_loadu_ps(in + x - 2));
+            acc = _mm256_add_ps(
+                acc, _mm256_mul_ps(k1, _mm256_loadu_ps(in + x - 1)));
+            acc = _mm256_add_ps(
+                acc, _mm256_mul_ps(k2, _mm256_loadu_ps(in + x)));
+            acc = _mm256_add_ps(
+                acc, _mm256_mul_ps(k3, _mm256_loadu_ps(in + x + 1)));
+            acc = _mm256_add_ps(
+                acc, _mm256_mul_ps(k4, _mm256_loadu_ps(in + x + 2)));
+            _mm256_storeu_ps(out + x, acc);
+        }
+#elif defined(PERCEPTUALDIFF_SSE)
+        const auto k0 = _mm_set1_ps(kernel[0]);
+        const auto k1 = _mm_set1_ps(kernel[1]);
+        const auto k2 = _mm_set1_ps(kernel[2]);
+        const auto k3 = _mm_set1_ps(kernel[3]);
+        const auto k4 = _mm_set1_ps(kernel[4]);
+        for (; x + 4 <= w - 2; x += 4)
+        {
+            auto acc = _mm_mul_ps(k0, _mm_loadu_ps(in + x - 2));
+            acc = _mm_add_ps(acc, _mm_mul_ps(k1, _mm_loadu_ps(in + x - 1)));
+            acc = _mm_add_ps(acc, _mm_mul_ps(k2, _mm_loadu_ps(in + x)));
+            acc = _mm_add_ps(acc, _mm_mul_ps(k3, _mm_loadu_ps(in + x + 1)));
+            acc = _mm_add_ps(acc, _mm_mul_ps(k4, _mm_loadu_ps(in + x + 2)));
+            _mm_storeu_ps(out + x, acc);
+        }
+#endif
+        for (; x < w - 2; x++)
+        {
+            auto acc = kernel[0] * in[x - 2];
+            acc += kernel[1] * in[x - 1];
+            acc += kernel[2] * in[x];
+            acc += kernel[3] * in[x + 1];
+            acc += kernel[4] * in[x + 2];
+            out[x] = acc;
+        }
+
+        for (x = std::max(x, w - 2); x < w; x++)
+        {
+            out[x] = convolve_row_at(in, x, w);
+        }
+    }
+
+
+    // Converts to IEEE half precision, rounding to nearest even. Values past
+    // the largest half saturate there; the pyramid holds no infinities or
+    // NaNs. This matches the F16C instructions bit for bit below 65520 in
+    // magnitude only: from there on they round to infinity, which would
+    // turn the contrasts of a bright level into NaNs, where this keeps
+    // 65504.
+    static inline uint16_t float_to_half(const float value)
+    {
+        uint32_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        const auto sign = (bits >> 16) & 0x8000u;
+        bits &= 0x7fffffffu;
+
+        // 65504, and 2^-14, the smallest normal half.
+        const auto half_max_bits = uint32_t(0x477fe000);
+        const auto half_min_normal_bits = uint32_t(113) << 23;
+        if (bits >= half_max_bits)
+        {
+            return static_cast<uint16_t>(sign | 0x7bffu);
+        }
+        if (bits < half_min_normal_bits)
+        {
+            // Adding 0.5 lines the denormal half's bits up with the bottom
+            // of the float mantissa and lets the FPU do the rounding.
+            const auto magic_bits = uint32_t(126) << 23;
+            float magic;
+            float f;
+            std::memcpy(&magic, &magic_bits, sizeof(magic));
+            std::memcpy(&f, &bits, sizeof(f));
+            f += magic;
+            std::memcpy(&bits, &f, sizeof(bits));
+            return static_cast<uint16_t>(sign | (bits - magic_bits));
+        }
+        const auto odd = (bits >> 13) & 1u;
+        bits += (uint32_t(15 - 127) << 23) + 0xfffu + odd;
+        return static_cast<uint16_t>(sign | (bits >> 13));
+    }
+
+
+    // Widens a half precision value. Moving the exponent and mantissa into
+    // place and scaling by 2^112 rebias the exponent, and turns denormal
+    // halves into the normal floats they stand for.
+    static inline float half_to_float(const uint16_t half)
+    {
+        const uint32_t bits = (half & 0x7fffu) << 13;
+        float f;
+        std::memcpy(&f, &bits, sizeof(f));
+        f *= 5.192296858534828e33f;
+        return (half & 0x8000u) ? -f : f;
+    }
+
+
+    static inline float widen(const float value)
+    {
+        return value;
+    }
+
+
+    static inline float widen(const uint16_t value)
+    {
+        return half_to_float(value);
+    }
+
+
+    // The first level that decimated pyramids store at half resolution.
+    // Level i is the original blurred i times, a Gaussian with a standard
+    // deviation of about 0.95 * sqrt(i) pixels. From level 2 on that is wide
+    // enough to sample every other pixel; lower levels alias visibly.
+    static const auto FIRST_DECIMATED_LEVEL = 2u;
+
+
+    // Where the samples of a level blurred without a full plane are stored:
+    // every 2^shift-th sample of every 2^shift-th row, in halves if they are
+    // set and in floats otherwise.
+    struct ReducedLevel
+    {
+        float *floats;
+        uint16_t *halves;
+        unsigned int shift;
+    };
+
+
+    // Blurs rows [begin, end) of the levels from first on, each from the
+    // level before it, starting from the full plane of level first - 1.
+    // Rows of a level are blurred in order and only the last five are kept,
+    // which are all the next level reads of it; each is stored as it is
+    // blurred. Every level also blurs two rows of context on each side more
+    // than the level above it, which neighbouring ranges blur again.
+    class StripBlur
+    {
+    public:
+
+        // rows has room for 5 * (MAX_PYR_LEVELS - first) + 1 rows.
+        StripBlur(const float *const base, const ReducedLevel *const levels,
+                  const unsigned int first, const size_t width,
+                  const ptrdiff_t height, const ptrdiff_t begin,
+                  const ptrdiff_t end, float *const rows)
+            : base_(base), levels_(levels), first_(first), width_(width),
+              height_(height), begin_(begin), end_(end), rows_(rows)
         {
-            if (i == 0 or width * height <= 1)
+            for (auto i = first; i < MAX_PYR_LEVELS; i++)
             {
-                levels_[i] = image;
+                const auto context =
+                    static_cast<ptrdiff_t>(2 * (MAX_PYR_LEVELS - 1 - i));
+                next_[i] = std::max(begin - context, ptrdiff_t(0));
+                last_[i] = std::min(end + context, height) - 1;
+            }
+        }
+
+        void run()
+        {
+            advance(MAX_PYR_LEVELS - 1, last_[MAX_PYR_LEVELS - 1]);
+        }
+
+    private:
+
+        StripBlur(const StripBlur &);
+        StripBlur &operator=(const StripBlur &);
+
+        // The kept row y of a level.
+        float *row(const unsigned int level, const ptrdiff_t y) const
+        {
+            const auto slot = static_cast<size_t>(y % 5);
+            return rows_ + ((level - first_) * 5 + slot) * width_;
+        }
+
+        // Blurs the rows of a level up to row last.
+        void advance(const unsigned int level, const ptrdiff_t last)
+        {
+            for (; next_[level] <= last; next_[level]++)
+            {
+                const auto y = next_[level];
+                const float *rows[5];
+                if (level == first_)
+                {
+                    for (auto j = 0; j < 5; j++)
+                    {
+                        rows[j] = base_ + mirror(y + j - 2, height_) * width_;
+                    }
+                }
+                else
+                {
+                    advance(level - 1, std::min(y + 2, last_[level - 1]));
+                    for (auto j = 0; j < 5; j++)
+                    {
+                        rows[j] = row(level - 1, mirror(y + j - 2, height_));
+                    }
+                }
+
+                const auto column =
+                    rows_ + (MAX_PYR_LEVELS - first_) * 5 * width_;
+                convolve_column(column, rows, width_);
+                const auto out = row(level, y);
+                convolve_row(out, column, width_);
+                store(levels_[level], y, out);
+            }
+        }
+
+        // Stores the samples of row y a level keeps, if it is in the range.
+        void store(const ReducedLevel &level, const ptrdiff_t y,
+                   const float *const row) const
+        {
+            const auto step = size_t(1) << level.shift;
+            if (y < begin_ or y >= end_ or static_cast<size_t>(y) % step)
+            {
+                return;
+            }
+            const auto stored_w = (width_ + step - 1) >> level.shift;
+            const auto offset =
+                (static_cast<size_t>(y) >> level.shift) * stored_w;
+            if (level.halves)
+            {
+                for (auto x = size_t(0); x < stored_w; x++)
+                {
+                    level.halves[offset + x] = float_to_half(row[x * step]);
+                }
             }
             else
             {
-                levels_[i].resize(static_cast<size_t>(width_) * height_);
-                convolve(levels_[i], levels_[i - 1]);
+                for (auto x = size_t(0); x < stored_w; x++)
+                {
+                    level.floats[offset + x] = row[x * step];
+                }
             }
         }
+
+        const float *const base_;
+        const ReducedLevel *const levels_;
+        const unsigned int first_;
+        const size_t width_;
+        const ptrdiff_t height_;
+        const ptrdiff_t begin_;
+        const ptrdiff_t end_;
+        float *const rows_;
+
+        // The next row to blur and the last row needed of each level.
+        ptrdiff_t next_[MAX_PYR_LEVELS];
+        ptrdiff_t last_[MAX_PYR_LEVELS];
+    };
+
+
+    LPyramid::LPyramid(std::vector<float> image,
+                       const unsigned int width, const unsigned int height,
+                       const bool decimated, const bool half_float,
+                       const Scheduler &scheduler)
+        : width_(0), height_(0), decimated_(decimated), half_float_(half_float)
+    {
+        rebuild(image, width, height, scheduler);
     }
 
-    // Convolves image b with the filter kernel and stores it in a.
-    void LPyramid::convolve(std::vector<float> &a,
-                            const std::vector<float> &b) const
+    LPyramid::LPyramid(const void *const levels[MAX_PYR_LEVELS],
+                       const unsigned int width, const unsigned int height,
+                       const bool decimated, const bool half_float)
+        : width_(width), height_(height), decimated_(decimated),
+          half_float_(half_float)
     {
-        assert(a.size() > 1);
-        assert(b.size() > 1);
+        const auto dim = static_cast<size_t>(width) * height;
+        for (auto i = 0u; i < MAX_PYR_LEVELS; i++)
+        {
+            level_data_[i] = levels[i];
+            level_shift_[i] =
+                dim > 1 and decimated and i >= FIRST_DECIMATED_LEVEL ? 1 : 0;
+        }
+    }
 
-        #pragma omp parallel for shared(a, b)
-        for (auto y = 0; y < static_cast<ptrdiff_t>(height_); y++)
+    size_t LPyramid::level_bytes(const unsigned int level,
+                                 const unsigned int width,
+                                 const unsigned int height,
+                                 const bool decimated,
+                                 const bool half_float)
+    {
+        const auto sample_bytes = half_float and level > 0 ? sizeof(uint16_t)
+                                                           : sizeof(float);
+        const auto dim = static_cast<size_t>(width) * height;
+        if (dim <= 1 or not decimated or level < FIRST_DECIMATED_LEVEL)
+        {
+            return dim * sample_bytes;
+        }
+        return static_cast<size_t>((width + 1) / 2) * ((height + 1) / 2) *
+               sample_bytes;
+    }
+
+    void LPyramid::rebuild(std::vector<float> &image,
+                           const unsigned int width, const unsigned int height,
+                           const Scheduler &scheduler)
+    {
+        LPyramid *const pyramids[] = {this};
+        std::vector<float> *const images[] = {&image};
+        rebuild_all(pyramids, images, 1, width, height, scheduler);
+    }
+
+    void LPyramid::rebuild_pair(LPyramid &a, std::vector<float> &image_a,
+                                LPyramid &b, std::vector<float> &image_b,
+                                const unsigned int width,
+                                const unsigned int height,
+                                const Scheduler &scheduler)
+    {
+        LPyramid *const pyramids[] = {&a, &b};
+        std::vector<float> *const images[] = {&image_a, &image_b};
+        rebuild_all(pyramids, images, 2, width, height, scheduler);
+    }
+
+    // Rebuilds each pyramid from its image. The pyramids have the same
+    // settings, and every loop blurs the same level of all of them.
+    void LPyramid::rebuild_all(LPyramid *const pyramids[],
+                               std::vector<float> *const images[],
+                               const size_t count,
+                               const unsigned int width,
+                               const unsigned int height,
+                               const Scheduler &scheduler)
+    {
+        const auto dim = static_cast<size_t>(width) * height;
+        for (auto p = size_t(0); p < count; p++)
         {
-            for (auto x = 0u; x < width_; x++)
+            auto &pyramid = *pyramids[p];
+            assert(images[p]->size() == dim);
+            assert(pyramid.decimated_ == pyramids[0]->decimated_ and
+                   pyramid.half_float_ == pyramids[0]->half_float_);
+
+            pyramid.width_ = width;
+            pyramid.height_ = height;
+
+            // Make the Laplacian pyramid by successively
+            // copying the earlier levels and blurring them
+            pyramid.levels_[0].swap(*images[p]);
+            pyramid.level_shift_[0] = 0;
+
+            if (dim <= 1)
+            {
+                for (auto i = 1u; i < MAX_PYR_LEVELS; i++)
+                {
+                    pyramid.levels_[i] = pyramid.levels_[0];
+                    pyramid.store_half(pyramid.half_levels_[i],
+                                       pyramid.levels_[0], 0, scheduler);
+                    pyramid.level_shift_[i] = 0;
+                }
+            }
+        }
+
+        if (dim > 1)
+        {
+            // Levels kept at full resolution in single precision are blurred
+            // from the one before them a plane at a time. The rest are
+            // blurred together and reduced as they are stored.
+            const auto first_reduced =
+                pyramids[0]->half_float_ ? 1u
+                : pyramids[0]->decimated_ ? FIRST_DECIMATED_LEVEL
+                                          : MAX_PYR_LEVELS;
+            for (auto i = 1u; i < first_reduced; i++)
             {
-                const auto index = y * width_ + x;
-                auto result = 0.0f;
-                for (auto i = -2; i <= 2; i++)
+                for (auto p = size_t(0); p < count; p++)
                 {
-                    for (auto j = -2; j <= 2; j++)
+                    pyramids[p]->level_shift_[i] = 0;
+                    pyramids[p]->levels_[i].resize(dim);
+                }
+                convolve(pyramids, count, i, scheduler);
+            }
+            if (first_reduced < MAX_PYR_LEVELS)
+            {
+                blur_reduced(pyramids, count, first_reduced, scheduler);
+            }
+        }
+
+        for (auto p = size_t(0); p < count; p++)
+        {
+            auto &pyramid = *pyramids[p];
+            for (auto i = 0u; i < MAX_PYR_LEVELS; i++)
+            {
+                pyramid.level_data_[i] =
+                    pyramid.half_float_ and i > 0
+                        ? static_cast<const void *>(
+                              pyramid.half_levels_[i].data())
+                        : pyramid.levels_[i].data();
+            }
+        }
+    }
+
+    // Convolves level - 1 of each pyramid with the filter kernel and stores
+    // it in level.
+    //
+    // The 5x5 kernel is separable, so this runs a vertical pass into a row
+    // buffer followed by a horizontal pass into the output row. The result
+    // differs from the direct 25-tap sum only in summation order (a few ulp).
+    void LPyramid::convolve(LPyramid *const pyramids[], const size_t count,
+                            const unsigned int level,
+                            const Scheduler &scheduler)
+    {
+        const auto w = static_cast<size_t>(pyramids[0]->width_);
+        const auto h = static_cast<ptrdiff_t>(pyramids[0]->height_);
+        const auto grain = size_t(16);
+        const auto tasks = Scheduler::task_count(pyramids[0]->height_, grain);
+
+        // Each task blurs rows of one pyramid.
+        scheduler.parallel_for(
+            count * tasks, 1, [&](const size_t task, const size_t)
+            {
+                const auto &b = pyramids[task / tasks]->levels_[level - 1];
+                auto &a = pyramids[task / tasks]->levels_[level];
+                const auto begin = (task % tasks) * grain;
+                const auto end = std::min(begin + grain, size_t(h));
+
+                auto &column = get_thread_buffers().floats;
+                column.resize(w);
+                for (auto y = static_cast<ptrdiff_t>(begin);
+                     y < static_cast<ptrdiff_t>(end); y++)
+                {
+                    const float *rows[5];
+                    for (auto j = 0; j < 5; j++)
                     {
-                        int nx = x + i;
-                        int ny = y + j;
-                        nx = std::max(nx, -nx);
-                        ny = std::max(ny, -ny);
-                        if (nx >= static_cast<long>(width_))
-                        {
-                            nx = 2 * width_ - nx - 1;
-                        }
-                        if (ny >= static_cast<long>(height_))
-                        {
-                            ny = 2 * height_ - ny - 1;
-                        }
-
-                        const float kernel[] = {0.05f, 0.25f, 0.4f, 0.25f, 0.05f};
-
-                        result +=
-                            kernel[i + 2] * kernel[j + 2] * b[ny * width_ + nx];
+                        rows[j] = &b[mirror(y + j - 2, h) * w];
                     }
+                    convolve_column(&column[0], rows, w);
+                    convolve_row(&a[y * w], &column[0], w);
+                }
+            });
+    }
+
+    // Blurs the levels of each pyramid from first on out of the full
+    // resolution level before them, and stores each at its own resolution
+    // and precision without a full resolution plane in single precision for
+    // any of them.
+    void LPyramid::blur_reduced(LPyramid *const pyramids[],
+                                const size_t count, const unsigned int first,
+                                const Scheduler &scheduler)
+    {
+        const auto width = pyramids[0]->width_;
+        const auto height = pyramids[0]->height_;
+        const auto w = static_cast<size_t>(width);
+        std::vector<ReducedLevel> reduced(count * MAX_PYR_LEVELS);
+        for (auto p = size_t(0); p < count; p++)
+        {
+            auto &pyramid = *pyramids[p];
+            for (auto i = first; i < MAX_PYR_LEVELS; i++)
+            {
+                const auto shift =
+                    pyramid.decimated_ and i >= FIRST_DECIMATED_LEVEL ? 1u
+                                                                      : 0u;
+                const auto step = size_t(1) << shift;
+                const auto stored = ((w + step - 1) >> shift) *
+                                    ((height + step - 1) >> shift);
+                pyramid.level_shift_[i] = shift;
+
+                auto &level = reduced[p * MAX_PYR_LEVELS + i];
+                level.shift = shift;
+                level.floats = nullptr;
+                level.halves = nullptr;
+                if (pyramid.half_float_)
+                {
+                    pyramid.half_levels_[i].resize(stored);
+                    level.halves = pyramid.half_levels_[i].data();
+                }
+                else
+                {
+                    pyramid.levels_[i].resize(stored);
+                    level.floats = pyramid.levels_[i].data();
                 }
-                a[index] = result;
             }
         }
+
+        // Ranges blur 4 rows of context per level below the top again, so
+        // they are kept long enough for that to be a small part of their
+        // work while leaving a few per thread. Their length is even, so
+        // each sample of a decimated level falls in exactly one.
+        auto threads = scheduler.get_thread_count();
+        if (threads == 0)
+        {
+            threads = std::max(std::thread::hardware_concurrency(), 1u);
+        }
+        const auto grain = std::min(
+            std::max((height / (4 * threads) + 1) & ~1u, 16u), 128u);
+        const auto tasks = Scheduler::task_count(height, grain);
+
+        // Each task blurs a range of rows of one pyramid.
+        const auto levels = MAX_PYR_LEVELS - first;
+        const auto h = static_cast<ptrdiff_t>(height);
+        scheduler.parallel_for(
+            count * tasks, 1, [&](const size_t task, const size_t)
+            {
+                const auto p = task / tasks;
+                const auto begin = (task % tasks) * grain;
+                const auto end = std::min(begin + grain, size_t(height));
+
+                auto &rows = get_thread_buffers().floats;
+                rows.resize((5 * levels + 1) * w);
+                StripBlur strip(pyramids[p]->levels_[first - 1].data(),
+                                &reduced[p * MAX_PYR_LEVELS], first, w, h,
+                                static_cast<ptrdiff_t>(begin),
+                                static_cast<ptrdiff_t>(end), rows.data());
+                strip.run();
+            });
+    }
+
+    // Stores b in half precision in a, every other sample of it if shift is
+    // 1.
+    void LPyramid::store_half(std::vector<uint16_t> &a,
+                              const std::vector<float> &b,
+                              const unsigned int shift,
+                              const Scheduler &scheduler) const
+    {
+        const auto w = static_cast<size_t>(width_);
+        const auto step = size_t(1) << shift;
+        const auto stored_w = (w + step - 1) >> shift;
+        const auto stored_h = (height_ + step - 1) >> shift;
+        a.resize(stored_w * stored_h);
+
+        scheduler.parallel_for(
+            stored_h, 32, [&](const size_t begin, const size_t end)
+            {
+                for (auto y = begin; y < end; y++)
+                {
+                    const auto row = &b[y * step * w];
+                    for (auto x = size_t(0); x < stored_w; x++)
+                    {
+                        a[y * stored_w + x] = float_to_half(row[x * step]);
+                    }
+                }
+            });
+    }
+
+    // Reads a pixel of a level stored with samples of type T.
+    template <typename T>
+    static float sample(const T *const plane,
+                        const unsigned int x, const unsigned int y,
+                        const unsigned int width, const unsigned int height,
+                        const unsigned int shift)
+    {
+        if (shift == 0)
+        {
+            const auto index = x + static_cast<size_t>(y) * width;
+            return widen(plane[index]);
+        }
+
+        // Sample i of a decimated level sits on full resolution coordinate
+        // 2 * i, so interpolate bilinearly between the neighbours.
+        const auto half_w = (width + 1) / 2;
+        const auto half_h = (height + 1) / 2;
+        const auto x0 = x / 2;
+        const auto y0 = y / 2;
+        const auto x1 = std::min(x0 + 1, half_w - 1);
+        const auto y1 = std::min(y0 + 1, half_h - 1);
+        const auto tx = (x % 2) * 0.5f;
+        const auto ty = (y % 2) * 0.5f;
+
+        const auto row0 = static_cast<size_t>(y0) * half_w;
+        const auto row1 = static_cast<size_t>(y1) * half_w;
+        const auto p00 = widen(plane[row0 + x0]);
+        const auto p01 = widen(plane[row0 + x1]);
+        const auto p10 = widen(plane[row1 + x0]);
+        const auto p11 = widen(plane[row1 + x1]);
+        const auto top = p00 + (p01 - p00) * tx;
+        const auto bottom = p10 + (p11 - p10) * tx;
+        return top + (bottom - top) * ty;
     }
 
     float LPyramid::get_value(const unsigned int x, const unsigned int y,
                               const unsigned int level) const
     {
-        const auto index = x + y * width_;
         assert(level < MAX_PYR_LEVELS);
-        return levels_[level][index];
+        if (half_float_ and level > 0)
+        {
+            return sample(static_cast<const uint16_t *>(level_data_[level]),
+                          x, y, width_, height_, level_shift_[level]);
+        }
+        return sample(static_cast<const float *>(level_data_[level]), x, y,
+                      width_, height_, level_shift_[level]);
+    }
+
+    const void *LPyramid::get_level(const unsigned int level) const
+    {
+        assert(level < MAX_PYR_LEVELS);
+        return level_data_[level];
+    }
+
+
+    size_t LPyramid::get_allocated_bytes() const
+    {
+        auto bytes = size_t(0);
+        for (auto i = 0u; i < MAX_PYR_LEVELS; i++)
+        {
+            bytes += levels_[i].capacity() * sizeof(float) +
+                     half_levels_[i].capacity() * sizeof(uint16_t);
+        }
+        return bytes;
     }
 }
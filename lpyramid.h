@@ -20,6 +20,10 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #ifndef PERCEPTUALDIFF_LPYRAMID_H
 #define PERCEPTUALDIFF_LPYRAMID_H
 
+#include "parallel.h"
+
+#include <cstddef>
+#include <cstdint>
 #include <vector>
 
 
@@ -35,21 +39,111 @@ namespace pdiff
     {
     public:
 
-        LPyramid(const std::vector<float> &image,
+        // The image becomes level 0, so callers that no longer need it can
+        // move it in.
+        //
+        // When decimated is set, levels from 2 on are stored at half
+        // resolution in each dimension and get_value() interpolates them.
+        // This cuts the pyramid from MAX_PYR_LEVELS full planes to 3.5 at the
+        // cost of small interpolation differences.
+        //
+        // When half_float is set, levels from 1 on are blurred in single
+        // precision but stored as IEEE half precision floats, which
+        // get_value() widens again. This halves the memory they take and the
+        // bandwidth of reading them, at a relative error of at most 2^-11.
+        // Values beyond the half range saturate at 65504 on purpose, where
+        // a conversion with the F16C instructions would give infinity. Level
+        // 0 is the image itself and stays as it is.
+        LPyramid(std::vector<float> image,
+                 unsigned int width,
+                 unsigned int height,
+                 bool decimated=false,
+                 bool half_float=false,
+                 const Scheduler &scheduler=Scheduler());
+
+        // Wraps levels stored elsewhere, such as in a mapped file, without
+        // copying them. Level i takes level_bytes(i, ...) bytes and must
+        // outlive the pyramid.
+        LPyramid(const void *const levels[MAX_PYR_LEVELS],
                  unsigned int width,
-                 unsigned int height);
+                 unsigned int height,
+                 bool decimated,
+                 bool half_float);
+
+        // Rebuilds the pyramid from another image, reusing the level storage.
+        // The image is swapped with level 0, so on return it holds the old
+        // level 0 for the caller to fill again.
+        void rebuild(std::vector<float> &image,
+                     unsigned int width,
+                     unsigned int height,
+                     const Scheduler &scheduler);
+
+        // Rebuilds two pyramids with the same settings from images of the
+        // same size, like rebuild(). Both are blurred in the same parallel
+        // loops, so threads left idle by one take on the other.
+        static void rebuild_pair(LPyramid &a, std::vector<float> &image_a,
+                                 LPyramid &b, std::vector<float> &image_b,
+                                 unsigned int width,
+                                 unsigned int height,
+                                 const Scheduler &scheduler);
 
         float get_value(unsigned int x, unsigned int y, unsigned int level) const;
 
+        // The stored samples of a level, level_bytes() of them.
+        const void *get_level(unsigned int level) const;
+
+        // Bytes of storage the pyramid holds for its levels, whether they
+        // are in use or kept for a later rebuild. Levels stored elsewhere
+        // are not counted.
+        size_t get_allocated_bytes() const;
+
+        // Size in bytes of a level of a pyramid of this size.
+        static size_t level_bytes(unsigned int level,
+                                  unsigned int width,
+                                  unsigned int height,
+                                  bool decimated,
+                                  bool half_float);
+
     private:
 
-        void convolve(std::vector<float> &a, const std::vector<float> &b) const;
+        LPyramid(const LPyramid &);
+        LPyramid &operator=(const LPyramid &);
+
+        static void rebuild_all(LPyramid *const pyramids[],
+                                std::vector<float> *const images[],
+                                size_t count,
+                                unsigned int width,
+                                unsigned int height,
+                                const Scheduler &scheduler);
+
+        static void convolve(LPyramid *const pyramids[], size_t count,
+                             unsigned int level, const Scheduler &scheduler);
+
+        static void blur_reduced(LPyramid *const pyramids[], size_t count,
+                                 unsigned int first,
+                                 const Scheduler &scheduler);
+
+        void store_half(std::vector<uint16_t> &a, const std::vector<float> &b,
+                        unsigned int shift, const Scheduler &scheduler) const;
 
         // Successively blurred versions of the original image.
         std::vector<float> levels_[MAX_PYR_LEVELS];
 
+        // Levels from 1 on in half precision, when half_float_ is set.
+        // levels_ then only holds level 0.
+        std::vector<uint16_t> half_levels_[MAX_PYR_LEVELS];
+
+        // Where each level is read from: levels_ or half_levels_, or
+        // external storage.
+        const void *level_data_[MAX_PYR_LEVELS];
+
+        // Level i is stored at 1 / 2^level_shift_[i] of the full resolution.
+        unsigned int level_shift_[MAX_PYR_LEVELS];
+
         unsigned int width_;
         unsigned int height_;
+        bool decimated_;
+        bool half_float_;
     };
 }
 
@@ -0,0 +1,333 @@
+/*
+Masking
+Copyright (C) 2006-2011 Yangli Hector Yee
+Copyright (C) 2011-2016 Steven Myint, Jeff Terrace
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "masking.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+
+namespace pdiff
+{
+#if _MSC_VER <= 1800
+    static const auto pi = 3.14159265f;
+
+
+    static float to_radians(const float degrees)  // LCOV_EXCL_LINE
+    {
+      return degrees * pi / 180.f;  // LCOV_EXCL_LINE
+    }
+
+
+    static float to_degrees(const float radians)  // LCOV_EXCL_LINE
+    {
+      return radians * 180.f / pi;  // LCOV_EXCL_LINE
+    }
+#else
+    constexpr auto pi = 3.14159265f;
+
+
+    constexpr float to_radians(const float degrees)  // LCOV_EXCL_LINE
+    {
+        return degrees * pi / 180.f;  // LCOV_EXCL_LINE
+    }
+
+
+    constexpr float to_degrees(const float radians)  // LCOV_EXCL_LINE
+    {
+        return radians * 180.f / pi;  // LCOV_EXCL_LINE
+    }
+#endif
+
+    // Given the adaptation luminance, this function returns the
+    // threshold of visibility in cd per m^2.
+    //
+    // TVI means Threshold vs Intensity function.
+    // This version comes from Ward Larson Siggraph 1997.
+    //
+    // Returns the threshold luminance given the adaptation luminance.
+    // Units are candelas per meter squared.
+    static float tvi(const float adaptation_luminance)
+    {
+        const auto log_a = log10f(adaptation_luminance);
+
+        float r;
+        if (log_a < -3.94f)
+        {
+            r = -2.86f;
+        }
+        else if (log_a < -1.44f)
+        {
+            r = powf(0.405f * log_a + 1.6f, 2.18f) - 2.86f;
+        }
+        else if (log_a < -0.0184f)
+        {
+            r = log_a - 0.395f;
+        }
+        else if (log_a < 1.9f)
+        {
+            r = powf(0.249f * log_a + 0.65f, 2.7f) - 0.72f;
+        }
+        else
+        {
+            r = log_a - 1.255f;
+        }
+
+        return powf(10.0f, r);
+    }
+
+
+    // computes the contrast sensitivity function (Barten SPIE 1989)
+    // given the cycles per degree (cpd) and luminance (lum)
+    static float csf(const float cpd, const float lum)
+    {
+        const auto a = 440.f * powf((1.f + 0.7f / lum), -0.2f);
+        const auto b = 0.3f * powf((1.0f + 100.0f / lum), 0.15f);
+
+        return a * cpd * expf(-b * cpd) * sqrtf(1.0f + 0.06f * expf(b * cpd));
+    }
+
+
+    /*
+    * Visual Masking Function
+    * from Daly 1993
+    */
+    static float mask(const float contrast)
+    {
+        const auto a = powf(392.498f * contrast, 0.7f);
+        const auto b = powf(0.0153f * a, 4.f);
+        return powf(1.0f + b, 0.25f);
+    }
+
+
+    static unsigned int adaptation(const float num_one_degree_pixels)
+    {
+        auto num_pixels = 1.f;
+        auto adaptation_level = 0u;
+        for (auto i = 0u; i < MAX_PYR_LEVELS; i++)
+        {
+            adaptation_level = i;
+            if (num_pixels > num_one_degree_pixels)
+            {
+                break;
+            }
+            num_pixels *= 2;
+        }
+        return adaptation_level;  // LCOV_EXCL_LINE
+    }
+
+
+    MaskingModel::MaskingModel(const float field_of_view, const size_t width)
+    {
+        const auto num_one_degree_pixels =
+            to_degrees(2 * std::tan(field_of_view * to_radians(.5f)));
+        const auto pixels_per_degree = width / num_one_degree_pixels;
+
+        adaptation_level = adaptation(num_one_degree_pixels);
+
+        cpd[0] = 0.5f * pixels_per_degree;
+        for (auto i = 1u; i < MAX_PYR_LEVELS; i++)
+        {
+            cpd[i] = 0.5f * cpd[i - 1];
+        }
+        const auto csf_max = csf(3.248f, 100.0f);
+
+        static_assert(MAX_PYR_LEVELS > 2,
+                      "MAX_PYR_LEVELS must be greater than 2");
+
+        for (auto i = 0u; i < MAX_PYR_LEVELS - 2; i++)
+        {
+            f_freq[i] = csf_max / csf(cpd[i], 100.0f);
+        }
+    }
+
+
+    static void mask_pixel(const MaskingModel &model, MaskingBlock &block,
+                           const size_t k)
+    {
+        const auto adapt = block.adapt[k];
+
+        auto sum_contrast = 0.f;
+        auto factor = 0.f;
+
+        for (auto i = 0u; i < MAX_PYR_LEVELS - 2; i++)
+        {
+            const auto contrast = block.contrast[i][k];
+            const auto f_mask = mask(contrast * csf(model.cpd[i], adapt));
+            factor += contrast * model.f_freq[i] * f_mask;
+            sum_contrast += contrast;
+        }
+        sum_contrast = std::max(sum_contrast, 1e-5f);
+        factor /= sum_contrast;
+        block.factor[k] = std::min(std::max(factor, 1.f), 10.f);
+        block.tvi[k] = tvi(adapt);
+    }
+
+
+    void mask_block(const MaskingModel &model, MaskingBlock &block,
+                    const size_t n)
+    {
+        for (auto k = size_t(0); k < n; k++)
+        {
+            mask_pixel(model, block, k);
+        }
+    }
+
+
+    // The approximations below are written without branches or calls so
+    // that the compiler can run them across the pixels of a block.
+
+    // Base 2 logarithm of the magnitude of a float. The mantissa is
+    // normalized to [sqrt(1/2), sqrt(2)) and its logarithm taken from the
+    // atanh series. The sign is ignored so that unused branches stay finite.
+    static inline float fast_log2(const float x)
+    {
+        int32_t bits;
+        std::memcpy(&bits, &x, sizeof(bits));
+        bits &= 0x7fffffff;
+        const int32_t exponent = (bits - 0x3f3504f3) >> 23;
+        const int32_t mantissa_bits = bits - exponent * (1 << 23);
+        float m;
+        std::memcpy(&m, &mantissa_bits, sizeof(m));
+
+        const auto t = (m - 1.f) / (m + 1.f);
+        const auto t2 = t * t;
+        const auto series =
+            2.88539008f +
+            t2 * (0.961796694f +
+                  t2 * (0.577078016f + t2 * (0.412198583f +
+                                             t2 * 0.320598898f)));
+        return static_cast<float>(exponent) + t * series;
+    }
+
+
+    // 2 to the power x, clamped to the normal float range. The fractional
+    // part in [-0.5, 0.5] goes through a degree 7 Taylor polynomial.
+    static inline float fast_exp2(float x)
+    {
+        x = std::min(std::max(x, -126.f), 126.f);
+        // Rounds to nearest; the offset keeps the truncated value positive.
+        const auto n = static_cast<int32_t>(x + 126.5f) - 126;
+        const auto f = (x - static_cast<float>(n)) * 0.693147181f;
+        const auto p =
+            1.f +
+            f * (1.f +
+                 f * (0.5f +
+                      f * (0.166666667f +
+                           f * (0.0416666667f +
+                                f * (0.00833333333f +
+                                     f * (0.00138888889f +
+                                          f * 0.000198412698f))))));
+        const int32_t scale_bits = (n + 127) * (1 << 23);
+        float scale;
+        std::memcpy(&scale, &scale_bits, sizeof(scale));
+        return p * scale;
+    }
+
+
+    static inline float fast_pow(const float x, const float y)
+    {
+        return fast_exp2(y * fast_log2(x));
+    }
+
+
+    void mask_block_fast(const MaskingModel &model, MaskingBlock &block,
+                         const size_t n)
+    {
+        const auto log2_e = 1.44269504f;
+        const auto log10_2 = 0.301029996f;
+        const auto log2_10 = 3.32192809f;
+
+        // The luminance dependent terms of csf() are the same for every
+        // level.
+        float csf_a[MASKING_BLOCK_SIZE];
+        float csf_b[MASKING_BLOCK_SIZE];
+        float sum_contrast[MASKING_BLOCK_SIZE];
+
+        #pragma omp simd
+        for (auto k = size_t(0); k < n; k++)
+        {
+            const auto adapt = block.adapt[k];
+            csf_a[k] = 440.f * fast_pow(1.f + 0.7f / adapt, -0.2f);
+            csf_b[k] = 0.3f * fast_pow(1.f + 100.f / adapt, 0.15f);
+            block.factor[k] = 0.f;
+            sum_contrast[k] = 0.f;
+        }
+
+        for (auto i = 0u; i < MAX_PYR_LEVELS - 2; i++)
+        {
+            const auto cpd = model.cpd[i];
+            const auto f_freq = model.f_freq[i];
+            const auto contrast = block.contrast[i];
+
+            #pragma omp simd
+            for (auto k = size_t(0); k < n; k++)
+            {
+                const auto e = fast_exp2(csf_b[k] * cpd * log2_e);
+                const auto sensitivity =
+                    csf_a[k] * cpd / e * std::sqrt(1.f + 0.06f * e);
+
+                // mask() with the fourth power and root done directly.
+                const auto a =
+                    fast_pow(392.498f * (contrast[k] * sensitivity), 0.7f);
+                const auto b = 0.0153f * a;
+                const auto b2 = b * b;
+                const auto f_mask = std::sqrt(std::sqrt(1.f + b2 * b2));
+
+                block.factor[k] += contrast[k] * f_freq * f_mask;
+                sum_contrast[k] += contrast[k];
+            }
+        }
+
+        #pragma omp simd
+        for (auto k = size_t(0); k < n; k++)
+        {
+            const auto factor =
+                block.factor[k] / std::max(sum_contrast[k], 1e-5f);
+            block.factor[k] = std::min(std::max(factor, 1.f), 10.f);
+
+            // tvi() with every branch evaluated and the right one selected.
+            const auto log_a = fast_log2(block.adapt[k]) * log10_2;
+            const auto r2 =
+                fast_pow(0.405f * log_a + 1.6f, 2.18f) - 2.86f;
+            const auto r4 =
+                fast_pow(0.249f * log_a + 0.65f, 2.7f) - 0.72f;
+            const auto r =
+                log_a < -3.94f ? -2.86f :
+                log_a < -1.44f ? r2 :
+                log_a < -0.0184f ? log_a - 0.395f :
+                log_a < 1.9f ? r4 :
+                log_a - 1.255f;
+            block.tvi[k] = fast_exp2(r * log2_10);
+        }
+
+        // At very high frequencies and low luminance expf() overflows in
+        // csf(). Those pixels take the reference path so that they saturate
+        // the same way.
+        for (auto k = size_t(0); k < n; k++)
+        {
+            if (csf_b[k] * model.cpd[0] > 88.f)
+            {
+                mask_pixel(model, block, k);
+            }
+        }
+    }
+}
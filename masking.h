@@ -0,0 +1,80 @@
+/*
+Masking
+Copyright (C) 2006-2011 Yangli Hector Yee
+Copyright (C) 2011-2016 Steven Myint, Jeff Terrace
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef PERCEPTUALDIFF_MASKING_H
+#define PERCEPTUALDIFF_MASKING_H
+
+#include "lpyramid.h"
+
+#include <cstddef>
+
+
+namespace pdiff
+{
+    // Number of pixels the masking kernels evaluate together.
+    static const unsigned int MASKING_BLOCK_SIZE = 16;
+
+
+    // Per comparison constants of the masking model.
+    struct MaskingModel
+    {
+        MaskingModel(float field_of_view, size_t width);
+
+        // Pyramid level used as the adaptation luminance.
+        unsigned int adaptation_level;
+
+        // Cycles per degree of each pyramid level.
+        float cpd[MAX_PYR_LEVELS];
+
+        // Contrast sensitivity of each level relative to the peak.
+        float f_freq[MAX_PYR_LEVELS - 2];
+    };
+
+
+    // Inputs and outputs of the masking model for a block of pixels, stored
+    // one array per quantity so the kernels can work across pixels.
+    struct MaskingBlock
+    {
+        // Adaptation luminance.
+        float adapt[MASKING_BLOCK_SIZE];
+
+        // Band contrast at each pyramid level.
+        float contrast[MAX_PYR_LEVELS - 2][MASKING_BLOCK_SIZE];
+
+        // Threshold elevation due to masking, in [1, 10].
+        float factor[MASKING_BLOCK_SIZE];
+
+        // Threshold of visibility of the adaptation luminance.
+        float tvi[MASKING_BLOCK_SIZE];
+    };
+
+
+    // Computes factor and tvi for the first n pixels of the block with the
+    // reference functions.
+    void mask_block(const MaskingModel &model, MaskingBlock &block,
+                    size_t n);
+
+    // Same as mask_block() but with vectorized approximations of powf, expf
+    // and log10f. Results agree to within a few parts per million; see
+    // test/accuracy.cpp.
+    void mask_block_fast(const MaskingModel &model, MaskingBlock &block,
+                         size_t n);
+}
+
+#endif
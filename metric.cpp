@@ -19,189 +19,611 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include "metric.h"
 
+#include "color.h"
+#include "image_view.h"
 #include "lpyramid.h"
+#include "masking.h"
+#include "parallel.h"
+#include "reference.h"
 #include "rgba_image.h"
+#include "stats.h"
 
+#include <atomic>
 #include <ciso646>
 #include <cmath>
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <vector>
 #include <algorithm>
+#include <utility>
 
 
 namespace pdiff
 {
-#if _MSC_VER <= 1800
-    static const auto pi = 3.14159265f;
+    PerceptualDiffParameters::PerceptualDiffParameters()
+        : luminance_only(false),
+          field_of_view(45.0f),
+          gamma(2.2f),
+          luminance(100.0f),
+          threshold_pixels(100),
+          color_factor(1.0f),
+          decimated_pyramid(false),
+          max_memory(0),
+          fast_masking(false),
+          half_float_pyramid(false),
+          threads(0),
+          executor(nullptr),
+          stats(nullptr),
+          tracer(nullptr)
+    {
+    }
 
 
-    static float to_radians(const float degrees)  // LCOV_EXCL_LINE
+    // Rows of context each band needs on either side. Every blur level reads
+    // two rows past the one it writes, interpolating a decimated level reads
+    // one more, and an even count keeps decimated levels sampling the same
+    // rows as they would over the whole image.
+    static const auto BAND_HALO = size_t(2 * MAX_PYR_LEVELS);
+
+
+    // The colour test can only change results when it is on with a nonzero
+    // weight. Otherwise chroma is neither converted nor compared.
+    static bool uses_chroma(const PerceptualDiffParameters &args)
     {
-      return degrees * pi / 180.f;  // LCOV_EXCL_LINE
+        return not args.luminance_only and args.color_factor != 0.f;
     }
 
 
-    static float to_degrees(const float radians)  // LCOV_EXCL_LINE
+    // Bytes of working memory per pixel: four chroma planes if they are
+    // used, and two pyramids, whose level 0 is the luminance plane.
+    // Decimated pyramids store one full level above it and six quarter
+    // levels, and half precision pyramids store the levels above it in half
+    // the space. The rows they are blurred in take memory per row, not per
+    // pixel.
+    static size_t bytes_per_pixel(const PerceptualDiffParameters &args)
     {
-      return radians * 180.f / pi;  // LCOV_EXCL_LINE
+        const auto upper_quarters =
+            args.decimated_pyramid ? 4 + 6 : (MAX_PYR_LEVELS - 1) * 4;
+        const auto pyramid_quarters =
+            4 + (args.half_float_pyramid ? upper_quarters / 2
+                                         : upper_quarters);
+        const auto quarter_planes =
+            (uses_chroma(args) ? 4 * 4 : 0) + 2 * pyramid_quarters;
+        return quarter_planes * sizeof(float) / 4;
     }
-#else
-    constexpr auto pi = 3.14159265f;
 
 
-    constexpr float to_radians(const float degrees)  // LCOV_EXCL_LINE
+    // Returns how many rows to compare at a time to stay within
+    // args.max_memory, or 0 if not even a single band fits.
+    static size_t rows_per_band(const size_t w, const size_t h,
+                                const PerceptualDiffParameters &args)
     {
-        return degrees * pi / 180.f;  // LCOV_EXCL_LINE
+        const auto row_bytes = w * bytes_per_pixel(args);
+        if (args.max_memory == 0 or row_bytes * h <= args.max_memory)
+        {
+            return h;
+        }
+
+        const auto budget_rows = args.max_memory / row_bytes;
+        if (budget_rows < 2 * BAND_HALO + 2)
+        {
+            return 0;
+        }
+        return (budget_rows - 2 * BAND_HALO) & ~size_t(1);
     }
 
 
-    constexpr float to_degrees(const float radians)  // LCOV_EXCL_LINE
+    // A rectangle of pixels, [x_begin, x_end) by [y_begin, y_end).
+    struct Region
     {
-        return radians * 180.f / pi;  // LCOV_EXCL_LINE
+        size_t x_begin;
+        size_t x_end;
+        size_t y_begin;
+        size_t y_end;
+    };
+
+
+    // Side of the square tiles the images are checked for differences in.
+    static const auto TILE_SIZE = size_t(64);
+
+
+    // Marks each tile in which the two images differ. Returns the number of
+    // such tiles.
+    static size_t find_dirty_tiles(const ImageView &image_a,
+                                   const ImageView &image_b,
+                                   const size_t tiles_x,
+                                   const Scheduler &scheduler,
+                                   std::vector<char> &dirty)
+    {
+        const auto w = static_cast<size_t>(image_a.get_width());
+        const auto h = static_cast<size_t>(image_a.get_height());
+        const auto tiles_y = dirty.size() / tiles_x;
+
+        // Rows in the same format are compared as they are, and others as
+        // RGBAImage stores them.
+        const auto same_format = image_a.get_format() == image_b.get_format();
+        const auto pixel_bytes =
+            same_format ? pixel_size(image_a.get_format())
+                        : sizeof(unsigned int);
+
+        std::atomic<size_t> dirty_count(0);
+
+        // Each task checks one row of tiles.
+        scheduler.parallel_for(
+            tiles_y, 1, [&](const size_t ty, const size_t)
+            {
+                auto &converted_a = get_thread_buffers().pixels[0];
+                auto &converted_b = get_thread_buffers().pixels[1];
+                const auto tile_row = &dirty[ty * tiles_x];
+                const auto y_end = std::min((ty + 1) * TILE_SIZE, h);
+                auto row_count = size_t(0);
+                for (auto y = ty * TILE_SIZE; y < y_end; y++)
+                {
+                    const auto row = static_cast<unsigned int>(y);
+                    auto row_a = image_a.get_row(row);
+                    auto row_b = image_b.get_row(row);
+                    if (not same_format)
+                    {
+                        converted_a.resize(w);
+                        converted_b.resize(w);
+                        image_a.read_row(row, 0, w, converted_a.data());
+                        image_b.read_row(row, 0, w, converted_b.data());
+                        row_a = reinterpret_cast<const unsigned char *>(
+                            converted_a.data());
+                        row_b = reinterpret_cast<const unsigned char *>(
+                            converted_b.data());
+                    }
+
+                    for (auto tx = size_t(0); tx < tiles_x; tx++)
+                    {
+                        const auto offset = tx * TILE_SIZE * pixel_bytes;
+                        const auto size =
+                            std::min(TILE_SIZE, w - tx * TILE_SIZE) *
+                            pixel_bytes;
+                        if (not tile_row[tx] and
+                            std::memcmp(row_a + offset, row_b + offset,
+                                        size) != 0)
+                        {
+                            tile_row[tx] = 1;
+                            row_count++;
+                        }
+                    }
+                }
+                dirty_count.fetch_add(row_count, std::memory_order_relaxed);
+            });
+        return dirty_count;
     }
-#endif
 
-    // Given the adaptation luminance, this function returns the
-    // threshold of visibility in cd per m^2.
-    //
-    // TVI means Threshold vs Intensity function.
-    // This version comes from Ward Larson Siggraph 1997.
-    //
-    // Returns the threshold luminance given the adaptation luminance.
-    // Units are candelas per meter squared.
-    static float tvi(const float adaptation_luminance)
+
+    // Returns the regions that have to be evaluated: every dirty tile grown
+    // by BAND_HALO, since pixels further than that from any difference come
+    // out identical in both pyramids and always pass. Runs of tile rows are
+    // merged when their regions touch, and split into bands of at most
+    // band_rows rows.
+    static std::vector<Region> dirty_regions(const std::vector<char> &dirty,
+                                             const size_t tiles_x,
+                                             const size_t w, const size_t h,
+                                             const size_t band_rows)
     {
-        const auto log_a = log10f(adaptation_luminance);
+        std::vector<Region> merged;
+        for (auto ty = size_t(0); ty * tiles_x < dirty.size(); ty++)
+        {
+            const auto tile_row = dirty.begin() + ty * tiles_x;
+            const auto first =
+                std::find(tile_row, tile_row + tiles_x, 1) - tile_row;
+            if (static_cast<size_t>(first) == tiles_x)
+            {
+                continue;
+            }
+            auto last = tiles_x - 1;
+            while (not tile_row[last])
+            {
+                last--;
+            }
+
+            Region region;
+            region.x_begin = first * TILE_SIZE;
+            region.x_begin -= std::min(region.x_begin, BAND_HALO);
+            region.x_end = std::min((last + 1) * TILE_SIZE + BAND_HALO, w);
+            region.y_begin = ty * TILE_SIZE;
+            region.y_begin -= std::min(region.y_begin, BAND_HALO);
+            region.y_end = std::min((ty + 1) * TILE_SIZE + BAND_HALO, h);
+
+            if (not merged.empty() and
+                region.y_begin <= merged.back().y_end)
+            {
+                auto &previous = merged.back();
+                previous.x_begin = std::min(previous.x_begin, region.x_begin);
+                previous.x_end = std::max(previous.x_end, region.x_end);
+                previous.y_end = region.y_end;
+            }
+            else
+            {
+                merged.push_back(region);
+            }
+        }
 
-        float r;
-        if (log_a < -3.94f)
+        std::vector<Region> regions;
+        for (const auto &region : merged)
         {
-            r = -2.86f;
+            for (auto y = region.y_begin; y < region.y_end; y += band_rows)
+            {
+                auto band = region;
+                band.y_begin = y;
+                band.y_end = std::min(y + band_rows, region.y_end);
+                regions.push_back(band);
+            }
         }
-        else if (log_a < -1.44f)
+        return regions;
+    }
+
+
+
+
+    // Luminance and CIE L*a*b* chroma of one image over a region.
+    struct ColorPlanes
+    {
+        // Sizes the planes for a region. Without chroma only the luminance
+        // plane is used, and a() and b() return null.
+        void resize(const size_t size, const bool with_chroma)
         {
-            r = powf(0.405f * log_a + 1.6f, 2.18f) - 2.86f;
+            lum.resize(size);
+            chroma = with_chroma;
+            if (chroma)
+            {
+                a_.resize(size);
+                b_.resize(size);
+            }
         }
-        else if (log_a < -0.0184f)
+
+        float *a()
         {
-            r = log_a - 0.395f;
+            return chroma ? a_.data() : nullptr;
         }
-        else if (log_a < 1.9f)
+
+        float *b()
         {
-            r = powf(0.249f * log_a + 0.65f, 2.7f) - 0.72f;
+            return chroma ? b_.data() : nullptr;
         }
-        else
+
+        size_t get_allocated_bytes() const
         {
-            r = log_a - 1.255f;
+            return (lum.capacity() + a_.capacity() + b_.capacity()) *
+                   sizeof(float);
         }
 
-        return powf(10.0f, r);
-    }
+        std::vector<float> lum;
+        bool chroma;
+        std::vector<float> a_;
+        std::vector<float> b_;
+    };
 
 
-    // computes the contrast sensitivity function (Barten SPIE 1989)
-    // given the cycles per degree (cpd) and luminance (lum)
-    static float csf(const float cpd, const float lum)
+    // The pyramid and chroma planes of one image, covering the rectangle of
+    // the given width whose top left pixel is at (x_origin, y_origin).
+    struct ImageLevels
     {
-        const auto a = 440.f * powf((1.f + 0.7f / lum), -0.2f);
-        const auto b = 0.3f * powf((1.0f + 100.0f / lum), 0.15f);
-
-        return a * cpd * expf(-b * cpd) * sqrtf(1.0f + 0.06f * expf(b * cpd));
-    }
+        const LPyramid *pyramid;
+        const float *a;
+        const float *b;
+        size_t x_origin;
+        size_t y_origin;
+        size_t width;
+    };
 
 
-    /*
-    * Visual Masking Function
-    * from Daly 1993
-    */
-    static float mask(const float contrast)
+    // Compares the pixels of row y of a region, adding to error_sum.
+    // Returns how many failed.
+    static size_t compare_row(const ImageLevels &levels_a,
+                              const ImageLevels &levels_b,
+                              const MaskingModel &model,
+                              const PerceptualDiffParameters &args,
+                              const Region &region,
+                              const size_t y,
+                              const MutableImageView *const
+                                  output_image_difference,
+                              double &error_sum)
     {
-        const auto a = powf(392.498f * contrast, 0.7f);
-        const auto b = powf(0.0153f * a, 4.f);
-        return powf(1.0f + b, 0.25f);
+        const auto &la = *levels_a.pyramid;
+        const auto &lb = *levels_b.pyramid;
+        const auto a_a = levels_a.a;
+        const auto a_b = levels_a.b;
+        const auto b_a = levels_b.a;
+        const auto b_b = levels_b.b;
+        const auto adaptation_level = model.adaptation_level;
+        const auto chroma = uses_chroma(args);
+        const auto mask_pixels =
+            args.fast_masking ? mask_block_fast : mask_block;
+
+        // Where the row is in the levels of each image, and where their
+        // chroma rows start.
+        const auto ya = static_cast<unsigned int>(y - levels_a.y_origin);
+        const auto yb = static_cast<unsigned int>(y - levels_b.y_origin);
+        const auto row_a = ya * levels_a.width - levels_a.x_origin;
+        const auto row_b = yb * levels_b.width - levels_b.x_origin;
+        const auto xa_shift = static_cast<unsigned int>(levels_a.x_origin);
+        const auto xb_shift = static_cast<unsigned int>(levels_b.x_origin);
+        auto pixels_failed = size_t(0);
+
+        // Pixels with the same luminance and chroma in both images always
+        // pass, so only the others are gathered for the masking model. They
+        // are kept as image columns.
+        auto &active = get_thread_buffers().pixels[0];
+        active.clear();
+        for (auto x = region.x_begin; x < region.x_end; x++)
+        {
+            const auto column = static_cast<unsigned int>(x);
+            if (la.get_value(column - xa_shift, ya, 0) !=
+                    lb.get_value(column - xb_shift, yb, 0) or
+                (chroma and
+                 (a_a[row_a + x] != b_a[row_b + x] or
+                  a_b[row_a + x] != b_b[row_b + x])))
+            {
+                active.push_back(column);
+            }
+        }
+
+        // They go through the masking model a block at a time.
+        MaskingBlock block;
+        for (auto first = size_t(0); first < active.size();
+             first += MASKING_BLOCK_SIZE)
+        {
+            const auto n = std::min<size_t>(MASKING_BLOCK_SIZE,
+                                            active.size() - first);
+
+            for (auto k = 0u; k < n; k++)
+            {
+                const auto xa = active[first + k] - xa_shift;
+                const auto xb = active[first + k] - xb_shift;
+
+                block.adapt[k] =
+                    std::max((la.get_value(xa, ya, adaptation_level) +
+                              lb.get_value(xb, yb, adaptation_level)) *
+                                 0.5f,
+                             1e-5f);
+
+                for (auto i = 0u; i < MAX_PYR_LEVELS - 2; i++)
+                {
+                    const auto n1 = std::abs(la.get_value(xa, ya, i) -
+                                             la.get_value(xa, ya, i + 1));
+
+                    const auto n2 = std::abs(lb.get_value(xb, yb, i) -
+                                             lb.get_value(xb, yb, i + 1));
+
+                    const auto numerator = std::max(n1, n2);
+                    const auto d1 = std::abs(la.get_value(xa, ya, i + 2));
+                    const auto d2 = std::abs(lb.get_value(xb, yb, i + 2));
+                    const auto denominator =
+                        std::max(std::max(d1, d2), 1e-5f);
+                    block.contrast[i][k] = numerator / denominator;
+                }
+            }
+
+            mask_pixels(model, block, n);
+
+            for (auto k = 0u; k < n; k++)
+            {
+                const auto x = active[first + k];
+                const auto adapt = block.adapt[k];
+                const auto factor = block.factor[k];
+
+                const auto delta =
+                    std::abs(la.get_value(x - xa_shift, ya, 0) -
+                             lb.get_value(x - xb_shift, yb, 0));
+                error_sum += delta;
+                auto pass = true;
+
+
+                // Pure luminance test.
+                if (delta > factor * block.tvi[k])
+                {
+                    pass = false;
+                }
+
+                if (chroma)
+                {
+                    // CIE delta E test with modifications.
+                    auto color_scale = args.color_factor;
+
+                    // Ramp down the color test in scotopic regions.
+                    if (adapt < 10.0f)
+                    {
+                        // Don't do color test at all.
+                        color_scale = 0.0;
+                    }
+
+                    const auto da = a_a[row_a + x] - b_a[row_b + x];
+                    const auto db = a_b[row_a + x] - b_b[row_b + x];
+                    const auto delta_e =
+                        (da * da + db * db) * color_scale;
+                    error_sum += delta_e;
+                    if (delta_e > factor)
+                    {
+                        pass = false;
+                    }
+                }
+
+                const auto row = static_cast<unsigned int>(y);
+                if (pass)
+                {
+                    if (output_image_difference)
+                    {
+                        output_image_difference->set(x, row, 0, 0, 0, 255);
+                    }
+                }
+                else
+                {
+                    pixels_failed++;
+                    if (output_image_difference)
+                    {
+                        output_image_difference->set(x, row, 255, 0, 0, 255);
+                    }
+                }
+            }
+        }
+
+        return pixels_failed;
     }
 
 
-    // convert Adobe RGB (1998) with reference white D65 to XYZ
-    static void adobe_rgb_to_xyz(const float r, const float g, const float b,
-                                 float &x, float &y, float &z)
+    // Compares the pixels of a region. The levels of both images cover at
+    // least the region.
+    //
+    // Once output_pixels_failed reaches failure_limit the remaining rows are
+    // skipped, and true is returned. The count is shared between tasks and
+    // checked before each row, so it may end up somewhat past the limit. The
+    // error sum is added up per task and then in task order, so it does not
+    // depend on how many threads there are.
+    static bool compare_region(const ImageLevels &levels_a,
+                               const ImageLevels &levels_b,
+                               const MaskingModel &model,
+                               const PerceptualDiffParameters &args,
+                               const Scheduler &scheduler,
+                               const Region &region,
+                               const size_t failure_limit,
+                               const MutableImageView *const
+                                   output_image_difference,
+                               size_t &output_pixels_failed,
+                               double &output_error_sum)
     {
-        // matrix is from http://www.brucelindbloom.com/
-        x = r * 0.576700f  + g * 0.185556f  + b * 0.188212f;
-        y = r * 0.297361f  + g * 0.627355f  + b * 0.0752847f;
-        z = r * 0.0270328f + g * 0.0706879f + b * 0.991248f;
+        const auto rows = region.y_end - region.y_begin;
+        const auto grain = size_t(4);
+        std::atomic<size_t> pixels_failed(output_pixels_failed);
+        std::atomic<bool> stopped(false);
+        std::vector<double> error_sums(Scheduler::task_count(rows, grain));
+
+        scheduler.parallel_for(
+            rows, grain, [&](const size_t begin, const size_t end)
+            {
+                auto error_sum = 0.;
+                for (auto row = begin; row < end; row++)
+                {
+                    if (pixels_failed.load(std::memory_order_relaxed) >=
+                        failure_limit)
+                    {
+                        stopped.store(true, std::memory_order_relaxed);
+                        break;
+                    }
+                    pixels_failed.fetch_add(
+                        compare_row(levels_a, levels_b, model, args,
+                                    region, region.y_begin + row,
+                                    output_image_difference, error_sum),
+                        std::memory_order_relaxed);
+                }
+                error_sums[begin / grain] = error_sum;
+            });
+
+        output_pixels_failed = pixels_failed;
+        for (const auto error_sum : error_sums)
+        {
+            output_error_sum += error_sum;
+        }
+        return stopped;
     }
 
 
-    struct White
+    // Buffers kept by a YeeComparator between comparisons.
+    struct YeeComparator::Workspace
     {
-        White()
+        Workspace()
+            : decimated(false),
+              half_float(false)
         {
-            adobe_rgb_to_xyz(1.f, 1.f, 1.f, x, y, z);
         }
 
-        float x;
-        float y;
-        float z;
-    };
+        // Built for the gamma of the last comparison, or null.
+        std::unique_ptr<GammaTable> gamma_table;
 
+        std::vector<char> dirty;
+        ColorPlanes planes_a;
+        ColorPlanes planes_b;
 
-    static const White global_white;
+        // Built with these settings of decimated_pyramid and
+        // half_float_pyramid, or null.
+        bool decimated;
+        bool half_float;
+        std::unique_ptr<LPyramid> la;
+        std::unique_ptr<LPyramid> lb;
+
+        // Bytes of storage held in all of the buffers.
+        size_t get_allocated_bytes() const
+        {
+            return (gamma_table ? gamma_table->get_allocated_bytes() : 0) +
+                   dirty.capacity() + planes_a.get_allocated_bytes() +
+                   planes_b.get_allocated_bytes() +
+                   (la ? la->get_allocated_bytes() : 0) +
+                   (lb ? lb->get_allocated_bytes() : 0);
+        }
+    };
 
 
-    static void xyz_to_lab(const float x, const float y, const float z,
-                           float &l, float &a, float &b)
+    // Times a stage like StageTimer, and adds the bytes the workspace grew by
+    // during it to the stage.
+    template <typename Buffers>
+    class BufferStageTimer
     {
-        const float epsilon = 216.0f / 24389.0f;
-        const float kappa = 24389.0f / 27.0f;
-        const float r[] = {
-            x / global_white.x,
-            y / global_white.y,
-            z / global_white.z
-        };
-        float f[3];
-        for (auto i = 0u; i < 3; i++)
+    public:
+
+        BufferStageTimer(const Buffers &buffers, ComparisonStats *const stats,
+                         const Stage stage, Tracer *const tracer)
+            : buffers_(buffers),
+              stats_(stats),
+              stage_(stage),
+              bytes_(stats ? buffers.get_allocated_bytes() : 0),
+              timer_(stats, stage, tracer)
         {
-            if (r[i] > epsilon)
-            {
-                f[i] = powf(r[i], 1.0f / 3.0f);
-            }
-            else
+        }
+
+        ~BufferStageTimer()
+        {
+            if (stats_)
             {
-                f[i] = (kappa * r[i] + 16.0f) / 116.0f;
+                const auto bytes = buffers_.get_allocated_bytes();
+                if (bytes > bytes_)
+                {
+                    stats_->add_workspace_growth_bytes(stage_,
+                                                       bytes - bytes_);
+                }
             }
         }
-        l = 116.0f * f[1] - 16.0f;
-        a = 500.0f * (f[0] - f[1]);
-        b = 200.0f * (f[1] - f[2]);
-    }
 
+    private:
 
-    static unsigned int adaptation(const float num_one_degree_pixels)
+        BufferStageTimer(const BufferStageTimer &);
+        BufferStageTimer &operator=(const BufferStageTimer &);
+
+        const Buffers &buffers_;
+        ComparisonStats *const stats_;
+        const Stage stage_;
+        const size_t bytes_;
+        const StageTimer timer_;
+    };
+
+
+    // Adds the pixels a comparison evaluated, skipped and found to fail to
+    // stats, if not null, along with the peak memory so far.
+    static void add_pixel_stats(ComparisonStats *const stats,
+                                const size_t pixels, const size_t evaluated,
+                                const size_t failed)
     {
-        auto num_pixels = 1.f;
-        auto adaptation_level = 0u;
-        for (auto i = 0u; i < MAX_PYR_LEVELS; i++)
+        if (stats)
         {
-            adaptation_level = i;
-            if (num_pixels > num_one_degree_pixels)
-            {
-                break;
-            }
-            num_pixels *= 2;
+            stats->add_pixels(evaluated, pixels - evaluated);
+            stats->add_pixels_failed(failed);
+            stats->update_peak_rss();
         }
-        return adaptation_level;  // LCOV_EXCL_LINE
     }
 
 
-    PerceptualDiffParameters::PerceptualDiffParameters()
-        : luminance_only(false),
-          field_of_view(45.0f),
-          gamma(2.2f),
-          luminance(100.0f),
-          threshold_pixels(100),
-          color_factor(1.0f)
+    YeeComparator::YeeComparator()
+        : workspace_(new Workspace)
+    {
+    }
+
+
+    YeeComparator::~YeeComparator()
     {
     }
 
@@ -215,243 +637,375 @@ namespace pdiff
                      RGBAImage *const output_image_difference,
                      std::ostream *const output_verbose)
     {
-        if ((image_a.get_width()  != image_b.get_width()) or
-            (image_a.get_height() != image_b.get_height()))
-        {
-            if (output_reason)
-            {
-                *output_reason = "Image dimensions do not match\n";
-            }
-            return false;
-        }
+        YeeComparator comparator;
+        return comparator.compare(image_a, image_b, args,
+                                  output_num_pixels_failed, output_error_sum,
+                                  output_reason, output_image_difference,
+                                  output_verbose);
+    }
+
+
+    bool yee_compare(const ImageView &image_a,
+                     const ImageView &image_b,
+                     const PerceptualDiffParameters &args,
+                     size_t *const output_num_pixels_failed,
+                     float *const output_error_sum,
+                     std::string *const output_reason,
+                     const MutableImageView *const output_image_difference,
+                     std::ostream *const output_verbose)
+    {
+        YeeComparator comparator;
+        return comparator.compare(image_a, image_b, args,
+                                  output_num_pixels_failed, output_error_sum,
+                                  output_reason, output_image_difference,
+                                  output_verbose);
+    }
 
-        const auto w = image_a.get_width();
-        const auto h = image_a.get_height();
-        const auto dim = w * h;
 
-        auto identical = true;
-        for (auto i = 0u; i < dim; i++)
+    bool YeeComparator::compare(const RGBAImage &image_a,
+                                const RGBAImage &image_b,
+                                const PerceptualDiffParameters &args,
+                                size_t *const output_num_pixels_failed,
+                                float *const output_error_sum,
+                                std::string *const output_reason,
+                                RGBAImage *const output_image_difference,
+                                std::ostream *const output_verbose)
+    {
+        const ImageView view_a(image_a);
+        if (not output_image_difference)
         {
-            if (image_a.get(i) != image_b.get(i))
-            {
-                identical = false;
-                break;
-            }
-        }
-        if (identical)
-        {
-            if (output_reason)
-            {
-                *output_reason = "Images are binary identical\n";
-            }
-            return true;
+            return compare_images(&view_a, nullptr, image_b, args,
+                                  output_num_pixels_failed, output_error_sum,
+                                  output_reason, nullptr, output_verbose);
         }
+        const MutableImageView difference(*output_image_difference);
+        return compare_images(&view_a, nullptr, image_b, args,
+                              output_num_pixels_failed, output_error_sum,
+                              output_reason, &difference, output_verbose);
+    }
+
 
-        // Assuming colorspaces are in Adobe RGB (1998) convert to XYZ.
-        std::vector<float> a_lum(dim);
-        std::vector<float> b_lum(dim);
+    bool YeeComparator::compare(
+        const ImageView &image_a,
+        const ImageView &image_b,
+        const PerceptualDiffParameters &args,
+        size_t *const output_num_pixels_failed,
+        float *const output_error_sum,
+        std::string *const output_reason,
+        const MutableImageView *const output_image_difference,
+        std::ostream *const output_verbose)
+    {
+        return compare_images(&image_a, nullptr, image_b, args,
+                              output_num_pixels_failed, output_error_sum,
+                              output_reason, output_image_difference,
+                              output_verbose);
+    }
 
-        std::vector<float> a_a(dim);
-        std::vector<float> b_a(dim);
-        std::vector<float> a_b(dim);
-        std::vector<float> b_b(dim);
 
-        if (output_verbose)
+    bool YeeComparator::compare(const PrecomputedReference &reference,
+                                const RGBAImage &image_b,
+                                const PerceptualDiffParameters &args,
+                                size_t *const output_num_pixels_failed,
+                                float *const output_error_sum,
+                                std::string *const output_reason,
+                                RGBAImage *const output_image_difference,
+                                std::ostream *const output_verbose)
+    {
+        if (not output_image_difference)
         {
-            *output_verbose << "Converting RGB to XYZ\n";
+            return compare_images(nullptr, &reference, image_b, args,
+                                  output_num_pixels_failed, output_error_sum,
+                                  output_reason, nullptr, output_verbose);
         }
+        const MutableImageView difference(*output_image_difference);
+        return compare_images(nullptr, &reference, image_b, args,
+                              output_num_pixels_failed, output_error_sum,
+                              output_reason, &difference, output_verbose);
+    }
 
-        const auto gamma = args.gamma;
-        const auto luminance = args.luminance;
 
-        #pragma omp parallel for shared(args, a_lum, b_lum, a_a, a_b, b_a, b_b)
-        for (auto y = 0; y < static_cast<ptrdiff_t>(h); y++)
+    bool YeeComparator::compare(
+        const PrecomputedReference &reference,
+        const ImageView &image_b,
+        const PerceptualDiffParameters &args,
+        size_t *const output_num_pixels_failed,
+        float *const output_error_sum,
+        std::string *const output_reason,
+        const MutableImageView *const output_image_difference,
+        std::ostream *const output_verbose)
+    {
+        return compare_images(nullptr, &reference, image_b, args,
+                              output_num_pixels_failed, output_error_sum,
+                              output_reason, output_image_difference,
+                              output_verbose);
+    }
+
+
+    bool YeeComparator::compare_images(
+        const ImageView *const image_a,
+        const PrecomputedReference *const reference,
+        const ImageView &image_b,
+        const PerceptualDiffParameters &args,
+        size_t *const output_num_pixels_failed,
+        float *const output_error_sum,
+        std::string *const output_reason,
+        const MutableImageView *const output_image_difference,
+        std::ostream *const output_verbose)
+    {
+        const auto w = static_cast<size_t>(
+            reference ? reference->get_width() : image_a->get_width());
+        const auto h = static_cast<size_t>(
+            reference ? reference->get_height() : image_a->get_height());
+        if (w != image_b.get_width() or h != image_b.get_height())
         {
-            for (auto x = 0u; x < w; x++)
+            if (output_reason)
             {
-                const auto i = x + y * w;
-
-                // perceptualdiff used to use premultiplied alphas when loading
-                // the image. This is no longer the case since the switch to
-                // FreeImage. We need to do the multiplication here now. As was
-                // the case with premultiplied alphas, differences in alphas
-                // won't be detected where the color is black.
-
-                const auto a_alpha = image_a.get_alpha(i) / 255.f;
-
-                const auto a_color_r = powf(
-                    image_a.get_red(i) / 255.f * a_alpha,
-                    gamma);
-                const auto a_color_g = powf(
-                    image_a.get_green(i) / 255.f * a_alpha,
-                    gamma);
-                const auto a_color_b = powf(
-                    image_a.get_blue(i) / 255.f * a_alpha,
-                    gamma);
-
-                float a_x;
-                float a_y;
-                float a_z;
-                adobe_rgb_to_xyz(a_color_r, a_color_g, a_color_b,
-                                 a_x, a_y, a_z);
-                float l;
-                xyz_to_lab(a_x, a_y, a_z, l, a_a[i], a_b[i]);
-
-                const auto b_alpha = image_b.get_alpha(i) / 255.f;
-
-                const auto b_color_r = powf(
-                    image_b.get_red(i) / 255.f * b_alpha,
-                    gamma);
-                const auto b_color_g = powf(
-                    image_b.get_green(i) / 255.f * b_alpha,
-                    gamma);
-                const auto b_color_b = powf(
-                    image_b.get_blue(i) / 255.f * b_alpha,
-                    gamma);
-
-                float b_x;
-                float b_y;
-                float b_z;
-                adobe_rgb_to_xyz(b_color_r, b_color_g, b_color_b,
-                                 b_x, b_y, b_z);
-                xyz_to_lab(b_x, b_y, b_z, l, b_a[i], b_b[i]);
-
-                a_lum[i] = a_y * luminance;
-                b_lum[i] = b_y * luminance;
+                *output_reason = "Image dimensions do not match\n";
             }
+            return false;
         }
 
-        const auto num_one_degree_pixels =
-            to_degrees(2 *
-                       std::tan(args.field_of_view * to_radians(.5f)));
-        const auto pixels_per_degree = w / num_one_degree_pixels;
-
-        if (output_verbose)
+        // Not a verdict on the images, but on how they were asked to be
+        // compared.
+        if (reference and not reference->matches(args))
         {
-            *output_verbose << "Performing test\n";
+            throw ReferenceException(
+                "Reference was precomputed with a different gamma, "
+                "luminance or pyramid");
         }
 
-        const auto adaptation_level = adaptation(num_one_degree_pixels);
-
-        float cpd[MAX_PYR_LEVELS];
-        cpd[0] = 0.5f * pixels_per_degree;
-        for (auto i = 1u; i < MAX_PYR_LEVELS; i++)
+        const Scheduler scheduler(args.threads, args.executor, args.tracer);
+        if (args.stats)
         {
-            cpd[i] = 0.5f * cpd[i - 1];
+            args.stats->set_threads(scheduler.get_thread_count());
         }
-        const auto csf_max = csf(3.248f, 100.0f);
 
-        static_assert(MAX_PYR_LEVELS > 2,
-                      "MAX_PYR_LEVELS must be greater than 2");
+        const auto tiles_x = (w + TILE_SIZE - 1) / TILE_SIZE;
+        const auto tiles_y = (h + TILE_SIZE - 1) / TILE_SIZE;
+        auto &workspace = *workspace_;
+        auto &dirty = workspace.dirty;
+        auto dirty_count = size_t(0);
+        {
+            const BufferStageTimer<Workspace> timer(
+                workspace, args.stats, Stage::FIND_TILES, args.tracer);
+            dirty.assign(tiles_x * tiles_y, 0);
+            dirty_count = find_dirty_tiles(
+                reference ? ImageView(reference->get_pixels(),
+                                      static_cast<unsigned int>(w),
+                                      static_cast<unsigned int>(h),
+                                      static_cast<ptrdiff_t>(w * 4),
+                                      get_rgba_image_format())
+                          : *image_a,
+                image_b, tiles_x, scheduler, dirty);
+        }
+        if (dirty_count == 0)
+        {
+            add_pixel_stats(args.stats, w * h, 0, 0);
+            if (output_reason)
+            {
+                *output_reason = "Images are binary identical\n";
+            }
+            return true;
+        }
 
-        float f_freq[MAX_PYR_LEVELS - 2];
-        for (auto i = 0u; i < MAX_PYR_LEVELS - 2; i++)
+        const auto band_rows = rows_per_band(w, h, args);
+        if (band_rows == 0)
         {
-            f_freq[i] = csf_max / csf(cpd[i], 100.0f);
+            if (output_reason)
+            {
+                *output_reason = "Memory budget is too small for images this "
+                                 "wide\n";
+            }
+            return false;
         }
 
-        auto pixels_failed = 0u;
+        const MaskingModel model(args.field_of_view, w);
+
+        // When only the verdict is wanted the comparison stops as soon as
+        // enough pixels have failed. A threshold of 0 fails every
+        // comparison, and the pixels are still counted for the reason.
+        const auto decision_only = not output_num_pixels_failed and
+                                   not output_error_sum and
+                                   not output_image_difference;
+        const auto failure_limit =
+            decision_only and args.threshold_pixels > 0
+                ? static_cast<size_t>(args.threshold_pixels)
+                : SIZE_MAX;
+
+        auto pixels_failed = size_t(0);
+        auto stopped_early = false;
+        auto pixels_evaluated = size_t(0);
         auto error_sum = 0.;
 
-        if (output_verbose)
+        if (output_verbose and dirty_count < dirty.size())
+        {
+            *output_verbose << "Skipping " << dirty.size() - dirty_count
+                            << " of " << dirty.size()
+                            << " tiles that are identical\n";
+        }
+        if (output_verbose and band_rows < h)
         {
-            *output_verbose << "Constructing Laplacian Pyramids\n";
+            *output_verbose << "Comparing in bands of " << band_rows
+                            << " rows\n";
         }
         try
         {
-            const LPyramid la(a_lum, w, h);
-            const LPyramid lb(b_lum, w, h);
+            const auto regions =
+                dirty_regions(dirty, tiles_x, w, h, band_rows);
 
-            #pragma omp parallel for reduction(+ : pixels_failed, error_sum) \
-            shared(args, a_a, a_b, b_a, b_b, cpd, f_freq)
-            for (auto y = 0; y < static_cast<ptrdiff_t>(h); y++)
+            // Pixels outside the regions pass.
+            if (output_image_difference)
             {
-                for (auto x = 0u; x < w; x++)
-                {
-                    const auto index = y * w + x;
+                const StageTimer timer(args.stats, Stage::COMPARE,
+                                       args.tracer);
+                scheduler.parallel_for(
+                    h, 64, [&](const size_t begin, const size_t end)
+                    {
+                        for (auto y = begin; y < end; y++)
+                        {
+                            for (auto x = 0u; x < w; x++)
+                            {
+                                output_image_difference->set(
+                                    x, static_cast<unsigned int>(y), 0, 0, 0,
+                                    255);
+                            }
+                        }
+                    });
+            }
 
-                    const auto adapt =
-                        std::max((la.get_value(x, y, adaptation_level) +
-                                  lb.get_value(x, y, adaptation_level)) *
-                                     0.5f,
-                                 1e-5f);
+            // Assuming colorspaces are in Adobe RGB (1998) convert to XYZ.
+            if (not workspace.gamma_table or
+                workspace.gamma_table->get_gamma() != args.gamma)
+            {
+                const BufferStageTimer<Workspace> timer(
+                    workspace, args.stats, Stage::CONVERT, args.tracer);
+                workspace.gamma_table.reset();
+                workspace.gamma_table.reset(
+                    new GammaTable(args.gamma, scheduler));
+            }
+            const auto &gamma_table = *workspace.gamma_table;
 
-                    auto sum_contrast = 0.f;
-                    auto factor = 0.f;
+            if (not workspace.la or
+                workspace.decimated != args.decimated_pyramid or
+                workspace.half_float != args.half_float_pyramid)
+            {
+                workspace.la.reset(new LPyramid(std::vector<float>(), 0, 0,
+                                                args.decimated_pyramid,
+                                                args.half_float_pyramid));
+                workspace.lb.reset(new LPyramid(std::vector<float>(), 0, 0,
+                                                args.decimated_pyramid,
+                                                args.half_float_pyramid));
+                workspace.decimated = args.decimated_pyramid;
+                workspace.half_float = args.half_float_pyramid;
+            }
+            auto &planes_a = workspace.planes_a;
+            auto &planes_b = workspace.planes_b;
+            const auto chroma = uses_chroma(args);
 
-                    for (auto i = 0u; i < MAX_PYR_LEVELS - 2; i++)
-                    {
-                        const auto n1 = std::abs(la.get_value(x, y, i) -
-                                                 la.get_value(x, y, i + 1));
-
-                        const auto n2 = std::abs(lb.get_value(x, y, i) -
-                                                 lb.get_value(x, y, i + 1));
-
-                        const auto numerator = std::max(n1, n2);
-                        const auto d1 = std::abs(la.get_value(x, y, i + 2));
-                        const auto d2 = std::abs(lb.get_value(x, y, i + 2));
-                        const auto denominator =
-                            std::max(std::max(d1, d2), 1e-5f);
-                        const auto contrast = numerator / denominator;
-                        const auto f_mask =
-                            mask(contrast * csf(cpd[i], adapt));
-                        factor += contrast * f_freq[i] * f_mask;
-                        sum_contrast += contrast;
-                    }
-                    sum_contrast = std::max(sum_contrast, 1e-5f);
-                    factor /= sum_contrast;
-                    factor = std::min(std::max(factor, 1.f), 10.f);
-                    const auto delta = std::abs(la.get_value(x, y, 0) -
-                                                lb.get_value(x, y, 0));
-                    error_sum += delta;
-                    auto pass = true;
+            // A precomputed reference covers the whole image.
+            ImageLevels levels_a = {};
+            if (reference)
+            {
+                levels_a.pyramid = &reference->get_pyramid();
+                levels_a.a = reference->get_a();
+                levels_a.b = reference->get_b();
+                levels_a.width = w;
+            }
 
+            // Each region is converted and blurred together with BAND_HALO
+            // pixels of context on every side, so its own pixels come out
+            // the same as they would over the whole image. The planes and
+            // pyramid levels are reused from region to region and from call
+            // to call.
+            for (auto r = regions.begin(); r != regions.end(); r++)
+            {
+                if (pixels_failed >= failure_limit)
+                {
+                    stopped_early = true;
+                    break;
+                }
 
-                    // Pure luminance test.
-                    if (delta > factor * tvi(adapt))
-                    {
-                        pass = false;
-                    }
+                Region context;
+                context.x_begin = r->x_begin - std::min(r->x_begin, BAND_HALO);
+                context.x_end = std::min(r->x_end + BAND_HALO, w);
+                context.y_begin = r->y_begin - std::min(r->y_begin, BAND_HALO);
+                context.y_end = std::min(r->y_end + BAND_HALO, h);
+                const auto context_w = context.x_end - context.x_begin;
+                const auto context_h = context.y_end - context.y_begin;
 
-                    if (not args.luminance_only)
+                if (output_verbose and r == regions.begin())
+                {
+                    *output_verbose << "Converting RGB to XYZ\n";
+                }
+                {
+                    const BufferStageTimer<Workspace> timer(
+                        workspace, args.stats, Stage::CONVERT, args.tracer);
+                    if (not reference)
                     {
-                        // CIE delta E test with modifications.
-                        auto color_scale = args.color_factor;
-
-                        // Ramp down the color test in scotopic regions.
-                        if (adapt < 10.0f)
-                        {
-                            // Don't do color test at all.
-                            color_scale = 0.0;
-                        }
-
-                        const auto da = a_a[index] - b_a[index];
-                        const auto db = a_b[index] - b_b[index];
-                        const auto delta_e = (da * da + db * db) * color_scale;
-                        error_sum += delta_e;
-                        if (delta_e > factor)
-                        {
-                            pass = false;
-                        }
+                        planes_a.resize(context_w * context_h, chroma);
+                        convert_region(*image_a, gamma_table, args.luminance,
+                                       context.x_begin, context.x_end,
+                                       context.y_begin, context.y_end,
+                                       planes_a.lum.data(), planes_a.a(),
+                                       planes_a.b(), scheduler);
                     }
+                    planes_b.resize(context_w * context_h, chroma);
+                    convert_region(image_b, gamma_table, args.luminance,
+                                   context.x_begin, context.x_end,
+                                   context.y_begin, context.y_end,
+                                   planes_b.lum.data(), planes_b.a(),
+                                   planes_b.b(), scheduler);
+                }
 
-                    if (pass)
+                if (output_verbose and r == regions.begin())
+                {
+                    *output_verbose << "Performing test\n"
+                                    << "Constructing Laplacian Pyramids\n";
+                }
+                // The luminance planes become level 0 of the pyramids, and
+                // the chroma planes stay with the caller.
+                const ImageLevels levels_context = {
+                    nullptr, nullptr, nullptr,
+                    context.x_begin, context.y_begin, context_w};
+                {
+                    const BufferStageTimer<Workspace> timer(
+                        workspace, args.stats, Stage::PYRAMIDS, args.tracer);
+                    const auto pyramid_w =
+                        static_cast<unsigned int>(context_w);
+                    const auto pyramid_h =
+                        static_cast<unsigned int>(context_h);
+                    if (reference)
                     {
-                        if (output_image_difference)
-                        {
-                            output_image_difference->set(0, 0, 0, 255, index);
-                        }
+                        workspace.lb->rebuild(planes_b.lum, pyramid_w,
+                                              pyramid_h, scheduler);
                     }
                     else
                     {
-                        pixels_failed++;
-                        if (output_image_difference)
-                        {
-                            output_image_difference->set(255, 0, 0, 255,
-                                                         index);
-                        }
+                        LPyramid::rebuild_pair(
+                            *workspace.la, planes_a.lum, *workspace.lb,
+                            planes_b.lum, pyramid_w, pyramid_h, scheduler);
+                        levels_a = levels_context;
+                        levels_a.pyramid = workspace.la.get();
+                        levels_a.a = planes_a.a();
+                        levels_a.b = planes_a.b();
                     }
                 }
+                auto levels_b = levels_context;
+                levels_b.pyramid = workspace.lb.get();
+                levels_b.a = planes_b.a();
+                levels_b.b = planes_b.b();
+
+                const StageTimer timer(args.stats, Stage::COMPARE,
+                                       args.tracer);
+                if (compare_region(levels_a, levels_b, model, args,
+                                   scheduler, *r, failure_limit,
+                                   output_image_difference, pixels_failed,
+                                   error_sum))
+                {
+                    stopped_early = true;
+                }
+                pixels_evaluated +=
+                    (r->x_end - r->x_begin) * (r->y_end - r->y_begin);
             }
         }
         catch (const std::bad_alloc &)
@@ -460,13 +1014,15 @@ namespace pdiff
             {
                 *output_reason = "Failed to Construct Laplacian pyramids. Out "
                                  "of memory.\n";
-                return false;
             }
+            return false;
         }
 
+        add_pixel_stats(args.stats, w * h, pixels_evaluated, pixels_failed);
+
         const auto different =
+            (stopped_early ? "At least " : "") +
             std::to_string(pixels_failed) + " pixels are different\n";
-
         const auto passed = pixels_failed < args.threshold_pixels;
 
         if (output_reason)
@@ -20,14 +20,22 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #ifndef PERCEPTUALDIFF_METRIC_H
 #define PERCEPTUALDIFF_METRIC_H
 
+#include <cstddef>
 #include <cstdint>
+#include <memory>
 #include <ostream>
 #include <string>
 
 
 namespace pdiff
 {
+    class ComparisonStats;
+    class Executor;
+    class ImageView;
+    class MutableImageView;
+    class PrecomputedReference;
     class RGBAImage;
+    class Tracer;
 
 
     struct PerceptualDiffParameters
@@ -52,6 +60,46 @@ namespace pdiff
         // 0.0 is the same as luminance_only_ = true,
         // 1.0 means full strength.
         float color_factor;
+
+        // Store the coarser Laplacian pyramid levels at half resolution.
+        // This roughly halves peak memory on large images. Results are close
+        // to but not identical with the default.
+        bool decimated_pyramid;
+
+        // Working memory budget in bytes, or 0 for no limit. Images whose
+        // colour planes and pyramids would not fit are compared in
+        // horizontal bands instead, with identical results.
+        size_t max_memory;
+
+        // Evaluate the masking model with vectorized approximations of
+        // powf, expf and log10f. This is several times faster, and factors
+        // and thresholds stay within a few parts per million of the exact
+        // model.
+        bool fast_masking;
+
+        // Store the blurred Laplacian pyramid levels as half precision
+        // floats. This halves their memory and the bandwidth the comparison
+        // spends reading them. Levels stay within 2^-11 of the default,
+        // relative.
+        bool half_float_pyramid;
+
+        // Most threads to compare with, or 0 for one per core. Comparisons
+        // running side by side share one pool of threads, so together they
+        // do not use more than the cores unless asked to.
+        unsigned int threads;
+
+        // Runs the comparison's parallel work in place of the built-in
+        // thread pool, if not null. It must outlive the comparison.
+        Executor *executor;
+
+        // Adds the time and memory each stage of the comparison takes, and
+        // the pixels it evaluates, to these, if not null. They must outlive
+        // the comparison.
+        ComparisonStats *stats;
+
+        // Records when each thread works on each stage and on each range of
+        // its parallel loops, if not null. It must outlive the comparison.
+        Tracer *tracer;
     };
 
 
@@ -69,6 +117,102 @@ namespace pdiff
         std::string *output_reason=nullptr,
         RGBAImage *output_image_difference=nullptr,
         std::ostream *output_verbose=nullptr);
+
+
+    // Compares pixels held by the caller, which are not copied. The
+    // difference image can likewise go to the caller's buffer.
+    bool yee_compare(
+        const ImageView &image_a,
+        const ImageView &image_b,
+        const PerceptualDiffParameters &parameters=PerceptualDiffParameters(),
+        size_t *output_num_pixels_failed=nullptr,
+        float *output_sum_errors=nullptr,
+        std::string *output_reason=nullptr,
+        const MutableImageView *output_image_difference=nullptr,
+        std::ostream *output_verbose=nullptr);
+
+
+    // Compares images like yee_compare(), but keeps its colour planes,
+    // pyramids and lookup tables from one call to the next. Comparing images
+    // no larger than the previous ones then needs no new allocations.
+    //
+    // An instance must not be used by several threads at once.
+    class YeeComparator
+    {
+    public:
+
+        YeeComparator();
+
+        ~YeeComparator();
+
+        bool compare(
+            const RGBAImage &image_a,
+            const RGBAImage &image_b,
+            const PerceptualDiffParameters &parameters=
+                PerceptualDiffParameters(),
+            size_t *output_num_pixels_failed=nullptr,
+            float *output_sum_errors=nullptr,
+            std::string *output_reason=nullptr,
+            RGBAImage *output_image_difference=nullptr,
+            std::ostream *output_verbose=nullptr);
+
+        bool compare(
+            const ImageView &image_a,
+            const ImageView &image_b,
+            const PerceptualDiffParameters &parameters=
+                PerceptualDiffParameters(),
+            size_t *output_num_pixels_failed=nullptr,
+            float *output_sum_errors=nullptr,
+            std::string *output_reason=nullptr,
+            const MutableImageView *output_image_difference=nullptr,
+            std::ostream *output_verbose=nullptr);
+
+        // Compares image_b against a reference image that was precomputed,
+        // usually once for many comparisons. Only image_b is converted and
+        // blurred. The reference must have been precomputed with the same
+        // gamma, luminance, decimated_pyramid and half_float_pyramid, or
+        // ReferenceException is thrown.
+        bool compare(
+            const PrecomputedReference &reference,
+            const RGBAImage &image_b,
+            const PerceptualDiffParameters &parameters=
+                PerceptualDiffParameters(),
+            size_t *output_num_pixels_failed=nullptr,
+            float *output_sum_errors=nullptr,
+            std::string *output_reason=nullptr,
+            RGBAImage *output_image_difference=nullptr,
+            std::ostream *output_verbose=nullptr);
+
+        bool compare(
+            const PrecomputedReference &reference,
+            const ImageView &image_b,
+            const PerceptualDiffParameters &parameters=
+                PerceptualDiffParameters(),
+            size_t *output_num_pixels_failed=nullptr,
+            float *output_sum_errors=nullptr,
+            std::string *output_reason=nullptr,
+            const MutableImageView *output_image_difference=nullptr,
+            std::ostream *output_verbose=nullptr);
+
+    private:
+
+        YeeComparator(const YeeComparator &);
+        YeeComparator &operator=(const YeeComparator &);
+
+        // Image A is given either as an image or as a reference.
+        bool compare_images(const ImageView *image_a,
+                            const PrecomputedReference *reference,
+                            const ImageView &image_b,
+                            const PerceptualDiffParameters &parameters,
+                            size_t *output_num_pixels_failed,
+                            float *output_sum_errors,
+                            std::string *output_reason,
+                            const MutableImageView *output_image_difference,
+                            std::ostream *output_verbose);
+
+        struct Workspace;
+        std::unique_ptr<Workspace> workspace_;
+    };
 }
 
 #endif
@@ -0,0 +1,308 @@
+/*
+Parallel loops
+Copyright (C) 2011-2016 Steven Myint, Jeff Terrace
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "parallel.h"
+
+#include "trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <ciso646>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+
+namespace pdiff
+{
+    Executor::~Executor()
+    {
+    }
+
+
+    ThreadBuffers &get_thread_buffers()
+    {
+        static thread_local ThreadBuffers buffers;
+        return buffers;
+    }
+
+
+    // Threads a loop runs on when the Scheduler does not limit them.
+    static unsigned int default_thread_count()
+    {
+        return std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+
+    // The ranges of a parallel loop, which any number of threads take in
+    // turn. The first exception a range throws is kept for the thread that
+    // started the loop, and the ranges not yet started are then skipped.
+    class Loop
+    {
+    public:
+
+        Loop(const size_t count, const size_t grain,
+             const std::function<void(size_t, size_t)> &body,
+             const unsigned int helper_limit)
+            : max_helpers(helper_limit),
+              helpers(0),
+              count_(count),
+              grain_(grain),
+              tasks_(Scheduler::task_count(count, grain)),
+              body_(body),
+              next_(0),
+              failed_(false)
+        {
+        }
+
+        // Most threads of the pool that may join the loop, and how many are
+        // in it, under the pool's lock.
+        const unsigned int max_helpers;
+        unsigned int helpers;
+
+        // Runs range task.
+        void run_task(const size_t task)
+        {
+            if (failed_.load(std::memory_order_relaxed))
+            {
+                return;
+            }
+            const auto begin = task * grain_;
+            try
+            {
+                body_(begin, std::min(begin + grain_, count_));
+            }
+            catch (...)
+            {
+                const std::lock_guard<std::mutex> lock(error_mutex_);
+                if (not error_)
+                {
+                    error_ = std::current_exception();
+                }
+                failed_.store(true, std::memory_order_relaxed);
+            }
+        }
+
+        // Runs ranges no other thread has taken until there are none left.
+        void work()
+        {
+            for (;;)
+            {
+                const auto task = next_.fetch_add(1);
+                if (task >= tasks_)
+                {
+                    return;
+                }
+                run_task(task);
+            }
+        }
+
+        bool has_tasks_left() const
+        {
+            return next_.load(std::memory_order_relaxed) < tasks_;
+        }
+
+        // Rethrows the first exception a range threw, if any. Only to be
+        // called once every range has finished.
+        void rethrow() const
+        {
+            if (error_)
+            {
+                std::rethrow_exception(error_);
+            }
+        }
+
+    private:
+
+        Loop(const Loop &);
+        Loop &operator=(const Loop &);
+
+        const size_t count_;
+        const size_t grain_;
+        const size_t tasks_;
+        const std::function<void(size_t, size_t)> &body_;
+        std::atomic<size_t> next_;
+        std::atomic<bool> failed_;
+        std::mutex error_mutex_;
+        std::exception_ptr error_;
+    };
+
+
+    // Threads that help with the loops other threads start. A free thread
+    // joins the first loop that has ranges left and room for it. There are
+    // as many threads as the most helpers a loop has wanted, which is one
+    // fewer than the cores unless a Scheduler asks for more.
+    //
+    // The pool is never destroyed, so threads still running loops when the
+    // process exits do not find it gone.
+    class ThreadPool
+    {
+    public:
+
+        static ThreadPool &get()
+        {
+            static auto pool = new ThreadPool();
+            return *pool;
+        }
+
+        // Runs the loop on the calling thread and on up to its max_helpers
+        // threads of the pool, and returns once all of its ranges have
+        // finished.
+        void run(Loop &loop)
+        {
+            {
+                const std::lock_guard<std::mutex> lock(mutex_);
+                while (threads_ < loop.max_helpers)
+                {
+                    std::thread([this]() { help(); }).detach();
+                    threads_++;
+                }
+                loops_.push_back(&loop);
+            }
+            work_available_.notify_all();
+
+            loop.work();
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            loops_.erase(std::find(loops_.begin(), loops_.end(), &loop));
+            loop_left_.wait(lock, [&loop]() { return loop.helpers == 0; });
+        }
+
+    private:
+
+        ThreadPool()
+            : threads_(0)
+        {
+        }
+
+        ThreadPool(const ThreadPool &);
+        ThreadPool &operator=(const ThreadPool &);
+
+        // Runs on each thread of the pool.
+        void help()
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            for (;;)
+            {
+                Loop *loop = nullptr;
+                work_available_.wait(lock, [this, &loop]()
+                {
+                    for (const auto candidate : loops_)
+                    {
+                        if (candidate->helpers < candidate->max_helpers and
+                            candidate->has_tasks_left())
+                        {
+                            loop = candidate;
+                            return true;
+                        }
+                    }
+                    return false;
+                });
+
+                loop->helpers++;
+                lock.unlock();
+                loop->work();
+                lock.lock();
+                if (--loop->helpers == 0)
+                {
+                    loop_left_.notify_all();
+                }
+            }
+        }
+
+        std::mutex mutex_;
+        std::condition_variable work_available_;
+        std::condition_variable loop_left_;
+        std::vector<Loop *> loops_;
+        unsigned int threads_;
+    };
+
+
+    Scheduler::Scheduler(const unsigned int threads, Executor *const executor,
+                         Tracer *const tracer)
+        : threads_(threads), executor_(executor), tracer_(tracer)
+    {
+    }
+
+
+    unsigned int Scheduler::get_thread_count() const
+    {
+        if (executor_)
+        {
+            return 0;
+        }
+        return threads_ ? threads_ : default_thread_count();
+    }
+
+
+    void Scheduler::parallel_for(
+        const size_t count, const size_t grain,
+        const std::function<void(size_t, size_t)> &body) const
+    {
+        const auto tasks = task_count(count, grain);
+        if (tasks == 0)
+        {
+            return;
+        }
+
+        // Ranges are named after the stage of the thread that started the
+        // loop, since they may run on others.
+        if (tracer_)
+        {
+            const auto tracer = tracer_;
+            const auto stage = get_traced_stage();
+            Scheduler(threads_, executor_).parallel_for(
+                count, grain, [&](const size_t begin, const size_t end)
+                {
+                    const auto start = Tracer::Clock::now();
+                    body(begin, end);
+                    tracer->add_chunk(stage, start, begin, end);
+                });
+            return;
+        }
+
+        const auto threads = get_thread_count();
+        if (tasks == 1 or threads == 1)
+        {
+            for (auto begin = size_t(0); begin < count; begin += grain)
+            {
+                body(begin, std::min(begin + grain, count));
+            }
+            return;
+        }
+
+        // Ranges are handed out one at a time, so threads that finish early
+        // take over work from slower ones.
+        Loop loop(count, grain, body,
+                  static_cast<unsigned int>(
+                      std::min<size_t>(threads ? threads - 1 : 0, tasks - 1)));
+        if (executor_)
+        {
+            executor_->run(tasks, [&loop](const size_t task)
+            {
+                loop.run_task(task);
+            });
+        }
+        else
+        {
+            ThreadPool::get().run(loop);
+        }
+        loop.rethrow();
+    }
+}
@@ -0,0 +1,107 @@
+/*
+Parallel loops
+Copyright (C) 2011-2016 Steven Myint, Jeff Terrace
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef PERCEPTUALDIFF_PARALLEL_H
+#define PERCEPTUALDIFF_PARALLEL_H
+
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+
+namespace pdiff
+{
+    class Tracer;
+
+
+    // Runs the parallel work of comparisons. Applications with a thread pool
+    // of their own can implement this to keep perceptualdiff on it, instead
+    // of on perceptualdiff's threads that compete with the pool for cores.
+    class Executor
+    {
+    public:
+
+        virtual ~Executor();
+
+        // Calls task(i) once for every i in [0, count) and returns when all
+        // of the calls have finished. The calls may run concurrently and in
+        // any order. They do not call run() themselves.
+        virtual void run(size_t count,
+                         const std::function<void(size_t)> &task) = 0;
+    };
+
+
+    // Splits loops into tasks and runs them on an executor, or by default on
+    // a pool of threads shared by the whole process. The thread that starts
+    // a loop works on it too, and the pool's threads take its tasks as they
+    // become free, so loops started at once from several threads share the
+    // pool's threads instead of each starting as many of their own.
+    class Scheduler
+    {
+    public:
+
+        // Uses up to threads threads, counting the one that starts a loop, or
+        // one per core if it is 0. An executor replaces the pool, and threads
+        // is then ignored. Each range is recorded on the tracer, if not null.
+        explicit Scheduler(unsigned int threads=0,
+                           Executor *executor=nullptr,
+                           Tracer *tracer=nullptr);
+
+        // Calls body(begin, end) over consecutive ranges of at most grain
+        // iterations that together cover [0, count). The ranges may run
+        // concurrently; range i starts at i * grain.
+        //
+        // If a range throws, the ranges that have not started yet are
+        // skipped, and the first exception is rethrown here once the others
+        // have finished.
+        void parallel_for(size_t count, size_t grain,
+                          const std::function<void(size_t, size_t)> &body)
+            const;
+
+        // Most threads parallel_for() runs ranges on at once, or 0 if an
+        // executor decides.
+        unsigned int get_thread_count() const;
+
+        // Number of ranges parallel_for() splits count iterations into.
+        static size_t task_count(size_t count, size_t grain)
+        {
+            return (count + grain - 1) / grain;
+        }
+
+    private:
+
+        unsigned int threads_;
+        Executor *executor_;
+        Tracer *tracer_;
+    };
+
+
+    // Buffers of the calling thread that outlive the ranges it runs, so loop
+    // bodies reuse them instead of allocating for every range or row. A body
+    // must not start a parallel loop while it uses one, since the ranges of
+    // that loop could run on the same thread.
+    struct ThreadBuffers
+    {
+        std::vector<float> floats;
+        std::vector<unsigned int> pixels[2];
+    };
+
+    ThreadBuffers &get_thread_buffers();
+}
+
+#endif
@@ -20,10 +20,17 @@ this program; if not, write to the Free Software Foundation, Inc., 59 Temple
 Place, Suite 330, Boston, MA 02111-1307 USA
 */
 
+#include "batch.h"
 #include "compare_args.h"
+#include "difference.h"
+#include "image_view.h"
 #include "lpyramid.h"
 #include "metric.h"
+#include "reference.h"
 #include "rgba_image.h"
+#include "server.h"
+#include "stats.h"
+#include "trace.h"
 
 #include <cstdlib>
 #include <ciso646>
@@ -37,22 +44,65 @@ int main(const int argc, char **const argv)
     {
         const pdiff::CompareArgs args(argc, argv);
 
+        if (not args.batch_.empty())
+        {
+            return pdiff::run_batch(args, std::cout) ? EXIT_SUCCESS
+                                                     : EXIT_FAILURE;
+        }
+
+        if (not args.serve_.empty())
+        {
+            pdiff::serve(args);
+        }
+
         if (args.verbose_)
         {
             args.print_args();
         }
 
+        if (not args.write_reference_.empty())
+        {
+            const pdiff::PrecomputedReference reference(*args.image_a_,
+                                                        args.parameters_);
+            reference.write_to_file(args.write_reference_);
+            if (args.tracer_)
+            {
+                args.tracer_->write_to_file(args.trace_file_);
+            }
+            if (args.verbose_)
+            {
+                std::cout << "Wrote reference to " << args.write_reference_
+                          << "\n";
+            }
+            return EXIT_SUCCESS;
+        }
+
         std::string reason;
         float error_sum = 0;
-        const auto passed = pdiff::yee_compare(
-            *args.image_a_,
-            *args.image_b_,
-            args.parameters_,
-            nullptr,
-            &error_sum,
-            &reason,
-            args.image_difference_.get(),
-            args.verbose_ ? &std::cout : nullptr);
+        pdiff::YeeComparator comparator;
+        const pdiff::ImageView image_b(*args.image_b_);
+        const auto difference =
+            args.difference_ ? &args.difference_->get_view() : nullptr;
+        const auto passed =
+            args.reference_ ?
+            comparator.compare(
+                *args.reference_,
+                image_b,
+                args.parameters_,
+                nullptr,
+                args.sum_errors_ ? &error_sum : nullptr,
+                &reason,
+                difference,
+                args.verbose_ ? &std::cout : nullptr) :
+            comparator.compare(
+                pdiff::ImageView(*args.image_a_),
+                image_b,
+                args.parameters_,
+                nullptr,
+                args.sum_errors_ ? &error_sum : nullptr,
+                &reason,
+                difference,
+                args.verbose_ ? &std::cout : nullptr);
 
         if (passed)
         {
@@ -69,23 +119,59 @@ int main(const int argc, char **const argv)
             {
                 const auto normalized =
                     error_sum /
-                    (args.image_a_->get_width() *
-                     args.image_a_->get_height() * 255.);
+                    (static_cast<double>(args.image_b_->get_width()) *
+                     args.image_b_->get_height() * 255.);
 
                 std::cout << error_sum << " error sum\n";
                 std::cout << normalized << " normalzied error sum\n";
             }
 
-            if (args.image_difference_.get())
+            if (args.difference_)
             {
-                args.image_difference_->write_to_file(args.image_difference_->get_name());
+                // The verdict can be read while the outputs are written.
+                std::cout << std::flush;
 
-                std::cerr << "Wrote difference image to "
-                          << args.image_difference_->get_name()
-                          << "\n";
+                const auto &outputs = *args.difference_;
+                const pdiff::StageTimer timer(args.stats_.get(),
+                                              pdiff::Stage::OUTPUT,
+                                              args.tracer_.get());
+                auto encoding = outputs.write(pdiff::Scheduler(
+                    args.parameters_.threads, args.parameters_.executor,
+                    args.tracer_.get()));
+                if (not outputs.get_regions_file().empty())
+                {
+                    std::cerr << "Wrote failing regions to "
+                              << outputs.get_regions_file() << "\n";
+                }
+                if (not outputs.get_tile_grid_file().empty())
+                {
+                    std::cerr << "Wrote tile grid to "
+                              << outputs.get_tile_grid_file() << "\n";
+                }
+
+                encoding.get();
+                if (not outputs.get_image_file().empty())
+                {
+                    std::cerr << "Wrote difference image to "
+                              << outputs.get_image_file() << "\n";
+                }
             }
         }
 
+        if (args.tracer_)
+        {
+            args.tracer_->write_to_file(args.trace_file_);
+        }
+
+        // Printed apart from the verdict, so that what scripts read from the
+        // standard output stays the same.
+        if (args.stats_)
+        {
+            args.stats_->update_peak_rss();
+            args.stats_->write_json(std::cerr);
+            std::cerr << "\n";
+        }
+
         return passed ? EXIT_SUCCESS : EXIT_FAILURE;
     }
     catch (const pdiff::ParseException &exception)
@@ -98,4 +184,19 @@ int main(const int argc, char **const argv)
         std::cerr << exception.what() << "\n";
         return EXIT_FAILURE;
     }
+    catch (const pdiff::ReferenceException &exception)
+    {
+        std::cerr << exception.what() << "\n";
+        return EXIT_FAILURE;
+    }
+    catch (const pdiff::ServerException &exception)
+    {
+        std::cerr << exception.what() << "\n";
+        return EXIT_FAILURE;
+    }
+    catch (const pdiff::TraceException &exception)
+    {
+        std::cerr << exception.what() << "\n";
+        return EXIT_FAILURE;
+    }
 }
@@ -0,0 +1,337 @@
+/*
+Precomputed reference
+Copyright (C) 2011-2016 Steven Myint, Jeff Terrace
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "reference.h"
+
+#include "color.h"
+#include "image_view.h"
+#include "metric.h"
+#include "parallel.h"
+#include "rgba_image.h"
+
+#include <ciso646>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <utility>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+namespace pdiff
+{
+    // Start of a precomputed reference file. The sections follow, each at a
+    // multiple of SECTION_ALIGNMENT bytes: the pixels, the a and b chroma
+    // planes, and the pyramid levels, the first of which is the luminance.
+    struct ReferenceHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t byte_order_mark;
+        uint32_t width;
+        uint32_t height;
+        float gamma;
+        float luminance;
+        uint32_t decimated;
+        uint32_t half_float;
+        uint32_t levels;
+    };
+
+
+    static const char REFERENCE_MAGIC[8] = {'P', 'D', 'I', 'F',
+                                            'F', 'R', 'E', 'F'};
+    static const auto REFERENCE_VERSION = uint32_t(1);
+    static const auto BYTE_ORDER_MARK = uint32_t(0x01020304);
+    static const auto SECTION_ALIGNMENT = size_t(64);
+
+
+    // Byte offsets of the sections of a file, and its total size.
+    struct ReferenceLayout
+    {
+        ReferenceLayout(const unsigned int width, const unsigned int height,
+                        const bool decimated, const bool half_float)
+        {
+            const auto dim = static_cast<size_t>(width) * height;
+            auto offset = size_t(0);
+            const auto section = [&offset](const size_t bytes)
+            {
+                offset = (offset + SECTION_ALIGNMENT - 1) /
+                         SECTION_ALIGNMENT * SECTION_ALIGNMENT;
+                const auto start = offset;
+                offset += bytes;
+                return start;
+            };
+
+            section(sizeof(ReferenceHeader));
+            pixels = section(dim * sizeof(unsigned int));
+            a = section(dim * sizeof(float));
+            b = section(dim * sizeof(float));
+            for (auto i = 0u; i < MAX_PYR_LEVELS; i++)
+            {
+                levels[i] = section(LPyramid::level_bytes(
+                    i, width, height, decimated, half_float));
+            }
+            size = offset;
+        }
+
+        // Returns whether the layout of an image this size can be
+        // addressed. Every section takes at most four bytes per pixel, plus
+        // the padding before it.
+        static bool fits(const unsigned int width, const unsigned int height)
+        {
+            const auto sections = size_t(3 + MAX_PYR_LEVELS);
+            const auto fixed_bytes = sizeof(ReferenceHeader) +
+                                     (sections + 1) * SECTION_ALIGNMENT;
+            const auto max_dim = (SIZE_MAX - fixed_bytes) / (sections * 4);
+            return height == 0 or width <= max_dim / height;
+        }
+
+        size_t pixels;
+        size_t a;
+        size_t b;
+        size_t levels[MAX_PYR_LEVELS];
+        size_t size;
+    };
+
+
+    PrecomputedReference::PrecomputedReference(
+        const RGBAImage &image, const PerceptualDiffParameters &parameters)
+        : PrecomputedReference(ImageView(image), parameters, image.get_name())
+    {
+    }
+
+
+    PrecomputedReference::PrecomputedReference(
+        const ImageView &image, const PerceptualDiffParameters &parameters,
+        const std::string &name)
+        : mapping_(nullptr), mapping_size_(0)
+    {
+        const auto w = image.get_width();
+        const auto h = image.get_height();
+        const auto dim = static_cast<size_t>(w) * h;
+        const auto decimated = parameters.decimated_pyramid;
+        const auto half_float = parameters.half_float_pyramid;
+        const ReferenceLayout layout(w, h, decimated, half_float);
+
+        buffer_.resize(layout.size);
+        const auto bytes = buffer_.data();
+
+        ReferenceHeader header;
+        std::memcpy(header.magic, REFERENCE_MAGIC, sizeof(header.magic));
+        header.version = REFERENCE_VERSION;
+        header.byte_order_mark = BYTE_ORDER_MARK;
+        header.width = w;
+        header.height = h;
+        header.gamma = parameters.gamma;
+        header.luminance = parameters.luminance;
+        header.decimated = decimated;
+        header.half_float = half_float;
+        header.levels = MAX_PYR_LEVELS;
+        std::memcpy(bytes, &header, sizeof(header));
+
+        const Scheduler scheduler(parameters.threads, parameters.executor,
+                                  parameters.tracer);
+        const auto pixels =
+            reinterpret_cast<unsigned int *>(bytes + layout.pixels);
+        scheduler.parallel_for(
+            h, 64, [&](const size_t begin, const size_t end)
+            {
+                for (auto y = begin; y < end; y++)
+                {
+                    image.read_row(static_cast<unsigned int>(y), 0, w,
+                                   pixels + y * w);
+                }
+            });
+
+        std::vector<float> lum(dim);
+        const GammaTable gamma_table(parameters.gamma, scheduler);
+        convert_region(image, gamma_table, parameters.luminance, 0, w, 0, h,
+                       lum.data(),
+                       reinterpret_cast<float *>(bytes + layout.a),
+                       reinterpret_cast<float *>(bytes + layout.b),
+                       scheduler);
+
+        const LPyramid pyramid(std::move(lum), w, h, decimated, half_float,
+                               scheduler);
+        for (auto i = 0u; i < MAX_PYR_LEVELS; i++)
+        {
+            std::memcpy(bytes + layout.levels[i], pyramid.get_level(i),
+                        LPyramid::level_bytes(i, w, h, decimated,
+                                              half_float));
+        }
+
+        attach(bytes, buffer_.size(), name);
+    }
+
+
+    PrecomputedReference::PrecomputedReference(const std::string &filename)
+        : mapping_(nullptr), mapping_size_(0)
+    {
+#ifdef _WIN32
+        std::ifstream file(filename, std::ios::binary);
+        if (not file)
+        {
+            throw ReferenceException("Failed to load the reference " +
+                                     filename);
+        }
+        buffer_.assign(std::istreambuf_iterator<char>(file),
+                       std::istreambuf_iterator<char>());
+        attach(buffer_.data(), buffer_.size(), filename);
+#else
+        const auto fd = open(filename.c_str(), O_RDONLY);
+        struct stat status;
+        if (fd < 0 or fstat(fd, &status) != 0)
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            throw ReferenceException("Failed to load the reference " +
+                                     filename);
+        }
+
+        const auto size = static_cast<size_t>(status.st_size);
+        const auto mapping =
+            size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0)
+                 : MAP_FAILED;
+        close(fd);
+        if (mapping == MAP_FAILED)
+        {
+            throw ReferenceException("Failed to load the reference " +
+                                     filename);
+        }
+        mapping_ = mapping;
+        mapping_size_ = size;
+
+        try
+        {
+            attach(static_cast<const char *>(mapping), size, filename);
+        }
+        catch (...)
+        {
+            munmap(mapping_, mapping_size_);
+            throw;
+        }
+#endif
+    }
+
+
+    PrecomputedReference::~PrecomputedReference()
+    {
+#ifndef _WIN32
+        if (mapping_)
+        {
+            munmap(mapping_, mapping_size_);
+        }
+#endif
+    }
+
+
+    void PrecomputedReference::attach(const char *const bytes,
+                                      const size_t size,
+                                      const std::string &filename)
+    {
+        ReferenceHeader header;
+        if (size < sizeof(header))
+        {
+            throw ReferenceException("Not a precomputed reference: " +
+                                     filename);
+        }
+        std::memcpy(&header, bytes, sizeof(header));
+        if (std::memcmp(header.magic, REFERENCE_MAGIC,
+                        sizeof(header.magic)) != 0)
+        {
+            throw ReferenceException("Not a precomputed reference: " +
+                                     filename);
+        }
+        if (header.version != REFERENCE_VERSION or
+            header.byte_order_mark != BYTE_ORDER_MARK or
+            header.levels != MAX_PYR_LEVELS or header.decimated > 1 or
+            header.half_float > 1)
+        {
+            throw ReferenceException("Reference " + filename +
+                                     " was written by an incompatible "
+                                     "version or machine");
+        }
+
+        if (not ReferenceLayout::fits(header.width, header.height))
+        {
+            throw ReferenceException("Reference " + filename +
+                                     " is too large");
+        }
+        const ReferenceLayout layout(header.width, header.height,
+                                     header.decimated != 0,
+                                     header.half_float != 0);
+        if (size < layout.size)
+        {
+            throw ReferenceException("Reference " + filename +
+                                     " is truncated");
+        }
+
+        bytes_ = bytes;
+        size_ = layout.size;
+        width_ = header.width;
+        height_ = header.height;
+        gamma_ = header.gamma;
+        luminance_ = header.luminance;
+        decimated_ = header.decimated != 0;
+        half_float_ = header.half_float != 0;
+
+        pixels_ = reinterpret_cast<const unsigned int *>(bytes +
+                                                         layout.pixels);
+        a_ = reinterpret_cast<const float *>(bytes + layout.a);
+        b_ = reinterpret_cast<const float *>(bytes + layout.b);
+
+        const void *levels[MAX_PYR_LEVELS];
+        for (auto i = 0u; i < MAX_PYR_LEVELS; i++)
+        {
+            levels[i] = bytes + layout.levels[i];
+        }
+        pyramid_.reset(
+            new LPyramid(levels, width_, height_, decimated_, half_float_));
+    }
+
+
+    void PrecomputedReference::write_to_file(
+        const std::string &filename) const
+    {
+        std::ofstream file(filename, std::ios::binary);
+        file.write(bytes_, static_cast<std::streamsize>(size_));
+        file.close();
+        if (not file)
+        {
+            throw ReferenceException("Failed to save to '" + filename + "'");
+        }
+    }
+
+
+    bool PrecomputedReference::matches(
+        const PerceptualDiffParameters &parameters) const
+    {
+        return gamma_ == parameters.gamma and
+               luminance_ == parameters.luminance and
+               decimated_ == parameters.decimated_pyramid and
+               half_float_ == parameters.half_float_pyramid;
+    }
+}
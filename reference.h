@@ -0,0 +1,157 @@
+/*
+Precomputed reference
+Copyright (C) 2011-2016 Steven Myint, Jeff Terrace
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef PERCEPTUALDIFF_REFERENCE_H
+#define PERCEPTUALDIFF_REFERENCE_H
+
+#include "exceptions.h"
+#include "lpyramid.h"
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+
+namespace pdiff
+{
+    class ImageView;
+    class RGBAImage;
+    struct PerceptualDiffParameters;
+
+
+    // Everything a comparison computes from image A alone: its pixels,
+    // chroma planes and Laplacian pyramid over the whole image. A reference
+    // that is compared against many candidates can be precomputed once,
+    // written to a file, and mapped into memory for each later comparison
+    // instead of being decoded, converted and blurred again.
+    //
+    // Files are written in the byte order of the machine and are only read
+    // back on machines with the same one.
+    class PrecomputedReference
+    {
+    public:
+
+        // Precomputes an image. Of the parameters only gamma, luminance,
+        // decimated_pyramid and half_float_pyramid matter, and comparisons
+        // must use the same ones.
+        PrecomputedReference(const RGBAImage &image,
+                             const PerceptualDiffParameters &parameters);
+
+        // Precomputes pixels that the caller owns. The name is only used in
+        // messages.
+        PrecomputedReference(const ImageView &image,
+                             const PerceptualDiffParameters &parameters,
+                             const std::string &name);
+
+        // Maps a file written by write_to_file().
+        explicit PrecomputedReference(const std::string &filename);
+
+        ~PrecomputedReference();
+
+        void write_to_file(const std::string &filename) const;
+
+        unsigned int get_width() const
+        {
+            return width_;
+        }
+
+        unsigned int get_height() const
+        {
+            return height_;
+        }
+
+        // Bytes taken by the pixels, chroma planes and pyramid.
+        size_t get_size() const
+        {
+            return size_;
+        }
+
+        // Returns true if comparisons with these parameters can use this
+        // reference.
+        bool matches(const PerceptualDiffParameters &parameters) const;
+
+        // The pixels, as RGBAImage::get_data() stores them.
+        const unsigned int *get_pixels() const
+        {
+            return pixels_;
+        }
+
+        // The CIE L*a*b* chroma planes.
+        const float *get_a() const
+        {
+            return a_;
+        }
+
+        const float *get_b() const
+        {
+            return b_;
+        }
+
+        const LPyramid &get_pyramid() const
+        {
+            return *pyramid_;
+        }
+
+    private:
+
+        PrecomputedReference(const PrecomputedReference &);
+        PrecomputedReference &operator=(const PrecomputedReference &);
+
+        // Checks the header of the bytes and points into them.
+        void attach(const char *bytes, size_t size,
+                    const std::string &filename);
+
+        // Holds the bytes when they were computed or read, rather than
+        // mapped.
+        std::vector<char> buffer_;
+
+        // The mapped file, if any.
+        void *mapping_;
+        size_t mapping_size_;
+
+        const char *bytes_;
+        size_t size_;
+
+        unsigned int width_;
+        unsigned int height_;
+        float gamma_;
+        float luminance_;
+        bool decimated_;
+        bool half_float_;
+
+        const unsigned int *pixels_;
+        const float *a_;
+        const float *b_;
+        std::unique_ptr<LPyramid> pyramid_;
+    };
+
+
+    class ReferenceException : public virtual PerceptualDiffException
+    {
+    public:
+
+        explicit ReferenceException(const std::string &message)
+            : std::invalid_argument(message),
+              PerceptualDiffException(message)
+        {
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,282 @@
+/*
+Resampling
+Copyright (C) 2011-2016 Steven Myint, Jeff Terrace
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "resample.h"
+
+#include "rgba_image.h"
+
+#include <algorithm>
+#include <ciso646>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+
+namespace pdiff
+{
+    // Half the width of each filter at its own scale.
+    static double filter_support(const ResampleFilter filter)
+    {
+        if (filter == ResampleFilter::BOX)
+        {
+            return 0.5;
+        }
+        else if (filter == ResampleFilter::BILINEAR)
+        {
+            return 1.0;
+        }
+        return 2.0;
+    }
+
+
+    static double filter_value(const ResampleFilter filter, double x)
+    {
+        x = std::fabs(x);
+        if (filter == ResampleFilter::BOX)
+        {
+            return x <= 0.5 ? 1.0 : 0.0;
+        }
+        else if (filter == ResampleFilter::BILINEAR)
+        {
+            return x < 1.0 ? 1.0 - x : 0.0;
+        }
+
+        // Mitchell-Netravali with B = C = 1/3.
+        const auto b = 1.0 / 3.0;
+        const auto c = 1.0 / 3.0;
+        if (x < 1.0)
+        {
+            return ((12.0 - 9.0 * b - 6.0 * c) * x * x * x +
+                    (-18.0 + 12.0 * b + 6.0 * c) * x * x + (6.0 - 2.0 * b)) /
+                   6.0;
+        }
+        if (x < 2.0)
+        {
+            return ((-b - 6.0 * c) * x * x * x + (6.0 * b + 30.0 * c) * x * x +
+                    (-12.0 * b - 48.0 * c) * x + (8.0 * b + 24.0 * c)) /
+                   6.0;
+        }
+        return 0.0;
+    }
+
+
+    // The source pixels, and their weights, that each pixel of one
+    // dimension of the result is made of.
+    struct Contributions
+    {
+        Contributions(const size_t source_size, const size_t size,
+                      const ResampleFilter filter)
+            : first(size), count(size), taps(0)
+        {
+            const auto scale =
+                static_cast<double>(size) / static_cast<double>(source_size);
+            const auto filter_scale = std::min(scale, 1.0);
+            const auto width = filter_support(filter) / filter_scale;
+
+            std::vector<std::vector<double>> all_weights(size);
+            for (auto i = size_t(0); i < size; i++)
+            {
+                const auto center = (static_cast<double>(i) + 0.5) / scale;
+                const auto left = static_cast<size_t>(
+                    std::max(std::floor(center - width + 0.5), 0.0));
+                const auto right = std::min(
+                    static_cast<size_t>(std::floor(center + width + 0.5)),
+                    source_size);
+
+                auto &pixel_weights = all_weights[i];
+                auto total = 0.0;
+                for (auto j = left; j < right; j++)
+                {
+                    const auto weight = filter_value(
+                        filter,
+                        (center - (static_cast<double>(j) + 0.5)) *
+                            filter_scale);
+                    pixel_weights.push_back(weight);
+                    total += weight;
+                }
+
+                // Zero weights at either end are dropped.
+                auto begin = size_t(0);
+                auto end = pixel_weights.size();
+                while (begin < end and pixel_weights[begin] == 0.0)
+                {
+                    begin++;
+                }
+                while (end > begin and pixel_weights[end - 1] == 0.0)
+                {
+                    end--;
+                }
+                if (begin == end or total == 0.0)
+                {
+                    // The nearest source pixel stands in.
+                    pixel_weights.assign(1, 1.0);
+                    first[i] = std::min(static_cast<size_t>(center),
+                                        source_size - 1);
+                    begin = 0;
+                    end = 1;
+                    total = 1.0;
+                }
+                else
+                {
+                    first[i] = left + begin;
+                }
+
+                pixel_weights = std::vector<double>(
+                    pixel_weights.begin() + begin,
+                    pixel_weights.begin() + end);
+                for (auto &weight : pixel_weights)
+                {
+                    weight /= total;
+                }
+                count[i] = pixel_weights.size();
+                taps = std::max(taps, count[i]);
+            }
+
+            weights.assign(size * taps, 0.f);
+            for (auto i = size_t(0); i < size; i++)
+            {
+                std::copy(all_weights[i].begin(), all_weights[i].end(),
+                          weights.begin() + i * taps);
+            }
+        }
+
+        std::vector<size_t> first;
+        std::vector<size_t> count;
+
+        // Those of pixel i start at i * taps.
+        std::vector<float> weights;
+        size_t taps;
+    };
+
+
+    std::shared_ptr<RGBAImage> resample(const RGBAImage &image,
+                                        const unsigned int width,
+                                        const unsigned int height,
+                                        const ResampleFilter filter,
+                                        const Scheduler &scheduler)
+    {
+        const auto source_width = static_cast<size_t>(image.get_width());
+        const auto source_height = static_cast<size_t>(image.get_height());
+        auto result = std::make_shared<RGBAImage>(width, height,
+                                                  image.get_name());
+        if (width == 0 or height == 0 or source_width == 0 or
+            source_height == 0)
+        {
+            return result;
+        }
+
+        const Contributions columns(source_width, width, filter);
+        const Contributions rows(source_height, height, filter);
+
+        // Pixels are filtered as four independent bytes.
+        const auto source =
+            reinterpret_cast<const unsigned char *>(image.get_data());
+        const auto output = reinterpret_cast<unsigned char *>(
+            result->get_data());
+        const auto source_stride = source_width * 4;
+        const auto stride = static_cast<size_t>(width) * 4;
+
+        scheduler.parallel_for(
+            height, 16, [&](const size_t begin, const size_t end)
+            {
+                // Each row of the result is first filtered down the columns
+                // at full width, then along the row.
+                auto &filtered = get_thread_buffers().floats;
+                filtered.resize(source_stride);
+                for (auto y = begin; y < end; y++)
+                {
+                    const auto row_weights = &rows.weights[y * rows.taps];
+                    std::fill(filtered.begin(), filtered.end(), 0.f);
+                    const auto sum = filtered.data();
+                    for (auto k = size_t(0); k < rows.count[y]; k++)
+                    {
+                        const auto weight = row_weights[k];
+                        const auto in =
+                            source + (rows.first[y] + k) * source_stride;
+                        #pragma omp simd
+                        for (auto i = size_t(0); i < source_stride; i++)
+                        {
+                            sum[i] += weight * static_cast<float>(in[i]);
+                        }
+                    }
+
+                    const auto out = output + y * stride;
+                    for (auto x = size_t(0); x < width; x++)
+                    {
+                        const auto weights =
+                            &columns.weights[x * columns.taps];
+                        const auto in = sum + columns.first[x] * 4;
+                        float pixel[4] = {0.f, 0.f, 0.f, 0.f};
+                        for (auto k = size_t(0); k < columns.count[x]; k++)
+                        {
+                            #pragma omp simd
+                            for (auto c = 0; c < 4; c++)
+                            {
+                                pixel[c] += weights[k] * in[k * 4 + c];
+                            }
+                        }
+                        for (auto c = 0; c < 4; c++)
+                        {
+                            out[x * 4 + c] = static_cast<unsigned char>(
+                                std::min(std::max(pixel[c] + 0.5f, 0.f),
+                                         255.f));
+                        }
+                    }
+                }
+            });
+
+        return result;
+    }
+
+
+    bool parse_resample_filter(const std::string &name,
+                               ResampleFilter &filter)
+    {
+        if (name == "box")
+        {
+            filter = ResampleFilter::BOX;
+        }
+        else if (name == "bilinear")
+        {
+            filter = ResampleFilter::BILINEAR;
+        }
+        else if (name == "bicubic")
+        {
+            filter = ResampleFilter::BICUBIC;
+        }
+        else
+        {
+            return false;
+        }
+        return true;
+    }
+
+
+    unsigned int max_halvings(unsigned int width, unsigned int height,
+                              const unsigned int n)
+    {
+        auto halvings = 0u;
+        while (halvings < n and width > 1 and height > 1)
+        {
+            width /= 2;
+            height /= 2;
+            halvings++;
+        }
+        return halvings;
+    }
+}
@@ -0,0 +1,66 @@
+/*
+Resampling
+Copyright (C) 2011-2016 Steven Myint, Jeff Terrace
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef PERCEPTUALDIFF_RESAMPLE_H
+#define PERCEPTUALDIFF_RESAMPLE_H
+
+#include "parallel.h"
+
+#include <memory>
+#include <string>
+
+
+namespace pdiff
+{
+    class RGBAImage;
+
+
+    enum class ResampleFilter
+    {
+        // The average of the pixels each new pixel covers.
+        BOX,
+        // Linear interpolation, widened when shrinking.
+        BILINEAR,
+        // Mitchell-Netravali cubic, as FreeImage's FILTER_BICUBIC.
+        BICUBIC
+    };
+
+
+    // Parses "box", "bilinear" or "bicubic". Returns false for anything
+    // else.
+    bool parse_resample_filter(const std::string &name,
+                               ResampleFilter &filter);
+
+
+    // Resamples an image to width x height, one pass per dimension. When
+    // shrinking, the filter is widened to cover every pixel that falls into
+    // a new one, so shrinking by 2^n takes one call and no intermediate
+    // images. Channels are filtered independently, as they are stored.
+    std::shared_ptr<RGBAImage> resample(
+        const RGBAImage &image, unsigned int width, unsigned int height,
+        ResampleFilter filter=ResampleFilter::BICUBIC,
+        const Scheduler &scheduler=Scheduler());
+
+
+    // Returns how many of n halvings an image of this size can take, where
+    // only images more than 1 pixel in both dimensions can be halved.
+    unsigned int max_halvings(unsigned int width, unsigned int height,
+                              unsigned int n);
+}
+
+#endif
@@ -21,12 +21,27 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include "rgba_image.h"
 
+#include "resample.h"
+
 #include <FreeImage.h>
 
+#include <algorithm>
 #include <cassert>
+#include <cctype>
 #include <ciso646>
 #include <cstring>
+#include <fstream>
+#include <iterator>
+#include <sstream>
 #include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 
 namespace pdiff
@@ -43,6 +58,15 @@ namespace pdiff
     };
 
 
+    struct MultiBitmapDeleter
+    {
+        inline void operator()(FIMULTIBITMAP *bitmap)
+        {
+            FreeImage_CloseMultiBitmap(bitmap);
+        }
+    };
+
+
     static std::shared_ptr<FIBITMAP> to_free_image(const RGBAImage &image)
     {
         const auto *data = image.get_data();
@@ -65,25 +89,97 @@ namespace pdiff
     }
 
 
+    // Frees the bitmap whose pixels an image took over.
+    struct BitmapStorageDeleter
+    {
+        FIBITMAP *bitmap;
+
+        void operator()(unsigned int *) const
+        {
+            FreeImage_Unload(bitmap);
+        }
+    };
+
+
+    // Pixels of a new image that the caller fills in.
+    static std::shared_ptr<unsigned int> allocate_pixels(
+        const unsigned int w, const unsigned int h)
+    {
+        return std::shared_ptr<unsigned int>(
+            new unsigned int[static_cast<size_t>(w) * h],
+            std::default_delete<unsigned int[]>());
+    }
+
+
+    // Takes ownership of the image, which may be null, and returns its
+    // pixels as an RGBAImage. A 32-bit bitmap whose rows follow each other
+    // already holds them as RGBAImage does, except that FreeImage keeps the
+    // rows bottom up, so its rows are reversed in place and kept rather
+    // than copied. Others are converted straight into a new image.
     static std::shared_ptr<RGBAImage> to_rgba_image(FIBITMAP *image,
                                                     const std::string &filename="")
     {
+        std::unique_ptr<FIBITMAP, FreeImageDeleter> bitmap(image);
+        if (not bitmap)
+        {
+            return nullptr;
+        }
+
         const auto w = FreeImage_GetWidth(image);
         const auto h = FreeImage_GetHeight(image);
+        const auto type = FreeImage_GetImageType(image);
+        const auto bpp = FreeImage_GetBPP(image);
 
-        auto result = std::make_shared<RGBAImage>(w, h, filename);
-        // Copy the image over to our internal format, FreeImage has the scanlines
-        // bottom to top though.
-        auto dest = result->get_data();
-        for (unsigned int y = 0; y < h; y++, dest += w)
+        if (type == FIT_BITMAP and bpp == 32 and
+            FreeImage_GetPitch(image) == w * sizeof(unsigned int))
         {
-            const auto scanline = reinterpret_cast<const unsigned int *>(
-                FreeImage_GetScanLine(image, h - y - 1));
-            memcpy(dest, scanline, sizeof(dest[0]) * w);
+            const auto pixels =
+                reinterpret_cast<unsigned int *>(FreeImage_GetBits(image));
+            for (auto y = 0u; y < h / 2; y++)
+            {
+                std::swap_ranges(pixels + static_cast<size_t>(y) * w,
+                                 pixels + static_cast<size_t>(y + 1) * w,
+                                 pixels + static_cast<size_t>(h - 1 - y) * w);
+            }
+            const std::shared_ptr<unsigned int> storage(
+                pixels, BitmapStorageDeleter{bitmap.release()});
+            return std::make_shared<RGBAImage>(w, h, storage, filename);
         }
 
-        return result;
+        if (type == FIT_BITMAP and bpp == 24)
+        {
+            const auto storage = allocate_pixels(w, h);
+            for (auto y = 0u; y < h; y++)
+            {
+                FreeImage_ConvertLine24To32(
+                    reinterpret_cast<BYTE *>(storage.get() +
+                                             static_cast<size_t>(y) * w),
+                    FreeImage_GetScanLine(image, static_cast<int>(h - 1 - y)),
+                    static_cast<int>(w));
+            }
+            return std::make_shared<RGBAImage>(w, h, storage, filename);
+        }
+
+        // Palettes, transparency and 16-bit channels are left to FreeImage.
+        bitmap.reset(FreeImage_ConvertTo32Bits(image));
+        if (not bitmap)
+        {
+            return nullptr;
+        }
+        if (FreeImage_GetPitch(bitmap.get()) == w * sizeof(unsigned int))
+        {
+            return to_rgba_image(bitmap.release(), filename);
+        }
 
+        const auto storage = allocate_pixels(w, h);
+        for (auto y = 0u; y < h; y++)
+        {
+            std::memcpy(storage.get() + static_cast<size_t>(y) * w,
+                        FreeImage_GetScanLine(bitmap.get(),
+                                              static_cast<int>(h - 1 - y)),
+                        sizeof(unsigned int) * w);
+        }
+        return std::make_shared<RGBAImage>(w, h, storage, filename);
     }
 
     std::shared_ptr<RGBAImage> RGBAImage::down_sample(unsigned int w,
@@ -110,57 +206,890 @@ namespace pdiff
         assert(w <= width_);
         assert(h <= height_);
 
-        auto bitmap = to_free_image(*this);
-        std::unique_ptr<FIBITMAP, FreeImageDeleter> converted(
-            FreeImage_Rescale(bitmap.get(), w, h, FILTER_BICUBIC));
+        return resample(*this, w, h);
+    }
 
-        auto img = to_rgba_image(converted.get(), name_);
+    // Reads and writes one family of image files.
+    class ImageCodec
+    {
+    public:
 
-        return img;
+        virtual ~ImageCodec()
+        {
+        }
+
+        // Returns true if a file that starts with these bytes is in this
+        // codec's format.
+        virtual bool can_read(const unsigned char *header,
+                              size_t size) const = 0;
+
+        // Returns true if this codec writes files with this name.
+        virtual bool can_write(const std::string &filename) const = 0;
+
+        virtual std::shared_ptr<RGBAImage> read(
+            const std::string &filename) const = 0;
+
+        // Reads an image of width x height shrunk by up to 2^halvings, for
+        // formats that can skip pixels that way. Others read all of it.
+        virtual std::shared_ptr<RGBAImage> read_reduced(
+            const std::string &filename, unsigned int, unsigned int,
+            unsigned int) const
+        {
+            return read(filename);
+        }
+
+        // Reads the size of an image from its header. Returns false if that
+        // would take decoding it.
+        virtual bool read_size(const std::string &filename,
+                               unsigned int &width,
+                               unsigned int &height) const = 0;
+
+        virtual void write(const RGBAImage &image,
+                           const std::string &filename) const = 0;
+    };
+
+
+    // Returns the extension of a file name in lower case.
+    static std::string get_extension(const std::string &filename)
+    {
+        const auto dot = filename.rfind('.');
+        if (dot == std::string::npos or
+            filename.find_first_of("/\\", dot) != std::string::npos)
+        {
+            return "";
+        }
+        auto extension = filename.substr(dot + 1);
+        std::transform(extension.begin(), extension.end(), extension.begin(),
+                       [](const char c)
+                       {
+                           return static_cast<char>(
+                               std::tolower(static_cast<unsigned char>(c)));
+                       });
+        return extension;
     }
 
-    void RGBAImage::write_to_file(const std::string &filename) const
+
+    // Returns the whole of a file. Where the system allows it the file is
+    // mapped rather than read, so pages are only read as they are used. The
+    // mapping is private, so writes to it do not reach the file.
+    static std::shared_ptr<unsigned char> load_file(
+        const std::string &filename, size_t &size)
     {
-        const auto file_type = FreeImage_GetFIFFromFilename(filename.c_str());
-        if (FIF_UNKNOWN == file_type)
+#ifdef _WIN32
+        std::ifstream file(filename, std::ios::binary);
+        std::vector<char> bytes((std::istreambuf_iterator<char>(file)),
+                                std::istreambuf_iterator<char>());
+        if (not file.good() and not file.eof())
+        {
+            throw RGBImageException("Failed to load the image " + filename);
+        }
+        size = bytes.size();
+        const auto contents = std::shared_ptr<unsigned char>(
+            new unsigned char[size + 1],
+            std::default_delete<unsigned char[]>());
+        std::copy(bytes.begin(), bytes.end(), contents.get());
+        return contents;
+#else
+        const auto fd = open(filename.c_str(), O_RDONLY);
+        struct stat status;
+        if (fd < 0 or fstat(fd, &status) != 0)
         {
-            throw RGBImageException("Can't save to unknown filetype '" +
-                                    filename + "'");
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            throw RGBImageException("Failed to load the image " + filename);
+        }
+
+        size = static_cast<size_t>(status.st_size);
+        const auto mapping =
+            size ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                        fd, 0)
+                 : MAP_FAILED;
+        close(fd);
+        if (mapping == MAP_FAILED)
+        {
+            throw RGBImageException("Failed to load the image " + filename);
         }
+        const auto mapped_size = size;
+        return std::shared_ptr<unsigned char>(
+            static_cast<unsigned char *>(mapping),
+            [mapped_size](unsigned char *const bytes)
+            {
+                munmap(bytes, mapped_size);
+            });
+#endif
+    }
 
-        auto bitmap = to_free_image(*this);
 
-        const bool result =
-            !!FreeImage_Save(file_type, bitmap.get(), filename.c_str());
-        if (not result)
+    static void save_file(const std::string &filename,
+                          const std::string &header,
+                          const unsigned char *const pixels,
+                          const size_t size)
+    {
+        std::ofstream file(filename, std::ios::binary);
+        file.write(header.data(), static_cast<std::streamsize>(header.size()));
+        file.write(reinterpret_cast<const char *>(pixels),
+                   static_cast<std::streamsize>(size));
+        if (not file)
         {
             throw RGBImageException("Failed to save to '" + filename + "'");
         }
     }
 
-    std::shared_ptr<RGBAImage> read_from_file(const std::string &filename)
+
+    // Returns the four channels of a pixel in the order RGBA.
+    static void unpack_pixel(const unsigned int pixel,
+                             unsigned char *const channels)
     {
-        const auto file_type = FreeImage_GetFileType(filename.c_str());
-        if (FIF_UNKNOWN == file_type)
+        unsigned char bytes[4];
+        std::memcpy(bytes, &pixel, sizeof(pixel));
+        channels[0] = bytes[FI_RGBA_RED];
+        channels[1] = bytes[FI_RGBA_GREEN];
+        channels[2] = bytes[FI_RGBA_BLUE];
+        channels[3] = bytes[FI_RGBA_ALPHA];
+    }
+
+
+    // Lays out channels as FreeImage does in 32-bit bitmaps, which is how
+    // images from every codec are stored.
+    static unsigned int pack_pixel(const unsigned char r,
+                                   const unsigned char g,
+                                   const unsigned char b,
+                                   const unsigned char a)
+    {
+        unsigned char bytes[4];
+        bytes[FI_RGBA_RED] = r;
+        bytes[FI_RGBA_GREEN] = g;
+        bytes[FI_RGBA_BLUE] = b;
+        bytes[FI_RGBA_ALPHA] = a;
+        unsigned int pixel;
+        std::memcpy(&pixel, bytes, sizeof(pixel));
+        return pixel;
+    }
+
+
+    static const char RAW_MAGIC[] = "PDRW";
+    static const size_t RAW_HEADER_SIZE = 16;
+
+
+    // Frames that a renderer can write without encoding them:
+    //
+    //   bytes 0-3   "PDRW"
+    //   bytes 4-7   the order of the channels in each pixel, "BGRA" or
+    //               "RGBA"
+    //   bytes 8-15  width and height, 32-bit little-endian
+    //
+    // followed by the 8-bit channels of the pixels, top row first. A frame
+    // whose channels come in the order FreeImage keeps them in memory, which
+    // is BGRA on little-endian machines, is mapped and compared in place.
+    class RawCodec : public ImageCodec
+    {
+    public:
+
+        bool can_read(const unsigned char *const header,
+                      const size_t size) const override
+        {
+            return size >= 4 and std::memcmp(header, RAW_MAGIC, 4) == 0;
+        }
+
+        bool can_write(const std::string &filename) const override
+        {
+            return get_extension(filename) == "pdraw";
+        }
+
+        std::shared_ptr<RGBAImage> read(
+            const std::string &filename) const override
+        {
+            size_t size;
+            const auto file = load_file(filename, size);
+            const auto bytes = file.get();
+            if (size < RAW_HEADER_SIZE or not can_read(bytes, size))
+            {
+                throw RGBImageException("Failed to load the image " +
+                                        filename);
+            }
+            const auto w = read_le32(bytes + 8);
+            const auto h = read_le32(bytes + 12);
+            const auto count = static_cast<size_t>(w) * h;
+            const auto order = bytes + 4;
+            if ((size - RAW_HEADER_SIZE) / 4 < count or
+                not (is_order(order, "BGRA") or is_order(order, "RGBA")))
+            {
+                throw RGBImageException("Failed to load the image " +
+                                        filename);
+            }
+
+            if (std::memcmp(order, native_order().data(), 4) == 0)
+            {
+                const std::shared_ptr<unsigned int> storage(
+                    file,
+                    reinterpret_cast<unsigned int *>(bytes +
+                                                     RAW_HEADER_SIZE));
+                return std::make_shared<RGBAImage>(w, h, storage, filename);
+            }
+
+            const auto result = std::make_shared<RGBAImage>(
+                w, h, allocate_pixels(w, h), filename);
+            const auto pixels = bytes + RAW_HEADER_SIZE;
+            const auto red = order[0] == 'R' ? 0 : 2;
+            for (auto i = size_t(0); i < count; i++)
+            {
+                const auto pixel = pixels + i * 4;
+                result->get_data()[i] = pack_pixel(
+                    pixel[red], pixel[1], pixel[2 - red], pixel[3]);
+            }
+            return result;
+        }
+
+        bool read_size(const std::string &filename, unsigned int &width,
+                       unsigned int &height) const override
+        {
+            unsigned char header[RAW_HEADER_SIZE];
+            std::ifstream file(filename, std::ios::binary);
+            if (not file.read(reinterpret_cast<char *>(header),
+                              sizeof(header)) or
+                not can_read(header, sizeof(header)))
+            {
+                return false;
+            }
+            width = read_le32(header + 8);
+            height = read_le32(header + 12);
+            return true;
+        }
+
+        void write(const RGBAImage &image,
+                   const std::string &filename) const override
+        {
+            auto header = std::string(RAW_MAGIC, 4) + native_order();
+            for (const auto value : {image.get_width(), image.get_height()})
+            {
+                for (auto shift = 0u; shift < 32; shift += 8)
+                {
+                    header += static_cast<char>((value >> shift) & 0xff);
+                }
+            }
+            save_file(filename, header,
+                      reinterpret_cast<const unsigned char *>(
+                          image.get_data()),
+                      static_cast<size_t>(image.get_width()) *
+                          image.get_height() * sizeof(unsigned int));
+        }
+
+    private:
+
+        static unsigned int read_le32(const unsigned char *const bytes)
+        {
+            return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) |
+                   (static_cast<unsigned int>(bytes[3]) << 24);
+        }
+
+        static bool is_order(const unsigned char *const order,
+                             const char *const name)
+        {
+            return std::memcmp(order, name, 4) == 0;
+        }
+
+        // The order of the channels of a pixel in memory.
+        static std::string native_order()
+        {
+            std::string order(4, ' ');
+            order[FI_RGBA_RED] = 'R';
+            order[FI_RGBA_GREEN] = 'G';
+            order[FI_RGBA_BLUE] = 'B';
+            order[FI_RGBA_ALPHA] = 'A';
+            return order;
+        }
+    };
+
+
+    // Netpbm files: binary PGM (P5), PPM (P6) and PAM (P7) with one to four
+    // channels. Other maximum values than 255 are scaled to 8 bits. PAM
+    // files are written with alpha and PPM files without.
+    class NetpbmCodec : public ImageCodec
+    {
+    public:
+
+        bool can_read(const unsigned char *const header,
+                      const size_t size) const override
+        {
+            return size >= 3 and header[0] == 'P' and header[1] >= '5' and
+                   header[1] <= '7' and std::isspace(header[2]);
+        }
+
+        bool can_write(const std::string &filename) const override
         {
-            throw RGBImageException("Unknown filetype '" + filename + "'");
+            const auto extension = get_extension(filename);
+            return extension == "pam" or extension == "ppm";
         }
 
-        FIBITMAP *free_image = nullptr;
-        if (auto temporary = FreeImage_Load(file_type, filename.c_str(), 0))
+        std::shared_ptr<RGBAImage> read(
+            const std::string &filename) const override;
+
+        bool read_size(const std::string &filename, unsigned int &width,
+                       unsigned int &height) const override;
+
+        void write(const RGBAImage &image,
+                   const std::string &filename) const override;
+    };
+
+
+    // Reads the header fields of a netpbm file from bytes [position, end),
+    // leaving position at the first sample.
+    static bool read_netpbm_header(const unsigned char *&position,
+                                   const unsigned char *const end,
+                                   unsigned int &width, unsigned int &height,
+                                   unsigned int &depth, unsigned int &maxval)
+    {
+        const auto kind = position[1];
+        position += 2;
+
+        // Skips whitespace and comments, then reads a token.
+        const auto next_token = [&]()
+        {
+            while (position < end)
+            {
+                if (*position == '#')
+                {
+                    while (position < end and *position != '\n')
+                    {
+                        position++;
+                    }
+                }
+                else if (std::isspace(*position))
+                {
+                    position++;
+                }
+                else
+                {
+                    break;
+                }
+            }
+            const auto begin = position;
+            while (position < end and not std::isspace(*position))
+            {
+                position++;
+            }
+            return std::string(begin, position);
+        };
+        const auto next_number = [&](unsigned int &value)
+        {
+            const auto token = next_token();
+            if (token.empty() or
+                token.find_first_not_of("0123456789") != std::string::npos or
+                token.size() > 9)
+            {
+                return false;
+            }
+            value = static_cast<unsigned int>(std::stoul(token));
+            return true;
+        };
+
+        if (kind == '7')
+        {
+            width = height = depth = maxval = 0;
+            for (;;)
+            {
+                const auto key = next_token();
+                if (key == "ENDHDR")
+                {
+                    break;
+                }
+                auto ok = true;
+                if (key == "WIDTH")
+                {
+                    ok = next_number(width);
+                }
+                else if (key == "HEIGHT")
+                {
+                    ok = next_number(height);
+                }
+                else if (key == "DEPTH")
+                {
+                    ok = next_number(depth);
+                }
+                else if (key == "MAXVAL")
+                {
+                    ok = next_number(maxval);
+                }
+                else if (key == "TUPLTYPE")
+                {
+                    next_token();
+                }
+                else
+                {
+                    return false;
+                }
+                if (not ok)
+                {
+                    return false;
+                }
+            }
+        }
+        else
         {
-            free_image = FreeImage_ConvertTo32Bits(temporary);
-            FreeImage_Unload(temporary);
+            depth = kind == '5' ? 1 : 3;
+            if (not next_number(width) or not next_number(height) or
+                not next_number(maxval))
+            {
+                return false;
+            }
         }
-        if (not free_image)
+
+        // One whitespace character ends the header.
+        if (position >= end or not std::isspace(*position))
+        {
+            return false;
+        }
+        position++;
+        return width > 0 and height > 0 and depth >= 1 and depth <= 4 and
+               maxval >= 1 and maxval <= 65535;
+    }
+
+
+    std::shared_ptr<RGBAImage> NetpbmCodec::read(
+        const std::string &filename) const
+    {
+        size_t size;
+        const auto file = load_file(filename, size);
+        auto position = static_cast<const unsigned char *>(file.get());
+        const auto end = position + size;
+
+        unsigned int w;
+        unsigned int h;
+        unsigned int depth;
+        unsigned int maxval;
+        if (not can_read(position, size) or
+            not read_netpbm_header(position, end, w, h, depth, maxval))
+        {
+            throw RGBImageException("Failed to load the image " + filename);
+        }
+
+        const auto sample_size = maxval > 255 ? 2u : 1u;
+        const auto count = static_cast<size_t>(w) * h;
+        if (static_cast<size_t>(end - position) / (depth * sample_size) <
+            count)
         {
             throw RGBImageException("Failed to load the image " + filename);
         }
 
-        auto result = to_rgba_image(free_image);
+        // Every sample value is scaled to 8 bits once.
+        std::vector<unsigned char> scale(maxval + 1);
+        for (auto v = 0u; v <= maxval; v++)
+        {
+            scale[v] = static_cast<unsigned char>((v * 255u + maxval / 2) /
+                                                  maxval);
+        }
+        const auto sample = [&](const size_t i)
+        {
+            const auto value =
+                sample_size == 1
+                    ? position[i]
+                    : (position[2 * i] << 8) | position[2 * i + 1];
+            return scale[std::min(static_cast<unsigned int>(value), maxval)];
+        };
+
+        const auto result =
+            std::make_shared<RGBAImage>(w, h, allocate_pixels(w, h), filename);
+        const auto pixels = result->get_data();
+        for (auto i = size_t(0); i < count; i++)
+        {
+            const auto first = i * depth;
+            if (depth <= 2)
+            {
+                const auto gray = sample(first);
+                pixels[i] = pack_pixel(gray, gray, gray,
+                                       depth == 2 ? sample(first + 1) : 255);
+            }
+            else
+            {
+                pixels[i] = pack_pixel(sample(first), sample(first + 1),
+                                       sample(first + 2),
+                                       depth == 4 ? sample(first + 3) : 255);
+            }
+        }
+        return result;
+    }
+
+
+    // Reads the header of a netpbm file a few kilobytes at a time, so only
+    // files with long comments are read further.
+    bool NetpbmCodec::read_size(const std::string &filename,
+                                unsigned int &width,
+                                unsigned int &height) const
+    {
+        std::ifstream file(filename, std::ios::binary);
+        std::vector<unsigned char> header;
+        while (file)
+        {
+            const auto size = header.size();
+            header.resize(std::max<size_t>(2 * size, 4096));
+            file.read(reinterpret_cast<char *>(&header[size]),
+                      static_cast<std::streamsize>(header.size() - size));
+            header.resize(size + static_cast<size_t>(file.gcount()));
+
+            const unsigned char *position = header.data();
+            unsigned int depth;
+            unsigned int maxval;
+            if (not can_read(position, header.size()))
+            {
+                return false;
+            }
+            if (read_netpbm_header(position, position + header.size(),
+                                   width, height, depth, maxval))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+
+    void NetpbmCodec::write(const RGBAImage &image,
+                            const std::string &filename) const
+    {
+        const auto w = image.get_width();
+        const auto h = image.get_height();
+        const auto alpha = get_extension(filename) == "pam";
+        const auto depth = alpha ? 4u : 3u;
+
+        std::ostringstream header;
+        if (alpha)
+        {
+            header << "P7\nWIDTH " << w << "\nHEIGHT " << h
+                   << "\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n";
+        }
+        else
+        {
+            header << "P6\n" << w << " " << h << "\n255\n";
+        }
+
+        const auto count = static_cast<size_t>(w) * h;
+        std::vector<unsigned char> samples(count * depth);
+        for (auto i = size_t(0); i < count; i++)
+        {
+            unsigned char channels[4];
+            unpack_pixel(image.get_data()[i], channels);
+            std::memcpy(&samples[i * depth], channels, depth);
+        }
+        save_file(filename, header.str(), samples.data(), samples.size());
+    }
+
+
+    // Everything else FreeImage can read or write.
+    class FreeImageCodec : public ImageCodec
+    {
+    public:
+
+        bool can_read(const unsigned char *, size_t) const override
+        {
+            return true;
+        }
+
+        bool can_write(const std::string &filename) const override
+        {
+            return FreeImage_GetFIFFromFilename(filename.c_str()) !=
+                   FIF_UNKNOWN;
+        }
+
+        std::shared_ptr<RGBAImage> read(
+            const std::string &filename) const override
+        {
+            const auto file_type = FreeImage_GetFileType(filename.c_str());
+            if (FIF_UNKNOWN == file_type)
+            {
+                throw RGBImageException("Unknown filetype '" + filename +
+                                        "'");
+            }
+
+            const auto result = to_rgba_image(
+                FreeImage_Load(file_type, filename.c_str(), 0), filename);
+            if (not result)
+            {
+                throw RGBImageException("Failed to load the image " +
+                                        filename);
+            }
+            return result;
+        }
+
+        std::shared_ptr<RGBAImage> read_reduced(
+            const std::string &filename, unsigned int width,
+            unsigned int height, unsigned int halvings) const override;
+
+        bool read_size(const std::string &filename, unsigned int &width,
+                       unsigned int &height) const override
+        {
+            const auto file_type = FreeImage_GetFileType(filename.c_str());
+            if (FIF_UNKNOWN == file_type or
+                not FreeImage_FIFSupportsNoPixels(file_type))
+            {
+                return false;
+            }
+
+            const std::unique_ptr<FIBITMAP, FreeImageDeleter> bitmap(
+                FreeImage_Load(file_type, filename.c_str(),
+                               FIF_LOAD_NOPIXELS));
+            if (not bitmap)
+            {
+                return false;
+            }
+            width = FreeImage_GetWidth(bitmap.get());
+            height = FreeImage_GetHeight(bitmap.get());
+            return true;
+        }
+
+        void write(const RGBAImage &image,
+                   const std::string &filename) const override
+        {
+            const auto file_type =
+                FreeImage_GetFIFFromFilename(filename.c_str());
+            auto bitmap = to_free_image(image);
+
+            // Difference images are mostly one colour, so the fastest
+            // compression costs them little size.
+            const auto flags = file_type == FIF_PNG ? PNG_Z_BEST_SPEED : 0;
+            const bool result = !!FreeImage_Save(file_type, bitmap.get(),
+                                                 filename.c_str(), flags);
+            if (not result)
+            {
+                throw RGBImageException("Failed to save to '" + filename +
+                                        "'");
+            }
+        }
+    };
+
+
+    // Whether a TIFF page's NewSubfileType marks it as a reduced-resolution
+    // copy of another page, as the levels of a pyramidal TIFF are.
+    static bool is_reduced_page(FIBITMAP *bitmap)
+    {
+        FITAG *tag = nullptr;
+        if (not FreeImage_GetMetadata(FIMD_EXIF_MAIN, bitmap,
+                                      "NewSubfileType", &tag) or
+            FreeImage_GetTagType(tag) != FIDT_LONG or
+            FreeImage_GetTagCount(tag) < 1)
+        {
+            return false;
+        }
+        return (*static_cast<const DWORD *>(FreeImage_GetTagValue(tag)) &
+                1) != 0;
+    }
+
+
+    // Reads the page of a multi-page TIFF that is the image shrunk by the
+    // most, up to 2^halvings, as pyramidal TIFFs keep their smaller levels.
+    // Only pages marked as reduced-resolution images count, so the other
+    // pages of a document are never taken for levels. Returns null if there
+    // is none.
+    static FIBITMAP *load_tiff_level(const std::string &filename,
+                                     const unsigned int width,
+                                     const unsigned int height,
+                                     const unsigned int halvings)
+    {
+        // A level may round its size either way.
+        const auto is_level = [=](const unsigned int w, const unsigned int h,
+                                  const unsigned int n)
+        {
+            const auto step = 1u << n;
+            return (w == width / step or w == (width + step - 1) / step) and
+                   (h == height / step or h == (height + step - 1) / step);
+        };
+
+        // The pages are looked at without their pixels first.
+        auto best_page = -1;
+        auto best_halvings = 0u;
+        {
+            const std::unique_ptr<FIMULTIBITMAP, MultiBitmapDeleter> pages(
+                FreeImage_OpenMultiBitmap(FIF_TIFF, filename.c_str(), FALSE,
+                                          TRUE, FALSE, FIF_LOAD_NOPIXELS));
+            if (not pages)
+            {
+                return nullptr;
+            }
+            const auto count = FreeImage_GetPageCount(pages.get());
+            for (auto page = 1; page < count; page++)
+            {
+                const auto bitmap = FreeImage_LockPage(pages.get(), page);
+                if (not bitmap)
+                {
+                    continue;
+                }
+                const auto reduced = is_reduced_page(bitmap);
+                const auto w = FreeImage_GetWidth(bitmap);
+                const auto h = FreeImage_GetHeight(bitmap);
+                FreeImage_UnlockPage(pages.get(), bitmap, FALSE);
+                if (not reduced)
+                {
+                    continue;
+                }
+                for (auto n = best_halvings + 1; n <= halvings; n++)
+                {
+                    if (is_level(w, h, n))
+                    {
+                        best_page = page;
+                        best_halvings = n;
+                    }
+                }
+            }
+        }
+        if (best_page < 0)
+        {
+            return nullptr;
+        }
+
+        const std::unique_ptr<FIMULTIBITMAP, MultiBitmapDeleter> pages(
+            FreeImage_OpenMultiBitmap(FIF_TIFF, filename.c_str(), FALSE,
+                                      TRUE));
+        if (not pages)
+        {
+            return nullptr;
+        }
+        const auto bitmap = FreeImage_LockPage(pages.get(), best_page);
+        if (not bitmap)
+        {
+            return nullptr;
+        }
+        const auto level = FreeImage_Clone(bitmap);
+        FreeImage_UnlockPage(pages.get(), bitmap, FALSE);
+        return level;
+    }
+
 
-        FreeImage_Unload(free_image);
+    std::shared_ptr<RGBAImage> FreeImageCodec::read_reduced(
+        const std::string &filename, const unsigned int width,
+        const unsigned int height, const unsigned int halvings) const
+    {
+        const auto file_type = FreeImage_GetFileType(filename.c_str());
+        FIBITMAP *bitmap = nullptr;
+        if (file_type == FIF_JPEG)
+        {
+            // Asked for a size, the JPEG decoder scales by 1/2, 1/4 or 1/8
+            // as it decodes, to no less than that size.
+            const auto size = std::max(width, height) >> halvings;
+            if (size > 0 and size <= 0x7fff)
+            {
+                bitmap = FreeImage_Load(file_type, filename.c_str(),
+                                        JPEG_DEFAULT |
+                                            static_cast<int>(size << 16));
+            }
+        }
+        else if (file_type == FIF_TIFF)
+        {
+            bitmap = load_tiff_level(filename, width, height, halvings);
+        }
+        if (not bitmap)
+        {
+            return read(filename);
+        }
 
+        const auto result = to_rgba_image(bitmap, filename);
+        if (not result)
+        {
+            throw RGBImageException("Failed to load the image " + filename);
+        }
         return result;
     }
+
+
+    // In the order they are tried. FreeImage takes whatever the others do
+    // not.
+    static const ImageCodec &get_codec(const size_t i)
+    {
+        static const RawCodec raw_codec;
+        static const NetpbmCodec netpbm_codec;
+        static const FreeImageCodec free_image_codec;
+        static const ImageCodec *const codecs[] = {
+            &raw_codec, &netpbm_codec, &free_image_codec};
+        return *codecs[i];
+    }
+
+    static const size_t CODEC_COUNT = 3;
+
+
+    void RGBAImage::write_to_file(const std::string &filename) const
+    {
+        for (auto i = size_t(0); i < CODEC_COUNT; i++)
+        {
+            const auto &codec = get_codec(i);
+            if (codec.can_write(filename))
+            {
+                codec.write(*this, filename);
+                return;
+            }
+        }
+        throw RGBImageException("Can't save to unknown filetype '" +
+                                filename + "'");
+    }
+
+    // Returns the codec that reads a file, by its first bytes.
+    static const ImageCodec &find_reader(const std::string &filename)
+    {
+        unsigned char header[16];
+        std::ifstream file(filename, std::ios::binary);
+        file.read(reinterpret_cast<char *>(header), sizeof(header));
+        const auto size = static_cast<size_t>(file.gcount());
+
+        auto i = size_t(0);
+        while (not get_codec(i).can_read(header, size))
+        {
+            i++;
+        }
+        return get_codec(i);
+    }
+
+    std::shared_ptr<RGBAImage> read_from_file(const std::string &filename)
+    {
+        return find_reader(filename).read(filename);
+    }
+
+    std::shared_ptr<RGBAImage> read_from_file(const std::string &filename,
+                                              const unsigned int halvings,
+                                              const ResampleFilter filter,
+                                              const Scheduler &scheduler)
+    {
+        const auto &codec = find_reader(filename);
+        if (halvings == 0)
+        {
+            return codec.read(filename);
+        }
+
+        unsigned int width;
+        unsigned int height;
+        auto steps = halvings;
+        std::shared_ptr<RGBAImage> image;
+        if (codec.read_size(filename, width, height))
+        {
+            steps = max_halvings(width, height, halvings);
+            image = codec.read_reduced(filename, width, height, steps);
+        }
+        else
+        {
+            image = codec.read(filename);
+            width = image->get_width();
+            height = image->get_height();
+            steps = max_halvings(width, height, halvings);
+        }
+
+        // Whatever the codec leaves is resampled the rest of the way.
+        width >>= steps;
+        height >>= steps;
+        if (image->get_width() == width and image->get_height() == height)
+        {
+            return image;
+        }
+        return resample(*image, width, height, filter, scheduler);
+    }
+
+    bool read_image_size(const std::string &filename, unsigned int &width,
+                         unsigned int &height)
+    {
+        try
+        {
+            return find_reader(filename).read_size(filename, width, height);
+        }
+        catch (const RGBImageException &)
+        {
+            return false;
+        }
+    }
 }
@@ -21,11 +21,12 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #define PERCEPTUALDIFF_RGBA_IMAGE_H
 
 #include "exceptions.h"
+#include "resample.h"
 
+#include <cstddef>
 #include <memory>
 #include <stdexcept>
 #include <string>
-#include <vector>
 
 
 namespace pdiff
@@ -47,32 +48,49 @@ namespace pdiff
             : width_(w),
               height_(h),
               name_(name),
-              data_(static_cast<size_t>(w) * h)
+              storage_(new unsigned int[static_cast<size_t>(w) * h](),
+                       std::default_delete<unsigned int[]>()),
+              data_(storage_.get())
         {
         }
 
-        unsigned char get_red(const unsigned int i) const
+        // Takes over pixels that are already laid out as get_data() returns
+        // them, such as those a decoder wrote. They are freed by storage's
+        // deleter. A null storage makes an image that only has a size, for
+        // images whose pixels are never read.
+        RGBAImage(const unsigned int w, const unsigned int h,
+                  const std::shared_ptr<unsigned int> &storage,
+                  const std::string &name="")
+            : width_(w),
+              height_(h),
+              name_(name),
+              storage_(storage),
+              data_(storage_.get())
+        {
+        }
+
+        unsigned char get_red(const size_t i) const
         {
             return (data_[i] & 0xff);
         }
 
-        unsigned char get_green(const unsigned int i) const
+        unsigned char get_green(const size_t i) const
         {
             return ((data_[i] >> 8) & 0xff);
         }
 
-        unsigned char get_blue(const unsigned int i) const
+        unsigned char get_blue(const size_t i) const
         {
             return ((data_[i] >> 16) & 0xff);
         }
 
-        unsigned char get_alpha(const unsigned int i) const
+        unsigned char get_alpha(const size_t i) const
         {
             return ((data_[i] >> 24) & 0xff);
         }
 
         void set(const unsigned char r, const unsigned char g, const unsigned char b,
-                 const unsigned char a, const unsigned int i)
+                 const unsigned char a, const size_t i)
         {
             data_[i] = r | (g << 8) | (b << 16) | (a << 24);
         }
@@ -89,15 +107,15 @@ namespace pdiff
 
         void set(const unsigned int x, const unsigned int y, const unsigned int d)
         {
-            data_[x + y * width_] = d;
+            data_[x + static_cast<size_t>(y) * width_] = d;
         }
 
         unsigned int get(const unsigned int x, const  unsigned int y) const
         {
-            return data_[x + y * width_];
+            return data_[x + static_cast<size_t>(y) * width_];
         }
 
-        unsigned int get(const unsigned int i) const
+        unsigned int get(const size_t i) const
         {
             return data_[i];
         }
@@ -109,15 +127,16 @@ namespace pdiff
 
         unsigned int *get_data()
         {
-            return &data_[0];
+            return data_;
         }
 
         const unsigned int *get_data() const
         {
-            return &data_[0];
+            return data_;
         }
 
-        // By default down sample to half of each original dimension.
+        // By default down sample to half of each original dimension. The
+        // filter is bicubic; resample() offers others.
         std::shared_ptr<RGBAImage> down_sample(unsigned int w=0,
                                                unsigned int h=0) const;
 
@@ -131,13 +150,32 @@ namespace pdiff
         const unsigned int width_;
         const unsigned int height_;
         const std::string name_;
-        std::vector<unsigned int> data_;
+        const std::shared_ptr<unsigned int> storage_;
+        unsigned int *const data_;
     };
 
 
     std::shared_ptr<RGBAImage> read_from_file(const std::string &filename);
 
 
+    // Reads an image halved in each dimension as many of halvings times as
+    // max_halvings() allows. JPEGs are scaled down as they are decoded and
+    // pyramidal TIFFs give up a smaller level, so most of their pixels are
+    // never decoded. The rest of the way, and other formats, are resampled
+    // with filter.
+    std::shared_ptr<RGBAImage> read_from_file(
+        const std::string &filename, unsigned int halvings,
+        ResampleFilter filter=ResampleFilter::BICUBIC,
+        const Scheduler &scheduler=Scheduler());
+
+
+    // Reads the size of an image file from its header, without decoding
+    // the pixels. Returns false if the format needs a full decode for that
+    // or the file cannot be read.
+    bool read_image_size(const std::string &filename, unsigned int &width,
+                         unsigned int &height);
+
+
     class RGBImageException : public virtual PerceptualDiffException
     {
     public:
@@ -0,0 +1,405 @@
+/*
+Comparison server
+Copyright (C) 2011-2016 Steven Myint, Jeff Terrace
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "server.h"
+
+#include "batch.h"
+#include "compare_args.h"
+#include "metric.h"
+#include "reference.h"
+#include "rgba_image.h"
+
+#include <chrono>
+#include <ciso646>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+
+namespace pdiff
+{
+#ifdef _WIN32
+    void serve(const CompareArgs &)
+    {
+        throw ServerException("--serve is not supported on Windows");
+    }
+#else
+    // Precomputed references shared by the connections of a server, least
+    // recently used first out once they take more than capacity bytes.
+    class ReferenceCache
+    {
+    public:
+
+        ReferenceCache(const size_t capacity, const bool verbose)
+            : capacity_(capacity), verbose_(verbose), size_(0)
+        {
+        }
+
+        std::shared_ptr<PrecomputedReference> load(
+            const std::string &filename, const CompareArgs &args,
+            unsigned int halvings);
+
+    private:
+
+        typedef std::pair<std::string, std::shared_ptr<PrecomputedReference>>
+            Entry;
+
+        const size_t capacity_;
+        const bool verbose_;
+        size_t size_;
+
+        // Most recently used first.
+        std::list<Entry> entries_;
+        std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+        std::mutex mutex_;
+    };
+
+
+    // Identifies a file's current contents and the parameters and size a
+    // reference is precomputed for.
+    static std::string cache_key(const std::string &filename,
+                                 const CompareArgs &args,
+                                 const unsigned int halvings)
+    {
+        struct stat status;
+        if (stat(filename.c_str(), &status) != 0)
+        {
+            throw RGBImageException("Failed to load the image " + filename);
+        }
+#ifdef __APPLE__
+        const auto nanoseconds = status.st_mtimespec.tv_nsec;
+#else
+        const auto nanoseconds = status.st_mtim.tv_nsec;
+#endif
+
+        const auto &parameters = args.parameters_;
+        std::ostringstream key;
+        key.precision(std::numeric_limits<float>::max_digits10);
+        key << filename << "\n" << status.st_dev << " " << status.st_ino
+            << " " << status.st_size << " " << status.st_mtime << "."
+            << nanoseconds << " " << parameters.gamma << " "
+            << parameters.luminance << " " << parameters.decimated_pyramid
+            << " " << parameters.half_float_pyramid << " " << halvings
+            << " " << static_cast<int>(args.resample_filter_);
+        return key.str();
+    }
+
+
+    std::shared_ptr<PrecomputedReference> ReferenceCache::load(
+        const std::string &filename, const CompareArgs &args,
+        const unsigned int halvings)
+    {
+        const auto key = cache_key(filename, args, halvings);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            const auto found = index_.find(key);
+            if (found != index_.end())
+            {
+                entries_.splice(entries_.begin(), entries_, found->second);
+                return found->second->second;
+            }
+        }
+
+        // Other connections go on while this one precomputes. If two of
+        // them miss the same reference at once, both compute it and the
+        // first one is kept.
+        const auto image = read_from_file(
+            filename, halvings, args.resample_filter_,
+            Scheduler(args.parameters_.threads, args.parameters_.executor));
+        const auto reference =
+            std::make_shared<PrecomputedReference>(*image, args.parameters_);
+
+        // A file that changed while it was read may have been read half
+        // old and half new, so it only serves this request.
+        if (cache_key(filename, args, halvings) != key)
+        {
+            return reference;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        const auto found = index_.find(key);
+        if (found != index_.end())
+        {
+            return found->second->second;
+        }
+
+        entries_.emplace_front(key, reference);
+        index_[key] = entries_.begin();
+        size_ += reference->get_size();
+
+        // The newest reference is kept even if it is over the limit alone.
+        while (size_ > capacity_ and entries_.size() > 1)
+        {
+            const auto &oldest = entries_.back();
+            size_ -= oldest.second->get_size();
+            if (verbose_)
+            {
+                std::cerr << "Evicted "
+                          << oldest.first.substr(0, oldest.first.find('\n'))
+                          << "\n";
+            }
+            index_.erase(oldest.first);
+            entries_.pop_back();
+        }
+        if (verbose_)
+        {
+            std::cerr << "Cached " << filename << " (" << size_ / 1024
+                      << " KiB in " << entries_.size() << " references)\n";
+        }
+        return reference;
+    }
+
+
+    // Counts the connections being served, up to a limit.
+    class ConnectionLimit
+    {
+    public:
+
+        explicit ConnectionLimit(const unsigned int limit)
+            : limit_(limit), count_(0)
+        {
+        }
+
+        // Waits until fewer than limit connections are served, and counts
+        // one more.
+        void acquire()
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            released_.wait(lock, [this] { return count_ < limit_; });
+            count_++;
+        }
+
+        void release()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            count_--;
+            released_.notify_all();
+        }
+
+        // Waits until no connections are served.
+        void wait_for_none()
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            released_.wait(lock, [this] { return count_ == 0; });
+        }
+
+    private:
+
+        const unsigned int limit_;
+        unsigned int count_;
+        std::mutex mutex_;
+        std::condition_variable released_;
+    };
+
+
+    static bool write_all(const int connection, const std::string &data)
+    {
+        auto written = size_t(0);
+        while (written < data.size())
+        {
+            const auto count = write(connection, data.data() + written,
+                                     data.size() - written);
+            if (count < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return false;
+            }
+            written += static_cast<size_t>(count);
+        }
+        return true;
+    }
+
+
+    // Longest request line read, newline included. A client that sends more
+    // without a newline gets an error and is disconnected, so it cannot
+    // take all of the server's memory.
+    static const auto MAX_REQUEST_BYTES = size_t(64) * 1024;
+
+
+    static void serve_connection(const int connection,
+                                 const CompareArgs &args,
+                                 ReferenceCache &cache)
+    {
+        const ReferenceLoader load_reference =
+            [&cache](const std::string &filename, const CompareArgs &pair,
+                     const unsigned int halvings)
+            {
+                return cache.load(filename, pair, halvings);
+            };
+
+        // One comparator keeps its buffers from request to request.
+        YeeComparator comparator;
+        std::string buffer;
+        char chunk[4096];
+        auto number = size_t(0);
+        for (;;)
+        {
+            const auto newline = buffer.find('\n');
+            const auto line_bytes =
+                newline == std::string::npos ? buffer.size() : newline + 1;
+            if (line_bytes > MAX_REQUEST_BYTES)
+            {
+                write_all(connection,
+                          error_line(number + 1,
+                                     "Request is longer than " +
+                                         std::to_string(MAX_REQUEST_BYTES) +
+                                         " bytes"));
+                break;
+            }
+            if (newline == std::string::npos)
+            {
+                const auto count = read(connection, chunk, sizeof(chunk));
+                if (count < 0 and errno == EINTR)
+                {
+                    continue;
+                }
+                if (count <= 0)
+                {
+                    break;
+                }
+                buffer.append(chunk, static_cast<size_t>(count));
+                continue;
+            }
+
+            const auto line = buffer.substr(0, newline);
+            buffer.erase(0, newline + 1);
+            const auto reply = compare_line(comparator, args, line, ++number,
+                                            load_reference);
+            if (not reply.empty() and not write_all(connection, reply))
+            {
+                break;
+            }
+        }
+        close(connection);
+    }
+
+
+    void serve(const CompareArgs &args)
+    {
+        // A client that goes away is noticed by write() failing instead.
+        std::signal(SIGPIPE, SIG_IGN);
+
+        sockaddr_un address;
+        std::memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (args.serve_.size() >= sizeof(address.sun_path))
+        {
+            throw ServerException("Socket path is too long: " + args.serve_);
+        }
+        std::strcpy(address.sun_path, args.serve_.c_str());
+
+        const auto listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener < 0)
+        {
+            throw ServerException("Failed to create a socket");
+        }
+
+        // A socket left behind by an earlier server is replaced.
+        unlink(address.sun_path);
+        if (bind(listener, reinterpret_cast<const sockaddr *>(&address),
+                 sizeof(address)) != 0 or
+            listen(listener, SOMAXCONN) != 0)
+        {
+            close(listener);
+            throw ServerException("Failed to listen on " + args.serve_ +
+                                  ": " + std::strerror(errno));
+        }
+        if (args.verbose_)
+        {
+            std::cerr << "Listening on " << args.serve_ << "\n";
+        }
+
+        // Clients past the limit wait in the listen queue until another
+        // one is done. The connections use the cache and the limit, so the
+        // server waits for all of them to finish before it gives up.
+        ReferenceCache cache(args.cache_memory_, args.verbose_);
+        ConnectionLimit limit(args.connections_);
+        for (;;)
+        {
+            limit.acquire();
+            const auto connection = accept(listener, nullptr, nullptr);
+            if (connection < 0)
+            {
+                const auto error = errno;
+                limit.release();
+                if (error == EINTR or error == ECONNABORTED)
+                {
+                    continue;
+                }
+
+                // Running out of descriptors or buffers passes as
+                // connections close, so it is waited out.
+                if (error == EMFILE or error == ENFILE or error == ENOBUFS or
+                    error == ENOMEM)
+                {
+                    if (args.verbose_)
+                    {
+                        std::cerr << "Failed to accept: "
+                                  << std::strerror(error) << "\n";
+                    }
+                    std::this_thread::sleep_for(
+                        std::chrono::milliseconds(100));
+                    continue;
+                }
+                close(listener);
+                limit.wait_for_none();
+                throw ServerException(std::string("Failed to accept: ") +
+                                      std::strerror(error));
+            }
+            try
+            {
+                std::thread([connection, &args, &cache, &limit]()
+                            {
+                                serve_connection(connection, args, cache);
+                                limit.release();
+                            }).detach();
+            }
+            catch (const std::system_error &)
+            {
+                // Out of threads for now; the client may try again.
+                close(connection);
+                limit.release();
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            }
+        }
+    }
+#endif
+}
@@ -0,0 +1,65 @@
+/*
+Comparison server
+Copyright (C) 2011-2016 Steven Myint, Jeff Terrace
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef PERCEPTUALDIFF_SERVER_H
+#define PERCEPTUALDIFF_SERVER_H
+
+#include "exceptions.h"
+
+#include <stdexcept>
+#include <string>
+
+
+namespace pdiff
+{
+    class CompareArgs;
+
+
+    // Listens on the Unix domain socket args.serve_ and serves each
+    // connection on its own thread until the client closes it. At most
+    // args.connections_ are served at once, and further clients wait to be
+    // accepted.
+    //
+    // A request is a line in the format of a --batch manifest, and its reply
+    // the line of JSON --batch would print for it. Blank and comment lines
+    // get no reply. Image1 of each request is precomputed and kept, by path,
+    // modification time and the parameters it was precomputed for, so that
+    // later requests against the same reference only decode and process
+    // their own image. The least recently used references are dropped once
+    // they take more than args.cache_memory_ bytes. A file that changes
+    // while it is read is not kept. A request line longer than 64 KiB gets
+    // an error and closes its connection.
+    //
+    // Running out of file descriptors is waited out. Only returns by
+    // throwing, once the connections being served have finished.
+    void serve(const CompareArgs &args);
+
+
+    class ServerException : public virtual PerceptualDiffException
+    {
+    public:
+
+        explicit ServerException(const std::string &message)
+            : std::invalid_argument(message),
+              PerceptualDiffException(message)
+        {
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,140 @@
+/*
+Comparison statistics
+Copyright (C) 2011-2016 Steven Myint, Jeff Terrace
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "stats.h"
+
+#include <algorithm>
+#include <ciso646>
+#include <ostream>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+
+namespace pdiff
+{
+    const char *get_stage_name(const Stage stage)
+    {
+        static const char *const names[STAGE_COUNT] = {
+            "decode", "find_tiles", "convert", "pyramids", "compare", "output"};
+        return names[static_cast<size_t>(stage)];
+    }
+
+
+    double read_process_cpu_seconds()
+    {
+#ifdef _WIN32
+        FILETIME creation, exited, kernel, user;
+        if (not GetProcessTimes(GetCurrentProcess(), &creation, &exited,
+                                &kernel, &user))
+        {
+            return 0.;
+        }
+        const auto ticks = [](const FILETIME &time)
+        {
+            return (static_cast<unsigned long long>(time.dwHighDateTime)
+                    << 32) |
+                   time.dwLowDateTime;
+        };
+        // In units of 100 nanoseconds.
+        return static_cast<double>(ticks(kernel) + ticks(user)) * 1e-7;
+#else
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) != 0)
+        {
+            return 0.;
+        }
+        const auto seconds = [](const timeval &time)
+        {
+            return static_cast<double>(time.tv_sec) +
+                   static_cast<double>(time.tv_usec) * 1e-6;
+        };
+        return seconds(usage.ru_utime) + seconds(usage.ru_stime);
+#endif
+    }
+
+
+    size_t read_peak_rss_bytes()
+    {
+#ifdef _WIN32
+        PROCESS_MEMORY_COUNTERS counters;
+        if (not GetProcessMemoryInfo(GetCurrentProcess(), &counters,
+                                     sizeof(counters)))
+        {
+            return 0;
+        }
+        return counters.PeakWorkingSetSize;
+#else
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) != 0)
+        {
+            return 0;
+        }
+#ifdef __APPLE__
+        return static_cast<size_t>(usage.ru_maxrss);
+#else
+        // In kilobytes.
+        return static_cast<size_t>(usage.ru_maxrss) * 1024;
+#endif
+#endif
+    }
+
+
+    ComparisonStats::ComparisonStats()
+        : threads_(0),
+          pixels_evaluated_(0),
+          pixels_skipped_(0),
+          pixels_failed_(0),
+          peak_rss_bytes_(0)
+    {
+        std::fill(stages_, stages_ + STAGE_COUNT, StageStats{0., 0., 0});
+    }
+
+
+    void ComparisonStats::update_peak_rss()
+    {
+        peak_rss_bytes_ = std::max(peak_rss_bytes_, read_peak_rss_bytes());
+    }
+
+
+    void ComparisonStats::write_json(std::ostream &output) const
+    {
+        output << "{\"stages\": {";
+        for (auto i = size_t(0); i < STAGE_COUNT; i++)
+        {
+            const auto &stage = stages_[i];
+            output << (i > 0 ? ", " : "") << "\""
+                   << get_stage_name(static_cast<Stage>(i))
+                   << "\": {\"wall_seconds\": " << stage.wall_seconds
+                   << ", \"process_cpu_seconds\": "
+                   << stage.process_cpu_seconds
+                   << ", \"workspace_growth_bytes\": "
+                   << stage.workspace_growth_bytes
+                   << "}";
+        }
+        output << "}, \"peak_rss_bytes\": " << peak_rss_bytes_
+               << ", \"threads\": " << threads_
+               << ", \"pixels_evaluated\": " << pixels_evaluated_
+               << ", \"pixels_skipped\": " << pixels_skipped_
+               << ", \"pixels_failed\": " << pixels_failed_ << "}";
+    }
+}
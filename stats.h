@@ -0,0 +1,234 @@
+/*
+Comparison statistics
+Copyright (C) 2011-2016 Steven Myint, Jeff Terrace
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef PERCEPTUALDIFF_STATS_H
+#define PERCEPTUALDIFF_STATS_H
+
+#include "trace.h"
+
+#include <chrono>
+#include <cstddef>
+#include <iosfwd>
+
+
+namespace pdiff
+{
+    // The stages of a comparison that are timed, in the order they run.
+    enum class Stage
+    {
+        // Reading both images, which the caller times.
+        DECODE,
+        // Finding the tiles in which the images differ.
+        FIND_TILES,
+        // Converting pixels to luminance and chroma.
+        CONVERT,
+        // Building the Laplacian pyramids of both images, together.
+        PYRAMIDS,
+        // Testing pixels through the masking model.
+        COMPARE,
+        // Writing the difference outputs, which the caller times.
+        OUTPUT
+    };
+
+    static const size_t STAGE_COUNT = 6;
+
+
+    // Returns the name of a stage as it appears in JSON, such as
+    // "find_tiles".
+    const char *get_stage_name(Stage stage);
+
+
+    // CPU time the whole process has used so far, over all of its threads.
+    double read_process_cpu_seconds();
+
+
+    // The most memory the process has had resident so far, or 0 where the
+    // system does not say.
+    size_t read_peak_rss_bytes();
+
+
+    // What a comparison cost, stage by stage, and how much of the images it
+    // had to evaluate. Stages that run once per region or band add up over
+    // all of them.
+    class ComparisonStats
+    {
+    public:
+
+        ComparisonStats();
+
+        // Wall time of a stage.
+        double get_seconds(const Stage stage) const
+        {
+            return stages_[static_cast<size_t>(stage)].wall_seconds;
+        }
+
+        void add_seconds(const Stage stage, const double seconds)
+        {
+            stages_[static_cast<size_t>(stage)].wall_seconds += seconds;
+        }
+
+        // CPU time of the whole process during a stage, not just of the
+        // comparison. Anything else the process does meanwhile, such as
+        // decoding the next pair of a batch or serving other connections,
+        // is counted too.
+        double get_process_cpu_seconds(const Stage stage) const
+        {
+            return stages_[static_cast<size_t>(stage)].process_cpu_seconds;
+        }
+
+        void add_process_cpu_seconds(const Stage stage,
+                                     const double seconds)
+        {
+            stages_[static_cast<size_t>(stage)].process_cpu_seconds +=
+                seconds;
+        }
+
+        // Bytes the buffers a YeeComparator keeps between comparisons grew
+        // by during a stage. One that compares images no larger than before
+        // grows by none, and decoded images and the temporary buffers of a
+        // stage are not counted.
+        size_t get_workspace_growth_bytes(const Stage stage) const
+        {
+            return stages_[static_cast<size_t>(stage)]
+                .workspace_growth_bytes;
+        }
+
+        void add_workspace_growth_bytes(const Stage stage,
+                                        const size_t bytes)
+        {
+            stages_[static_cast<size_t>(stage)].workspace_growth_bytes +=
+                bytes;
+        }
+
+        // Most threads the comparison could run its parallel work on, or
+        // 0 if an executor decides.
+        unsigned int get_threads() const
+        {
+            return threads_;
+        }
+
+        void set_threads(const unsigned int threads)
+        {
+            threads_ = threads;
+        }
+
+        // Pixels that went through the masking model, and those skipped
+        // because their tiles are identical. A comparison that stops once
+        // enough pixels have failed evaluates only some of the rest.
+        size_t get_pixels_evaluated() const
+        {
+            return pixels_evaluated_;
+        }
+
+        size_t get_pixels_skipped() const
+        {
+            return pixels_skipped_;
+        }
+
+        void add_pixels(const size_t evaluated, const size_t skipped)
+        {
+            pixels_evaluated_ += evaluated;
+            pixels_skipped_ += skipped;
+        }
+
+        // Pixels found to fail, up to where the comparison stopped.
+        size_t get_pixels_failed() const
+        {
+            return pixels_failed_;
+        }
+
+        void add_pixels_failed(const size_t pixels)
+        {
+            pixels_failed_ += pixels;
+        }
+
+        // Peak resident memory of the process when update_peak_rss() was
+        // last called.
+        size_t get_peak_rss_bytes() const
+        {
+            return peak_rss_bytes_;
+        }
+
+        void update_peak_rss();
+
+        // Writes the stats as a JSON object, with an object of the
+        // measurements of each stage under "stages".
+        void write_json(std::ostream &output) const;
+
+    private:
+
+        struct StageStats
+        {
+            double wall_seconds;
+            double process_cpu_seconds;
+            size_t workspace_growth_bytes;
+        };
+
+        StageStats stages_[STAGE_COUNT];
+        unsigned int threads_;
+        size_t pixels_evaluated_;
+        size_t pixels_skipped_;
+        size_t pixels_failed_;
+        size_t peak_rss_bytes_;
+    };
+
+
+    // Adds the wall time and process CPU time from its construction to its
+    // destruction to a stage of stats, unless stats is null, and records the
+    // stage on tracer, unless it is null.
+    class StageTimer
+    {
+    public:
+
+        StageTimer(ComparisonStats *const stats, const Stage stage,
+                   Tracer *const tracer=nullptr)
+            : stats_(stats),
+              stage_(stage),
+              start_(stats ? std::chrono::steady_clock::now()
+                           : std::chrono::steady_clock::time_point()),
+              start_cpu_(stats ? read_process_cpu_seconds() : 0.),
+              trace_(tracer, get_stage_name(stage))
+        {
+        }
+
+        ~StageTimer()
+        {
+            if (stats_)
+            {
+                const std::chrono::duration<double> elapsed =
+                    std::chrono::steady_clock::now() - start_;
+                stats_->add_seconds(stage_, elapsed.count());
+                stats_->add_process_cpu_seconds(
+                    stage_, read_process_cpu_seconds() - start_cpu_);
+            }
+        }
+
+    private:
+
+        StageTimer(const StageTimer &);
+        StageTimer &operator=(const StageTimer &);
+
+        ComparisonStats *const stats_;
+        const Stage stage_;
+        const std::chrono::steady_clock::time_point start_;
+        const double start_cpu_;
+        const TraceScope trace_;
+    };
+}
+
+#endif
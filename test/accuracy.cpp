@@ -0,0 +1,209 @@
+/*
+Accuracy of the approximate comparison modes
+Copyright (C) 2011-2016 Steven Myint, Jeff Terrace
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+// Compares mask_block_fast() against mask_block() over a sweep of adaptation
+// luminances and contrasts, then compares whole images with and without each
+// of --fast-masking and --half-float-pyramid.
+//
+// Usage: pdiff_accuracy [image1 image2]...
+//
+// Exits with a nonzero status if any image pair changes its verdict.
+
+#include "masking.h"
+#include "metric.h"
+#include "rgba_image.h"
+
+#include <algorithm>
+#include <ciso646>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <random>
+
+
+static float relative_error(const float exact, const float fast)
+{
+    if (std::isnan(exact) or std::isnan(fast))
+    {
+        return std::isnan(exact) == std::isnan(fast) ?
+            0.f : std::numeric_limits<float>::infinity();
+    }
+    return std::abs(fast - exact) / std::max(std::abs(exact), 1e-30f);
+}
+
+
+static void sweep_model()
+{
+    using namespace pdiff;
+
+    std::mt19937 generator(1);
+    std::uniform_real_distribution<float> log_contrast(-5.f, 3.f);
+
+    auto max_factor_error = 0.f;
+    auto max_tvi_error = 0.f;
+
+    const size_t widths[] = {64, 640, 1920, 8000};
+    for (const auto width : widths)
+    {
+        const MaskingModel model(45.f, width);
+
+        // Adaptation luminance from 1e-5 to 1e5, log spaced.
+        const auto steps = 4000u;
+        for (auto s = 0u; s < steps; s += MASKING_BLOCK_SIZE)
+        {
+            MaskingBlock exact;
+            for (auto k = 0u; k < MASKING_BLOCK_SIZE; k++)
+            {
+                const auto t = static_cast<float>(s + k) / steps;
+                exact.adapt[k] = std::pow(10.f, -5.f + 10.f * t);
+                for (auto i = 0u; i < MAX_PYR_LEVELS - 2; i++)
+                {
+                    exact.contrast[i][k] =
+                        std::pow(10.f, log_contrast(generator));
+                }
+            }
+
+            auto fast = exact;
+            mask_block(model, exact, MASKING_BLOCK_SIZE);
+            mask_block_fast(model, fast, MASKING_BLOCK_SIZE);
+
+            for (auto k = 0u; k < MASKING_BLOCK_SIZE; k++)
+            {
+                max_factor_error =
+                    std::max(max_factor_error,
+                             relative_error(exact.factor[k], fast.factor[k]));
+                max_tvi_error =
+                    std::max(max_tvi_error,
+                             relative_error(exact.tvi[k], fast.tvi[k]));
+            }
+        }
+    }
+
+    std::cout << "Maximum relative error of factor: " << max_factor_error
+              << "\n";
+    std::cout << "Maximum relative error of tvi: " << max_tvi_error << "\n";
+}
+
+
+// An approximation, and the parameter that turns it on.
+struct Approximation
+{
+    const char *name;
+    bool pdiff::PerceptualDiffParameters::*enabled;
+};
+
+
+static const Approximation approximations[] = {
+    {"fast masking", &pdiff::PerceptualDiffParameters::fast_masking},
+    {"half float pyramid",
+     &pdiff::PerceptualDiffParameters::half_float_pyramid}};
+
+
+// Returns true if the verdict is the same with and without every
+// approximation.
+static bool compare_pair(pdiff::YeeComparator &comparator,
+                         const char *const file_a, const char *const file_b)
+{
+    using namespace pdiff;
+
+    const auto image_a = read_from_file(file_a);
+    const auto image_b = read_from_file(file_b);
+
+    const auto w = image_a->get_width();
+    const auto h = image_a->get_height();
+    if (w != image_b->get_width() or h != image_b->get_height())
+    {
+        std::cout << file_a << " " << file_b
+                  << ": skipped, image dimensions do not match\n";
+        return true;
+    }
+
+    const PerceptualDiffParameters exact_parameters;
+    RGBAImage exact_difference(w, h);
+    auto exact_failed = size_t(0);
+    auto exact_error_sum = 0.f;
+    const auto exact_pass =
+        comparator.compare(*image_a, *image_b, exact_parameters,
+                           &exact_failed, &exact_error_sum, nullptr,
+                           &exact_difference);
+
+    auto same_verdicts = true;
+    for (const auto &approximation : approximations)
+    {
+        auto parameters = exact_parameters;
+        parameters.*approximation.enabled = true;
+
+        RGBAImage difference(w, h);
+        auto failed = size_t(0);
+        auto error_sum = 0.f;
+        const auto pass =
+            comparator.compare(*image_a, *image_b, parameters, &failed,
+                               &error_sum, nullptr, &difference);
+
+        auto flipped = size_t(0);
+        for (auto i = size_t(0); i < static_cast<size_t>(w) * h; i++)
+        {
+            if (exact_difference.get(i) != difference.get(i))
+            {
+                flipped++;
+            }
+        }
+
+        std::cout << file_a << " " << file_b << " with "
+                  << approximation.name << ": " << exact_failed << " / "
+                  << failed << " pixels failed, " << flipped
+                  << " pixels flipped, error sum off by "
+                  << relative_error(exact_error_sum, error_sum);
+        if (exact_pass != pass)
+        {
+            std::cout << ", VERDICT CHANGED";
+            same_verdicts = false;
+        }
+        std::cout << "\n";
+    }
+
+    return same_verdicts;
+}
+
+
+int main(const int argc, char **const argv)
+{
+    try
+    {
+        sweep_model();
+
+        // One comparator serves all pairs, so its buffers are reused
+        // across image sizes.
+        pdiff::YeeComparator comparator;
+        auto status = EXIT_SUCCESS;
+        for (auto i = 1; i + 1 < argc; i += 2)
+        {
+            if (not compare_pair(comparator, argv[i], argv[i + 1]))
+            {
+                status = EXIT_FAILURE;
+            }
+        }
+        return status;
+    }
+    catch (const pdiff::PerceptualDiffException &exception)
+    {
+        std::cerr << exception.what() << "\n";
+        return EXIT_FAILURE;
+    }
+}
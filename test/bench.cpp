@@ -0,0 +1,554 @@
+/*
+Copyright (C) 2011-2016 Steven Myint, Jeff Terrace
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+// Times each stage of comparisons of generated images, from 0.25 to 100
+// megapixels with a controlled density of differences, and of any image
+// pairs given, and writes the median times as JSON. Results can be checked
+// against the JSON of an earlier run.
+//
+// Usage: pdiff_bench [options] [image1 image2]...
+//
+//   --sizes s       Megapixels of the generated images, separated by commas,
+//                   each at least 0.000256 (default: 0.25,1,4,16,100)
+//   --densities d   Fractions of their pixels that differ, separated by
+//                   commas (default: 0.001,0.01,0.1)
+//   --repeat n      Runs of each case, of which the median is reported
+//                   (default: 3)
+//   --threads n     Use at most n threads (default: all)
+//   --output f      Write the JSON to the file f instead of the standard
+//                   output
+//   --baseline f    Compare each stage against the JSON of an earlier run
+//   --tolerance t   How much slower, as a fraction, a stage may get before
+//                   the comparison with the baseline fails (default: 0.1)
+//
+// Generated images are written as PNG files to the current directory for
+// the decode stage, and removed afterwards.
+//
+// Exits with a nonzero status if a stage got slower than the baseline
+// allows.
+
+#include "difference.h"
+#include "image_view.h"
+#include "metric.h"
+#include "rgba_image.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <chrono>
+#include <ciso646>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+
+// Files the benchmark writes, and removes once it is done with them.
+static const char *const GENERATED_A = "pdiff_bench_a.png";
+static const char *const GENERATED_B = "pdiff_bench_b.png";
+static const char *const DIFFERENCE_IMAGE = "pdiff_bench_diff.png";
+static const char *const DIFFERENCE_REGIONS = "pdiff_bench_regions.json";
+
+
+// Stages faster than this are too noisy to hold against a baseline.
+static const auto MIN_COMPARED_SECONDS = 0.005;
+
+
+// Smallest generated image, at least 16x16 pixels so that the squares of
+// differences fit.
+static const auto MIN_MEGAPIXELS = 16. * 16. / 1e6;
+
+
+struct BenchOptions
+{
+    BenchOptions()
+        : sizes{0.25, 1., 4., 16., 100.},
+          densities{0.001, 0.01, 0.1},
+          repeat(3),
+          threads(0),
+          tolerance(0.1)
+    {
+    }
+
+    std::vector<double> sizes;
+    std::vector<double> densities;
+    unsigned int repeat;
+    unsigned int threads;
+    std::string output;
+    std::string baseline;
+    double tolerance;
+    std::vector<std::string> images;
+};
+
+
+// The times and counts of one case.
+struct BenchResult
+{
+    std::string name;
+    unsigned int width;
+    unsigned int height;
+    double seconds;
+    pdiff::ComparisonStats stats;
+};
+
+
+// Parses a number read from where, such as an option. What std::stod() and
+// std::stoi() throw for a bad one is not a PerceptualDiffException, which
+// main() catches, so it is turned into one.
+static double parse_double(const std::string &value, const std::string &where)
+{
+    try
+    {
+        return std::stod(value);
+    }
+    catch (const std::invalid_argument &)
+    {
+    }
+    catch (const std::out_of_range &)
+    {
+    }
+    throw pdiff::PerceptualDiffException("Invalid number for " + where +
+                                         ": " + value);
+}
+
+
+static int parse_int(const std::string &value, const std::string &where)
+{
+    try
+    {
+        return std::stoi(value);
+    }
+    catch (const std::invalid_argument &)
+    {
+    }
+    catch (const std::out_of_range &)
+    {
+    }
+    throw pdiff::PerceptualDiffException("Invalid number for " + where +
+                                         ": " + value);
+}
+
+
+// Parses a list of numbers separated by commas, each at least minimum.
+static std::vector<double> parse_list(const std::string &list,
+                                      const std::string &option,
+                                      const double minimum)
+{
+    std::vector<double> values;
+    std::istringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ','))
+    {
+        const auto value = parse_double(item, option);
+        if (not (value >= minimum))
+        {
+            throw pdiff::PerceptualDiffException("Invalid number for " +
+                                                 option + ": " + item);
+        }
+        values.push_back(value);
+    }
+    return values;
+}
+
+
+static BenchOptions parse_options(const int argc, char **const argv)
+{
+    BenchOptions options;
+    for (auto i = 1; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+        const auto has_value = i + 1 < argc;
+        if (arg == "--sizes" and has_value)
+        {
+            options.sizes = parse_list(argv[++i], arg, MIN_MEGAPIXELS);
+        }
+        else if (arg == "--densities" and has_value)
+        {
+            options.densities = parse_list(argv[++i], arg, 0.);
+        }
+        else if (arg == "--repeat" and has_value)
+        {
+            options.repeat = static_cast<unsigned int>(
+                std::max(parse_int(argv[++i], arg), 1));
+        }
+        else if (arg == "--threads" and has_value)
+        {
+            options.threads = static_cast<unsigned int>(
+                std::max(parse_int(argv[++i], arg), 0));
+        }
+        else if (arg == "--output" and has_value)
+        {
+            options.output = argv[++i];
+        }
+        else if (arg == "--baseline" and has_value)
+        {
+            options.baseline = argv[++i];
+        }
+        else if (arg == "--tolerance" and has_value)
+        {
+            options.tolerance = parse_double(argv[++i], arg);
+        }
+        else if (arg.compare(0, 2, "--") == 0)
+        {
+            throw pdiff::PerceptualDiffException("Unknown option " + arg);
+        }
+        else
+        {
+            options.images.push_back(arg);
+        }
+    }
+    if (options.images.size() % 2 != 0)
+    {
+        throw pdiff::PerceptualDiffException("Images must come in pairs");
+    }
+    return options;
+}
+
+
+// Writes an image of about this many megapixels, 4:3, of gradients with
+// some texture for the masking model to work on, and a copy of it in which
+// 16x16 squares covering about density of the pixels are brighter.
+static void generate_pair(const double megapixels, const double density,
+                          unsigned int &width, unsigned int &height)
+{
+    width = static_cast<unsigned int>(
+        std::max(std::lround(std::sqrt(megapixels * 1e6 * 4. / 3.)), 16L));
+    height = std::max(width * 3 / 4, 16u);
+
+    pdiff::RGBAImage image(width, height);
+    for (auto y = 0u; y < height; y++)
+    {
+        for (auto x = 0u; x < width; x++)
+        {
+            auto hash = x * 374761393u + y * 668265263u;
+            hash = (hash ^ (hash >> 13)) * 1274126177u;
+            const auto texture = (hash >> 24) & 0x1f;
+            image.set(
+                static_cast<unsigned char>(x * 200 / width + texture),
+                static_cast<unsigned char>(y * 200 / height + texture),
+                static_cast<unsigned char>((x + y) * 100 / (width + height) +
+                                           texture),
+                255, static_cast<size_t>(y) * width + x);
+        }
+    }
+    image.write_to_file(GENERATED_A);
+
+    std::mt19937 generator(1);
+    std::uniform_int_distribution<unsigned int> column(0, width - 16);
+    std::uniform_int_distribution<unsigned int> row(0, height - 16);
+    const auto squares = static_cast<size_t>(
+        std::lround(density * width * height / 256.));
+    for (auto i = size_t(0); i < squares; i++)
+    {
+        const auto x0 = column(generator);
+        const auto y0 = row(generator);
+        for (auto y = y0; y < y0 + 16; y++)
+        {
+            for (auto x = x0; x < x0 + 16; x++)
+            {
+                const auto index = static_cast<size_t>(y) * width + x;
+                const auto brighten = [](const unsigned char c)
+                {
+                    return static_cast<unsigned char>(std::min(c + 48, 255));
+                };
+                image.set(brighten(image.get_red(index)),
+                          brighten(image.get_green(index)),
+                          brighten(image.get_blue(index)), 255, index);
+            }
+        }
+    }
+    image.write_to_file(GENERATED_B);
+}
+
+
+static double median(std::vector<double> values)
+{
+    std::sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+
+// Decodes, compares and writes the difference outputs of a pair repeat
+// times. Returns the median wall and process CPU time of each stage, the
+// most bytes the workspace grew by in any run, which is usually the first,
+// and the counts of the last run.
+static BenchResult run_case(pdiff::YeeComparator &comparator,
+                            const std::string &name,
+                            const std::string &file_a,
+                            const std::string &file_b,
+                            const BenchOptions &options)
+{
+    using namespace pdiff;
+
+    BenchResult result;
+    result.name = name;
+
+    std::vector<double> totals;
+    std::vector<std::vector<double>> wall_seconds(STAGE_COUNT);
+    std::vector<std::vector<double>> cpu_seconds(STAGE_COUNT);
+    std::vector<size_t> growth_bytes(STAGE_COUNT);
+    ComparisonStats stats;
+    for (auto run = 0u; run < options.repeat; run++)
+    {
+        stats = ComparisonStats();
+        const auto start = std::chrono::steady_clock::now();
+
+        std::shared_ptr<RGBAImage> image_a;
+        std::shared_ptr<RGBAImage> image_b;
+        {
+            const StageTimer timer(&stats, Stage::DECODE);
+            image_a = read_from_file(file_a);
+            image_b = read_from_file(file_b);
+        }
+        result.width = image_a->get_width();
+        result.height = image_a->get_height();
+
+        PerceptualDiffParameters parameters;
+        parameters.threads = options.threads;
+        parameters.stats = &stats;
+        const DifferenceOutputs outputs(image_b->get_width(),
+                                        image_b->get_height(),
+                                        DIFFERENCE_IMAGE,
+                                        DIFFERENCE_REGIONS, "", 64);
+        // The exact count is asked for, so the comparison does not stop
+        // early.
+        size_t pixels_failed;
+        comparator.compare(ImageView(*image_a), ImageView(*image_b),
+                           parameters, &pixels_failed, nullptr, nullptr,
+                           &outputs.get_view());
+        {
+            const StageTimer timer(&stats, Stage::OUTPUT);
+            outputs.write(Scheduler(options.threads)).get();
+        }
+
+        const std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        totals.push_back(elapsed.count());
+        for (auto i = size_t(0); i < STAGE_COUNT; i++)
+        {
+            const auto stage = static_cast<Stage>(i);
+            wall_seconds[i].push_back(stats.get_seconds(stage));
+            cpu_seconds[i].push_back(stats.get_process_cpu_seconds(stage));
+            growth_bytes[i] = std::max(
+                growth_bytes[i], stats.get_workspace_growth_bytes(stage));
+        }
+    }
+
+    std::remove(DIFFERENCE_IMAGE);
+    std::remove(DIFFERENCE_REGIONS);
+
+    result.seconds = median(totals);
+    result.stats.set_threads(stats.get_threads());
+    result.stats.add_pixels(stats.get_pixels_evaluated(),
+                            stats.get_pixels_skipped());
+    result.stats.add_pixels_failed(stats.get_pixels_failed());
+    result.stats.update_peak_rss();
+    for (auto i = size_t(0); i < STAGE_COUNT; i++)
+    {
+        const auto stage = static_cast<Stage>(i);
+        result.stats.add_seconds(stage, median(wall_seconds[i]));
+        result.stats.add_process_cpu_seconds(stage, median(cpu_seconds[i]));
+        result.stats.add_workspace_growth_bytes(stage, growth_bytes[i]);
+    }
+    return result;
+}
+
+
+static void write_json_string(std::ostream &output, const std::string &value)
+{
+    output << '"';
+    for (const auto c : value)
+    {
+        if (c == '"' or c == '\\')
+        {
+            output << '\\';
+        }
+        output << c;
+    }
+    output << '"';
+}
+
+
+// Writes one case per line, which is what read_baseline() expects.
+static void write_results(std::ostream &output,
+                          const std::vector<BenchResult> &results,
+                          const BenchOptions &options)
+{
+    output.precision(6);
+    output << "{\"repeat\": " << options.repeat
+           << ", \"threads\": " << options.threads << ", \"cases\": [\n";
+    for (auto i = size_t(0); i < results.size(); i++)
+    {
+        const auto &result = results[i];
+        output << "{\"name\": ";
+        write_json_string(output, result.name);
+        output << ", \"width\": " << result.width
+               << ", \"height\": " << result.height
+               << ", \"seconds\": " << result.seconds << ", \"stats\": ";
+        result.stats.write_json(output);
+        output << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    output << "]}\n";
+}
+
+
+// Reads the stage times of each case from the JSON of an earlier run.
+static std::map<std::string, pdiff::ComparisonStats> read_baseline(
+    const std::string &filename)
+{
+    std::ifstream file(filename);
+    if (not file)
+    {
+        throw pdiff::PerceptualDiffException("Failed to open the baseline " +
+                                             filename);
+    }
+
+    std::map<std::string, pdiff::ComparisonStats> baseline;
+    std::string line;
+    const std::string name_key = "{\"name\": \"";
+    while (std::getline(file, line))
+    {
+        if (line.compare(0, name_key.size(), name_key) != 0)
+        {
+            continue;
+        }
+        const auto name_end = line.find('"', name_key.size());
+        auto &stats =
+            baseline[line.substr(name_key.size(),
+                                 name_end - name_key.size())];
+        for (auto i = size_t(0); i < pdiff::STAGE_COUNT; i++)
+        {
+            const auto stage = static_cast<pdiff::Stage>(i);
+            const auto key = "\"" + std::string(get_stage_name(stage)) +
+                             "\": {\"wall_seconds\": ";
+            const auto position = line.find(key);
+            if (position != std::string::npos)
+            {
+                stats.add_seconds(
+                    stage, parse_double(line.substr(position + key.size()),
+                                        "the baseline " + filename));
+            }
+        }
+    }
+    return baseline;
+}
+
+
+// Prints how each stage compares with the baseline. Returns false if one
+// got slower than the tolerance allows.
+static bool check_baseline(const std::vector<BenchResult> &results,
+                           const BenchOptions &options)
+{
+    const auto baseline = read_baseline(options.baseline);
+    auto within = true;
+    for (const auto &result : results)
+    {
+        const auto found = baseline.find(result.name);
+        if (found == baseline.end())
+        {
+            std::cerr << result.name << ": not in the baseline\n";
+            continue;
+        }
+        for (auto i = size_t(0); i < pdiff::STAGE_COUNT; i++)
+        {
+            const auto stage = static_cast<pdiff::Stage>(i);
+            const auto before = found->second.get_seconds(stage);
+            const auto after = result.stats.get_seconds(stage);
+            if (before < MIN_COMPARED_SECONDS and
+                after < MIN_COMPARED_SECONDS)
+            {
+                continue;
+            }
+            const auto slower = after > before * (1. + options.tolerance);
+            std::cerr << result.name << " " << get_stage_name(stage) << ": "
+                      << before << " s -> " << after << " s"
+                      << (slower ? ", SLOWER" : "") << "\n";
+            within = within and not slower;
+        }
+    }
+    return within;
+}
+
+
+int main(const int argc, char **const argv)
+{
+    try
+    {
+        const auto options = parse_options(argc, argv);
+
+        // One comparator serves all cases, as it would a long running
+        // process.
+        pdiff::YeeComparator comparator;
+        std::vector<BenchResult> results;
+        for (const auto megapixels : options.sizes)
+        {
+            for (const auto density : options.densities)
+            {
+                unsigned int width;
+                unsigned int height;
+                generate_pair(megapixels, density, width, height);
+
+                std::ostringstream name;
+                name << "generated " << megapixels << " MP " << density;
+                std::cerr << name.str() << " (" << width << "x" << height
+                          << ")\n";
+                results.push_back(run_case(comparator, name.str(),
+                                           GENERATED_A, GENERATED_B,
+                                           options));
+            }
+        }
+        std::remove(GENERATED_A);
+        std::remove(GENERATED_B);
+
+        for (auto i = size_t(0); i < options.images.size(); i += 2)
+        {
+            const auto name =
+                options.images[i] + " " + options.images[i + 1];
+            std::cerr << name << "\n";
+            results.push_back(run_case(comparator, name, options.images[i],
+                                       options.images[i + 1], options));
+        }
+
+        if (options.output.empty())
+        {
+            write_results(std::cout, results, options);
+        }
+        else
+        {
+            std::ofstream file(options.output);
+            write_results(file, results, options);
+        }
+
+        if (not options.baseline.empty() and
+            not check_baseline(results, options))
+        {
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+    catch (const pdiff::PerceptualDiffException &exception)
+    {
+        std::cerr << exception.what() << "\n";
+        return EXIT_FAILURE;
+    }
+}
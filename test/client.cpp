@@ -0,0 +1,95 @@
+/*
+Client for perceptualdiff --serve
+Copyright (C) 2011-2016 Steven Myint, Jeff Terrace
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+// Sends the requests on standard input to a server one at a time, and
+// prints each reply as it comes.
+//
+// Usage: pdiff_client socket < requests
+
+#include <ciso646>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+
+int main(const int argc, char **const argv)
+{
+    if (argc != 2)
+    {
+        std::cerr << "Usage: pdiff_client socket < requests\n";
+        return EXIT_FAILURE;
+    }
+
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, argv[1], sizeof(address.sun_path) - 1);
+
+    const auto connection = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connection < 0 or
+        connect(connection, reinterpret_cast<const sockaddr *>(&address),
+                sizeof(address)) != 0)
+    {
+        std::cerr << "Failed to connect to " << argv[1] << "\n";
+        return EXIT_FAILURE;
+    }
+
+    std::string request;
+    std::string buffer;
+    while (std::getline(std::cin, request))
+    {
+        // Only requests with a pair get a reply.
+        const auto first = request.find_first_not_of(" \t");
+        if (first == std::string::npos or request[first] == '#')
+        {
+            continue;
+        }
+
+        request += "\n";
+        if (write(connection, request.data(), request.size()) !=
+            static_cast<ssize_t>(request.size()))
+        {
+            std::cerr << "Failed to send the request\n";
+            return EXIT_FAILURE;
+        }
+
+        for (auto newline = buffer.find('\n'); newline == std::string::npos;
+             newline = buffer.find('\n'))
+        {
+            char chunk[4096];
+            const auto count = read(connection, chunk, sizeof(chunk));
+            if (count <= 0)
+            {
+                std::cerr << "The server closed the connection\n";
+                return EXIT_FAILURE;
+            }
+            buffer.append(chunk, static_cast<size_t>(count));
+        }
+        const auto newline = buffer.find('\n');
+        std::cout << buffer.substr(0, newline + 1) << std::flush;
+        buffer.erase(0, newline + 1);
+    }
+
+    close(connection);
+    return EXIT_SUCCESS;
+}
@@ -79,12 +79,51 @@ fi
 rm -f diff.png
 "$pdiff" --output diff.png --verbose fish[12].png 2>&1 | grep -q 'FAIL'
 ls diff.png
-rm -f diff.png
+for format in pam ppm pdraw; do
+    "$pdiff" --output "diff.$format" fish[12].png > /dev/null || true
+    "$pdiff" diff.png "diff.$format"
+    "$pdiff" --down-sample 1 "diff.$format" diff.png
+done
+head -c 20 diff.pdraw > fake.pdraw
+"$pdiff" fish1.png fake.pdraw 2>&1 | grep -q 'Failed to load'
+rm -f diff.png diff.pam diff.ppm diff.pdraw fake.pdraw
 
 head fish1.png > fake.png
 "$pdiff" --verbose fish1.png fake.png 2>&1 | grep -q 'Failed to load'
 rm -f fake.png
 
+rm -f regions.json grid.json
+"$pdiff" --regions regions.json --tile-grid grid.json fish[12].png \
+    2>&1 | grep -q 'Wrote tile grid'
+grep -q '^{"width": 393, "height": 501, "regions": \[{"x": 20, ' regions.json
+grep -q '"pixels": 8857}' regions.json
+grep -q '"tile_size": 64, "failures": \[\[' grid.json
+"$pdiff" --tile-size 0 fish[12].png 2>&1 | grep -q 'Invalid'
+echo 'fish1.png fish2.png --regions regions.json' | "$pdiff" --batch - \
+    | grep -q '"regions": "regions.json"'
+rm -f regions.json grid.json
+
+# Stats are printed as JSON to the standard error.
+"$pdiff" --stats json fish[12].png 2>&1 >/dev/null \
+    | grep -q '"pixels_evaluated": 196893, "pixels_skipped": 0, '
+"$pdiff" --stats json fish[12].png 2>&1 >/dev/null \
+    | grep -q '"process_cpu_seconds": .*"workspace_growth_bytes": '
+"$pdiff" --stats json fish1.png fish1.png 2>&1 \
+    | grep -q '"pixels_evaluated": 0, "pixels_skipped": 196893, '
+"$pdiff" --stats text fish[12].png 2>&1 | grep -q 'Invalid'
+"$pdiff" --serve pdiff.sock --connections 0 2>&1 | grep -q 'Invalid'
+
+rm -f trace.json
+"$pdiff" --trace trace.json fish[12].png | grep -q 'FAIL'
+grep -q '^{"displayTimeUnit": "ms", "traceEvents": \[' trace.json
+grep -q '"name": "pyramids", "cat": "chunk", "ph": "X"' trace.json
+echo 'fish1.png fish2.png' | "$pdiff" --batch - --trace trace.json \
+    | grep -q '"passed": false'
+grep -q '"name": "decode", "cat": "stage", "ph": "X"' trace.json
+echo 'fish1.png fish2.png --trace trace.json' | "$pdiff" --batch - \
+    | grep -q 'can not be used in a manifest'
+rm -f trace.json
+
 mkdir -p unwritable.png
 "$pdiff" --output unwritable.png --verbose fish[12].png 2>&1 | grep -q 'Failed to save'
 rmdir unwritable.png
@@ -95,11 +134,118 @@ rmdir unwritable.png
 "$pdiff" --threshold -3 fish1.png Aqsis_vase.png 2>&1 | grep -q 'Invalid'
 "$pdiff" cam_mb_ref.tif cam_mb.tif --fake-option
 "$pdiff" --verbose --scale fish1.png Aqsis_vase.png 2>&1 | grep -q 'FAIL'
+"$pdiff" fish1.png Aqsis_vase.png | grep -q 'dimensions do not match'
 "$pdiff" --down-sample 2 fish1.png Aqsis_vase.png 2>&1 | grep -q 'FAIL'
+"$pdiff" --down-sample 2 --filter box fish[12].png 2>&1 | grep -q 'FAIL'
+"$pdiff" --filter wrong fish[12].png 2>&1 | grep -q 'Invalid'
 "$pdiff"  /dev/null /dev/null 2>&1 | grep -q 'Unknown filetype'
 "$pdiff" --verbose --sum-errors fish[12].png 2>&1 | grep -q 'sum'
+"$pdiff" --sum-errors fish[12].png | grep -q '^20109 pixels'
+"$pdiff" fish[12].png | grep -q '^At least'
+"$pdiff" --threshold 0 fish[12].png | grep -q '^20109 pixels'
+"$pdiff" --verbose cam_mb_ref.tif cam_mb.tif | grep -q 'tiles that are identical'
 "$pdiff" --color-factor .5 -threshold 1000 --gamma 3 --luminance 90 cam_mb_ref.tif cam_mb.tif
 "$pdiff" --verbose -down-sample 30 -scale --luminance-only --fov 80 cam_mb_ref.tif cam_mb.tif
 "$pdiff" --fov wrong fish1.png fish1.png 2>&1 | grep -q 'Invalid argument'
+"$pdiff" --decimated-pyramid Aqsis_vase.png Aqsis_vase_ref.png 2>&1 | grep -q 'FAIL'
+"$pdiff" --decimated-pyramid Bug1471457_ref.tif Bug1471457.tif
+"$pdiff" --max-memory 5 --verbose fish[12].png 2>&1 | grep -q 'in bands'
+test "$("$pdiff" --sum-errors fish[12].png)" = \
+    "$("$pdiff" --sum-errors --max-memory 5 fish[12].png)"
+"$pdiff" --max-memory 1 fish[12].png 2>&1 | grep -q 'too small'
+"$pdiff" --max-memory -3 fish[12].png 2>&1 | grep -q 'Invalid'
+"$pdiff" --fast-masking fish[12].png 2>&1 | grep -q 'FAIL'
+"$pdiff" --fast-masking Bug1471457_ref.tif Bug1471457.tif
+"$pdiff" --half-float-pyramid fish[12].png 2>&1 | grep -q 'FAIL'
+"$pdiff" --half-float-pyramid Bug1471457_ref.tif Bug1471457.tif
+test "$("$pdiff" --sum-errors --luminance-only fish[12].png)" = \
+    "$("$pdiff" --sum-errors --color-factor 0 fish[12].png)"
+test "$("$pdiff" --sum-errors --threads 1 Bug1102605_ref.tif Bug1102605.tif)" \
+    = "$("$pdiff" --sum-errors --threads 3 Bug1102605_ref.tif Bug1102605.tif)"
+"$pdiff" --threads -2 fish[12].png 2>&1 | grep -q 'Invalid'
+
+printf 'fish1.png fish1.png\n# comment\n\nfish1.png fish2.png --sum-errors\n' \
+    | "$pdiff" --batch - > batch.json || true
+test "$(wc -l < batch.json)" -eq 2
+grep -q '"line": 1, .*"passed": true' batch.json
+grep -q '"line": 4, .*"pixels_failed": 20109' batch.json
+echo 'fish1.png fish1.png' | "$pdiff" --batch -
+echo 'fish1.png missing.png' | "$pdiff" --batch - | grep -q '"error"'
+"$pdiff" --batch - fish1.png 2>&1 | grep -q 'manifest'
+rm -f batch.json
+
+if [ -f "$d/pdiff_client" ]; then
+    rm -f pdiff.sock
+    "$pdiff" --serve pdiff.sock --connections 1 --sum-errors &
+    server=$!
+    trap 'kill "$server"' EXIT
+    for i in $(seq 50); do
+        [ -S pdiff.sock ] && break
+        sleep 0.1
+    done
+    cp fish1.png served.png
+    printf 'served.png fish2.png\n\nserved.png fish2.png\nfish1.png\n' \
+        | "$d/pdiff_client" pdiff.sock > served.json
+    test "$(grep -c '"pixels_failed": 20109' served.json)" -eq 2
+    grep -q '"line": 3, "error"' served.json
+    # References are halved as the images they are compared with.
+    echo 'fish2.png fish1.png --down-sample 1' > halved.txt
+    test "$("$d/pdiff_client" pdiff.sock < halved.txt \
+                | grep -o '"pixels_failed": [0-9]*')" = \
+        "$("$pdiff" --batch halved.txt --sum-errors \
+                | grep -o '"pixels_failed": [0-9]*')"
+    rm -f halved.txt
+    # Requests past the longest line get an error instead.
+    { head -c 70000 /dev/zero | tr '\0' a; echo; } \
+        | "$d/pdiff_client" pdiff.sock | grep -q '"error": "Request is longer'
+    # A changed file is read again.
+    sleep 1
+    cp fish2.png served.png
+    echo 'served.png fish2.png' | "$d/pdiff_client" pdiff.sock \
+        | grep -q 'binary identical'
+    kill "$server"
+    trap - EXIT
+    rm -f pdiff.sock served.png served.json
+fi
+
+rm -f fish1.ref
+"$pdiff" --write-reference fish1.ref fish1.png
+test "$("$pdiff" --sum-errors fish1.png fish2.png)" = \
+    "$("$pdiff" --sum-errors --reference fish1.ref fish2.png)"
+"$pdiff" --reference fish1.ref fish1.png
+"$pdiff" --gamma 2 --reference fish1.ref fish2.png 2>&1 >/dev/null \
+    | grep -q 'precomputed'
+echo '--reference fish1.ref fish2.png --gamma 2' > mismatched.txt
+"$pdiff" --batch mismatched.txt | grep -q '"error": "Reference was'
+rm -f mismatched.txt
+"$pdiff" --reference fish1.png fish2.png 2>&1 | grep -q 'Not a precomputed'
+# Headers with a decimated flag of 2, and with a width and height whose
+# layout overflows.
+cp fish1.ref corrupt.ref
+printf '\002' | dd of=corrupt.ref bs=1 seek=32 conv=notrunc 2>/dev/null
+"$pdiff" --reference corrupt.ref fish2.png 2>&1 | grep -q 'incompatible'
+cp fish1.ref corrupt.ref
+printf '\377\377\377\377\377\377\377\377' |
+    dd of=corrupt.ref bs=1 seek=16 conv=notrunc 2>/dev/null
+"$pdiff" --reference corrupt.ref fish2.png 2>&1 | grep -q 'too large'
+rm -f fish1.ref corrupt.ref
+
+if [ -f "$d/pdiff_accuracy" ]; then
+    "$d/pdiff_accuracy" \
+        Bug1102605_ref.tif Bug1102605.tif \
+        Bug1471457_ref.tif Bug1471457.tif \
+        cam_mb_ref.tif cam_mb.tif \
+        fish2.png fish1.png \
+        Aqsis_vase.png Aqsis_vase_ref.png \
+        alpha1.png alpha2.png
+fi
+
+if [ -f "$d/pdiff_views" ]; then
+    "$d/pdiff_views" \
+        cam_mb_ref.tif cam_mb.tif \
+        fish2.png fish1.png \
+        Aqsis_vase.png Aqsis_vase_ref.png \
+        alpha1.png alpha2.png
+fi
 
 echo -e '\x1b[01;32mOK\x1b[0m'
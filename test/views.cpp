@@ -0,0 +1,302 @@
+/*
+Comparisons of views in each pixel format
+Copyright (C) 2011-2016 Steven Myint, Jeff Terrace
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+// Compares pairs of images as they are loaded from their files, then as
+// views of the same pixels copied into buffers of each format: tightly
+// packed, with padding after each row, and stored bottom up. The difference
+// is written to a view laid out likewise. RGB views are compared with the
+// files made opaque, since they have no alpha.
+//
+// Usage: pdiff_views [image1 image2]...
+//
+// Exits with a nonzero status if a view is compared differently than its
+// file.
+
+#include "image_view.h"
+#include "metric.h"
+#include "rgba_image.h"
+
+#include <ciso646>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+
+// How the pixels of an image are laid out in a buffer, and in what format
+// the difference is written.
+struct Layout
+{
+    const char *name;
+    pdiff::PixelFormat format;
+    pdiff::PixelFormat difference_format;
+    size_t padding;
+    bool bottom_up;
+};
+
+
+// The layouts each pair is copied into. The difference of the last is
+// written as gray.
+static const Layout layouts[] = {
+    {"RGBA", pdiff::PixelFormat::RGBA, pdiff::PixelFormat::RGBA, 0, false},
+    {"BGRA", pdiff::PixelFormat::BGRA, pdiff::PixelFormat::BGRA, 0, false},
+    {"padded RGBA", pdiff::PixelFormat::RGBA, pdiff::PixelFormat::RGBA, 12,
+     false},
+    {"bottom up BGRA", pdiff::PixelFormat::BGRA, pdiff::PixelFormat::BGRA, 0,
+     true},
+    {"RGB", pdiff::PixelFormat::RGB, pdiff::PixelFormat::RGB, 0, false},
+    {"padded bottom up RGB to GRAY", pdiff::PixelFormat::RGB,
+     pdiff::PixelFormat::GRAY, 5, true}};
+
+
+// Pixels in a buffer of their own, and where the view of them starts.
+struct Buffer
+{
+    std::vector<unsigned char> bytes;
+    unsigned char *top;
+    ptrdiff_t stride;
+};
+
+
+// Returns a buffer of the size of an image laid out in format, padding and
+// bottom_up, filled with zeros.
+static Buffer make_buffer(const unsigned int width, const unsigned int height,
+                          const pdiff::PixelFormat format,
+                          const size_t padding, const bool bottom_up)
+{
+    const auto row_bytes = width * pdiff::pixel_size(format) + padding;
+    Buffer buffer;
+    buffer.bytes.resize(row_bytes * height);
+    buffer.top = buffer.bytes.data();
+    buffer.stride = static_cast<ptrdiff_t>(row_bytes);
+    if (bottom_up)
+    {
+        buffer.top += row_bytes * (height - 1);
+        buffer.stride = -buffer.stride;
+    }
+    return buffer;
+}
+
+
+// Returns the pixels of an image in a buffer laid out as layout says.
+static Buffer copy_pixels(const pdiff::RGBAImage &image, const Layout &layout)
+{
+    using pdiff::PixelFormat;
+
+    const auto w = image.get_width();
+    const auto h = image.get_height();
+    auto buffer =
+        make_buffer(w, h, layout.format, layout.padding, layout.bottom_up);
+    const auto size = pdiff::pixel_size(layout.format);
+
+    // Where red and blue are in the image's pixels, and in the buffer's.
+    const auto native_red =
+        pdiff::get_rgba_image_format() == PixelFormat::RGBA ? 0 : 2;
+    const auto red = layout.format == PixelFormat::BGRA ? 2 : 0;
+
+    auto source = reinterpret_cast<const unsigned char *>(image.get_data());
+    for (auto y = 0u; y < h; y++)
+    {
+        auto pixel = buffer.top + static_cast<ptrdiff_t>(y) * buffer.stride;
+        for (auto x = 0u; x < w; x++, pixel += size, source += 4)
+        {
+            pixel[red] = source[native_red];
+            pixel[1] = source[1];
+            pixel[2 - red] = source[2 - native_red];
+            if (size == 4)
+            {
+                pixel[3] = source[3];
+            }
+        }
+    }
+    return buffer;
+}
+
+
+// Returns true if pixel (x, y) of a difference view is marked as failed,
+// which is red, or any gray.
+static bool failed(const unsigned char *const top, const ptrdiff_t stride,
+                   const pdiff::PixelFormat format, const unsigned int x,
+                   const unsigned int y)
+{
+    const auto pixel = top + static_cast<ptrdiff_t>(y) * stride +
+                       x * pdiff::pixel_size(format);
+    return pixel[format == pdiff::PixelFormat::BGRA ? 2 : 0] != 0;
+}
+
+
+// Returns a copy of an image with every pixel opaque, which is how RGB
+// views of it are read.
+static std::shared_ptr<pdiff::RGBAImage> make_opaque(
+    const pdiff::RGBAImage &image)
+{
+    const auto w = image.get_width();
+    const auto h = image.get_height();
+    const auto opaque = std::make_shared<pdiff::RGBAImage>(w, h);
+    const auto bytes = static_cast<size_t>(w) * h * 4;
+    std::memcpy(opaque->get_data(), image.get_data(), bytes);
+    const auto pixels = reinterpret_cast<unsigned char *>(opaque->get_data());
+    for (auto i = size_t(3); i < bytes; i += 4)
+    {
+        pixels[i] = 255;
+    }
+    return opaque;
+}
+
+
+// How a pair of files compares, with the difference in RGBAImage's format.
+struct FileComparison
+{
+    size_t failed;
+    float error_sum;
+    Buffer difference;
+};
+
+
+static FileComparison compare_files(pdiff::YeeComparator &comparator,
+                                    const pdiff::RGBAImage &image_a,
+                                    const pdiff::RGBAImage &image_b)
+{
+    const auto w = image_a.get_width();
+    const auto h = image_a.get_height();
+    const auto format = pdiff::get_rgba_image_format();
+    FileComparison comparison = {0, 0.f, make_buffer(w, h, format, 0, false)};
+    const pdiff::MutableImageView difference_view(
+        comparison.difference.top, w, h, comparison.difference.stride,
+        format);
+    comparator.compare(pdiff::ImageView(image_a), pdiff::ImageView(image_b),
+                       pdiff::PerceptualDiffParameters(), &comparison.failed,
+                       &comparison.error_sum, nullptr, &difference_view);
+    return comparison;
+}
+
+
+// Returns true if the views of a pair in each layout are compared the same
+// as the pair. RGB views drop alpha, so they are held against the pair made
+// opaque.
+static bool compare_pair(pdiff::YeeComparator &comparator,
+                         const char *const file_a, const char *const file_b)
+{
+    using namespace pdiff;
+
+    const auto image_a = read_from_file(file_a);
+    const auto image_b = read_from_file(file_b);
+    const auto w = image_a->get_width();
+    const auto h = image_a->get_height();
+    if (w != image_b->get_width() or h != image_b->get_height())
+    {
+        std::cout << file_a << " " << file_b
+                  << ": skipped, image dimensions do not match\n";
+        return true;
+    }
+
+    const auto opaque_a = make_opaque(*image_a);
+    const auto opaque_b = make_opaque(*image_b);
+    const auto native_format = get_rgba_image_format();
+    const FileComparison files[] = {
+        compare_files(comparator, *image_a, *image_b),
+        compare_files(comparator, *opaque_a, *opaque_b)};
+
+    const PerceptualDiffParameters parameters;
+    auto same = true;
+    for (const auto &layout : layouts)
+    {
+        const auto opaque = layout.format == PixelFormat::RGB;
+        const auto &file = files[opaque ? 1 : 0];
+        const auto &file_b_image = opaque ? *opaque_b : *image_b;
+
+        const auto pixels_a = copy_pixels(*image_a, layout);
+        const auto pixels_b = copy_pixels(*image_b, layout);
+        const ImageView view_a(pixels_a.top, w, h, pixels_a.stride,
+                               layout.format);
+        const ImageView view_b(pixels_b.top, w, h, pixels_b.stride,
+                               layout.format);
+        auto difference = make_buffer(w, h, layout.difference_format,
+                                      layout.padding, layout.bottom_up);
+        const MutableImageView difference_view(difference.top, w, h,
+                                               difference.stride,
+                                               layout.difference_format);
+        auto failed_count = size_t(0);
+        auto error_sum = 0.f;
+        comparator.compare(view_a, view_b, parameters, &failed_count,
+                           &error_sum, nullptr, &difference_view);
+
+        // A view against the file in the other argument.
+        auto mixed_failed = size_t(0);
+        auto mixed_error_sum = 0.f;
+        comparator.compare(view_a, ImageView(file_b_image), parameters,
+                           &mixed_failed, &mixed_error_sum, nullptr, nullptr);
+
+        auto same_failures = true;
+        for (auto y = 0u; y < h; y++)
+        {
+            for (auto x = 0u; x < w; x++)
+            {
+                if (failed(file.difference.top, file.difference.stride,
+                           native_format, x, y) !=
+                    failed(difference.top, difference.stride,
+                           layout.difference_format, x, y))
+                {
+                    same_failures = false;
+                }
+            }
+        }
+
+        const auto matches =
+            failed_count == file.failed and error_sum == file.error_sum and
+            mixed_failed == file.failed and
+            mixed_error_sum == file.error_sum and same_failures;
+        std::cout << file_a << " " << file_b << " as " << layout.name
+                  << ": " << file.failed << " / " << failed_count << " / "
+                  << mixed_failed << " pixels failed, error sum "
+                  << file.error_sum << " / " << error_sum << " / "
+                  << mixed_error_sum;
+        if (not matches)
+        {
+            std::cout << ", DIFFERENT";
+            same = false;
+        }
+        std::cout << "\n";
+    }
+    return same;
+}
+
+
+int main(const int argc, char **const argv)
+{
+    try
+    {
+        pdiff::YeeComparator comparator;
+        auto status = EXIT_SUCCESS;
+        for (auto i = 1; i + 1 < argc; i += 2)
+        {
+            if (not compare_pair(comparator, argv[i], argv[i + 1]))
+            {
+                status = EXIT_FAILURE;
+            }
+        }
+        return status;
+    }
+    catch (const pdiff::PerceptualDiffException &exception)
+    {
+        std::cerr << exception.what() << "\n";
+        return EXIT_FAILURE;
+    }
+}
@@ -0,0 +1,160 @@
+/*
+Comparison tracing
+Copyright (C) 2011-2016 Steven Myint, Jeff Terrace
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "trace.h"
+
+#include <algorithm>
+#include <ciso646>
+#include <fstream>
+#include <ostream>
+#include <sstream>
+
+
+namespace pdiff
+{
+    // The stage of the innermost TraceScope on each thread, or null.
+    static thread_local const char *traced_stage = nullptr;
+
+
+    const char *get_traced_stage()
+    {
+        return traced_stage ? traced_stage : "parallel_for";
+    }
+
+
+    Tracer::Tracer()
+        : origin_(Clock::now())
+    {
+    }
+
+
+    void Tracer::add_stage(const char *const stage,
+                           const Clock::time_point start)
+    {
+        add_span(stage, false, start, 0, 0);
+    }
+
+
+    void Tracer::add_chunk(const char *const stage,
+                           const Clock::time_point start, const size_t begin,
+                           const size_t end)
+    {
+        add_span(stage, true, start, begin, end);
+    }
+
+
+    void Tracer::add_span(const char *const name, const bool chunk,
+                          const Clock::time_point start, const size_t begin,
+                          const size_t end)
+    {
+        const auto stop = Clock::now();
+        const std::chrono::duration<double, std::micro> offset =
+            start - origin_;
+        const std::chrono::duration<double, std::micro> duration =
+            stop - start;
+
+        const std::lock_guard<std::mutex> lock(mutex_);
+        const auto thread = threads_.insert(std::make_pair(
+            std::this_thread::get_id(),
+            static_cast<unsigned int>(threads_.size())));
+        spans_.push_back(Span{name, chunk, thread.first->second,
+                              offset.count(), duration.count(), begin, end});
+    }
+
+
+    void Tracer::write_json(std::ostream &output) const
+    {
+        const std::lock_guard<std::mutex> lock(mutex_);
+
+        // Viewers nest spans of a thread by their start, so outer stages
+        // come before the chunks they contain.
+        auto spans = spans_;
+        std::stable_sort(spans.begin(), spans.end(),
+                         [](const Span &a, const Span &b)
+                         {
+                             return a.start < b.start or
+                                    (a.start == b.start and
+                                     a.duration > b.duration);
+                         });
+
+        // Times to the nanosecond.
+        std::ostringstream json;
+        json << std::fixed;
+        json.precision(3);
+
+        json << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+        for (auto i = 0u; i < threads_.size(); i++)
+        {
+            json << (i > 0 ? ",\n" : "\n")
+                 << "{\"name\": \"thread_name\", \"ph\": \"M\", "
+                 << "\"pid\": 1, \"tid\": " << i
+                 << ", \"args\": {\"name\": \"thread " << i << "\"}}";
+        }
+        for (const auto &span : spans)
+        {
+            json << ",\n{\"name\": \"" << span.name << "\", \"cat\": \""
+                 << (span.chunk ? "chunk" : "stage")
+                 << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": "
+                 << span.thread << ", \"ts\": " << span.start
+                 << ", \"dur\": " << span.duration;
+            if (span.chunk)
+            {
+                json << ", \"args\": {\"begin\": " << span.begin
+                     << ", \"end\": " << span.end << "}";
+            }
+            json << "}";
+        }
+        json << "\n]}\n";
+        output << json.str();
+    }
+
+
+    void Tracer::write_to_file(const std::string &filename) const
+    {
+        std::ofstream file(filename);
+        write_json(file);
+        file.close();
+        if (not file)
+        {
+            throw TraceException("Failed to save the trace to " + filename);
+        }
+    }
+
+
+    TraceScope::TraceScope(Tracer *const tracer, const char *const stage)
+        : tracer_(tracer),
+          stage_(stage),
+          outer_stage_(traced_stage),
+          start_(tracer ? Tracer::Clock::now() : Tracer::Clock::time_point())
+    {
+        if (tracer_)
+        {
+            traced_stage = stage_;
+        }
+    }
+
+
+    TraceScope::~TraceScope()
+    {
+        if (tracer_)
+        {
+            tracer_->add_stage(stage_, start_);
+            traced_stage = outer_stage_;
+        }
+    }
+}
@@ -0,0 +1,132 @@
+/*
+Comparison tracing
+Copyright (C) 2011-2016 Steven Myint, Jeff Terrace
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef PERCEPTUALDIFF_TRACE_H
+#define PERCEPTUALDIFF_TRACE_H
+
+#include "exceptions.h"
+
+#include <chrono>
+#include <cstddef>
+#include <iosfwd>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+namespace pdiff
+{
+    // Records when each thread works on each stage of comparisons, and on
+    // each range of their parallel loops, as a timeline in the Chrome trace
+    // event format that Perfetto and chrome://tracing load. Any number of
+    // threads can record at once.
+    class Tracer
+    {
+    public:
+
+        typedef std::chrono::steady_clock Clock;
+
+        Tracer();
+
+        // Records that the calling thread worked on a stage from start until
+        // now.
+        void add_stage(const char *stage, Clock::time_point start);
+
+        // Records that the calling thread ran iterations [begin, end) of a
+        // parallel loop started in a stage from start until now.
+        void add_chunk(const char *stage, Clock::time_point start,
+                       size_t begin, size_t end);
+
+        // Writes the timeline as a JSON object, with a name for each thread
+        // that recorded spans. Threads are numbered in the order they first
+        // recorded.
+        void write_json(std::ostream &output) const;
+
+        void write_to_file(const std::string &filename) const;
+
+    private:
+
+        Tracer(const Tracer &);
+        Tracer &operator=(const Tracer &);
+
+        // Times are in microseconds since the tracer was made. Stages have
+        // no range.
+        struct Span
+        {
+            const char *name;
+            bool chunk;
+            unsigned int thread;
+            double start;
+            double duration;
+            size_t begin;
+            size_t end;
+        };
+
+        void add_span(const char *name, bool chunk, Clock::time_point start,
+                      size_t begin, size_t end);
+
+        const Clock::time_point origin_;
+        mutable std::mutex mutex_;
+        std::vector<Span> spans_;
+        std::map<std::thread::id, unsigned int> threads_;
+    };
+
+
+    // Records a stage of the calling thread from its construction to its
+    // destruction, unless tracer is null. Parallel loops started meanwhile
+    // on the thread name their ranges after the stage.
+    class TraceScope
+    {
+    public:
+
+        TraceScope(Tracer *tracer, const char *stage);
+
+        ~TraceScope();
+
+    private:
+
+        TraceScope(const TraceScope &);
+        TraceScope &operator=(const TraceScope &);
+
+        Tracer *const tracer_;
+        const char *const stage_;
+        const char *const outer_stage_;
+        const Tracer::Clock::time_point start_;
+    };
+
+
+    // Returns the innermost stage being traced on the calling thread, or
+    // "parallel_for" outside of any.
+    const char *get_traced_stage();
+
+
+    class TraceException : public virtual PerceptualDiffException
+    {
+    public:
+
+        explicit TraceException(const std::string &message)
+            : std::invalid_argument(message),
+              PerceptualDiffException(message)
+        {
+        }
+    };
+}
+
+#endif